@@ -5,21 +5,55 @@
 #include <memory>
 #include <atomic>
 #include <algorithm>
+#include <bit>
 #include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <cassert>
 #include <array>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <system_error>
 #include <list>
+#include <deque>
 #include <vector>
 #include <type_traits>
+#include <condition_variable>
+#include <chrono>
+#include <fstream>
 #include <experimental/optional>
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 #include <boost/sync/mutexes.hpp>
 
 class unit_test_internals_view;
 
 namespace std {
+    // placement_policy selects where the pages of the bucket and lock arrays
+    // go on machines with several NUMA nodes:
+    //  - local: wherever the thread that first writes them runs, which for a
+    //    freshly constructed table is the constructing thread.
+    //  - parallel_first_touch: the buckets are initialized by the worker pool,
+    //    so their pages spread over the nodes the workers run on.
+    //  - interleave: the pages are spread round-robin over all online nodes.
+    // Lock arrays, which every thread touches evenly, are interleaved under
+    // both of the latter. On single-node machines all three are the same.
+    // Only arrays from an allocator that maps each block itself, like
+    // mmap_allocator and huge_page_allocator, are interleaved, since the
+    // memory policy would stay on heap pages after the table frees them;
+    // with other allocators interleave places the buckets like local.
+    enum class placement_policy {
+        local,
+        parallel_first_touch,
+        interleave
+    };
+
     namespace private_impl {
         static constexpr const std::size_t DEFAULT_SLOTS_PER_BUCKET = 4;
         static constexpr const std::size_t DEFAULT_SIZE = (1U << 16) * DEFAULT_SLOTS_PER_BUCKET;
@@ -27,6 +61,48 @@ namespace std {
         static constexpr const double DEFAULT_MINIMUM_LOAD_FACTOR = 0.05;
         static constexpr const std::size_t NO_MAXIMUM_HASHPOWER = std::numeric_limits<size_t>::max();
         static constexpr const std::size_t MAX_NUM_LOCKS = 1UL << 16;
+        // The number of keys the overflow stash can hold before a failed cuckoo
+        // search forces the table to be doubled.
+        static constexpr const std::size_t STASH_SLOTS = 8;
+        static constexpr const std::size_t NO_MAXIMUM_DISPLACEMENT_WORK =
+            std::numeric_limits<size_t>::max();
+        // The smallest number of buckets the worker pool hands out at once, and
+        // how many chunks each worker gets on average. Smaller ranges are
+        // processed on the calling thread.
+        static constexpr const std::size_t MIN_PARALLEL_CHUNK = 1024;
+        static constexpr const std::size_t PARALLEL_CHUNKS_PER_WORKER = 8;
+        // Retired bucket arrays of at least this many buckets are freed on a
+        // helper thread rather than by the next resize.
+        static constexpr const std::size_t BACKGROUND_RECLAIM_BUCKETS = std::size_t(1) << 16;
+        // How long the helper thread waits for the readers that may still see
+        // the retired memory, in steps of RECLAIM_RETRY_INTERVAL, before it
+        // leaves the rest to later resizes.
+        static constexpr const std::size_t RECLAIM_RETRIES = 100;
+        static constexpr const std::chrono::milliseconds RECLAIM_RETRY_INTERVAL{1};
+        // Bucket arrays summarize which buckets hold elements in blocks of this
+        // many buckets, so that scans skip an empty block at once.
+        static constexpr const std::size_t OCCUPANCY_BLOCK = 512;
+        // Range constructors share the first buckets out among the workers in
+        // groups of this many buckets.
+        static constexpr const std::size_t BULK_LOAD_GROUP = 64;
+        // The table is halved automatically once its load factor is found below
+        // the shrink load factor twice in a row. A shrink load factor of 0 turns
+        // this off, and it cannot exceed 0.25, so that a halved table is never
+        // more than half full.
+        static constexpr const double NO_AUTOMATIC_SHRINK = 0.0;
+        static constexpr const double MAXIMUM_SHRINK_LOAD_FACTOR = 0.25;
+        // The table is expanded ahead of time once its load factor exceeds the
+        // maximum load factor; 0 leaves expansion to the inserts that find the
+        // table full. Each expansion adds the growth power to the hashpower.
+        static constexpr const double NO_MAXIMUM_LOAD_FACTOR = 0.0;
+        static constexpr const std::size_t DEFAULT_GROWTH_POWER = 1;
+        // Each thread checks the load factor against the shrink and maximum
+        // load factors every LOAD_FACTOR_CHECK_INTERVAL erases and inserts.
+        static constexpr const std::size_t LOAD_FACTOR_CHECK_INTERVAL = 1024;
+        // How often the maintenance thread looks at the table by default.
+        static constexpr const std::chrono::milliseconds DEFAULT_MAINTENANCE_INTERVAL{10};
+        // How many lock stripes the maintenance thread compacts per look.
+        static constexpr const std::size_t COMPACTION_STRIPES_PER_LOOK = 1024;
 
 
         using size_type = std::size_t;
@@ -50,6 +126,140 @@ namespace std {
         void swap_allocator(Allocator& dst, Allocator& src, std::false_type) {
         }
 
+        // has_allocate_zeroed tells whether an allocator can hand out zero-filled
+        // memory with an allocate_zeroed(count) member, which takes the place of
+        // allocate and is freed with deallocate.
+        template <typename Allocator, typename = void>
+        struct has_allocate_zeroed : std::false_type {};
+
+        template <typename Allocator>
+        struct has_allocate_zeroed<Allocator,
+                                   decltype(void(std::declval<Allocator&>().allocate_zeroed(
+                                           std::size_t())))> : std::true_type {};
+
+        // can_reallocate tells whether an allocator can grow a block in place
+        // with a reallocate(pointer, old_count, new_count) member, like
+        // mmap_allocator does.
+        template <typename Allocator, typename = void>
+        struct can_reallocate : std::false_type {};
+
+        template <typename Allocator>
+        struct can_reallocate<Allocator,
+                              decltype(void(std::declval<Allocator&>().reallocate(
+                                  std::declval<typename Allocator::value_type*>(),
+                                  std::size_t(), std::size_t())))>
+            : std::true_type {};
+
+        // allows_concurrent_use tells whether internal work split among the
+        // worker pool may construct and destroy elements through one allocator
+        // object from several threads at once. Allocators do not promise that
+        // in general; stateless ones are taken to, since whatever state they
+        // use is global anyway.
+        template <typename Allocator>
+        using allows_concurrent_use =
+                typename std::allocator_traits<Allocator>::is_always_equal;
+
+        // The page size huge_page_allocator aims for: 2 MB, the smallest huge
+        // page on x86-64 and on arm64 with 4 KB base pages.
+        static constexpr const std::size_t HUGE_PAGE_SIZE = std::size_t(1) << 21;
+
+        // online_numa_nodes returns the mask of online NUMA nodes, or 0 if there
+        // is only one, more than fit in the mask, or they cannot be found out.
+        inline unsigned long online_numa_nodes() {
+            static const unsigned long nodes = [] {
+                unsigned long mask = 0;
+#if defined(__linux__)
+                // The file lists node ranges, like "0-1,4".
+                std::ifstream online("/sys/devices/system/node/online");
+                std::string ranges;
+                if (!(online >> ranges)) {
+                    return 0UL;
+                }
+                std::size_t pos = 0;
+                while (pos < ranges.size()) {
+                    std::size_t next = ranges.find(',', pos);
+                    if (next == std::string::npos) {
+                        next = ranges.size();
+                    }
+                    const std::string range = ranges.substr(pos, next - pos);
+                    const char* digits = range.c_str();
+                    char* rest;
+                    const unsigned long first = std::strtoul(digits, &rest, 10);
+                    if (rest == digits) {
+                        return 0UL;
+                    }
+                    unsigned long last = first;
+                    if (*rest == '-') {
+                        digits = rest + 1;
+                        last = std::strtoul(digits, &rest, 10);
+                        if (rest == digits) {
+                            return 0UL;
+                        }
+                    }
+                    if (*rest != '\0' || last < first || last >= sizeof(mask) * 8) {
+                        return 0UL;
+                    }
+                    for (unsigned long node = first; node <= last; ++node) {
+                        mask |= 1UL << node;
+                    }
+                    pos = next + 1;
+                }
+#endif
+                return (mask & (mask - 1)) == 0 ? 0UL : mask;
+            }();
+            return nodes;
+        }
+
+        // maps_own_pages tells whether every block an allocator hands out is a
+        // memory mapping of its own, which deallocate unmaps. Allocators say so
+        // with a maps_own_pages member type, like mmap_allocator does.
+        template <typename Allocator, typename = void>
+        struct maps_own_pages : std::false_type {};
+
+        template <typename Allocator>
+        struct maps_own_pages<Allocator, decltype(void(typename Allocator::maps_own_pages()))>
+            : std::integral_constant<bool, Allocator::maps_own_pages::value> {};
+
+        // interleave_pages spreads the whole pages of [p, p + bytes) round-robin
+        // over the online NUMA nodes, moving those that are already in use.
+        // It is best effort, and does nothing where there is a single node or no
+        // mbind(2). The memory policy stays with the pages, so only blocks from
+        // an allocator that maps its own pages are interleaved: heap pages
+        // outlive the table, and whatever reuses them would inherit it.
+        template <typename Allocator>
+        void interleave_pages(void* p, std::size_t bytes) {
+#if defined(__linux__) && defined(SYS_mbind)
+            if (!maps_own_pages<Allocator>::value) {
+                return;
+            }
+            const unsigned long nodes = online_numa_nodes();
+            if (nodes == 0 || bytes == 0) {
+                return;
+            }
+            // From <numaif.h>, which needs libnuma.
+            static constexpr int MPOL_INTERLEAVE_MODE = 3;
+            static constexpr unsigned MPOL_MF_MOVE_FLAG = 1U << 1;
+            const std::uintptr_t page = static_cast<std::uintptr_t>(::sysconf(_SC_PAGESIZE));
+            const std::uintptr_t begin =
+                (reinterpret_cast<std::uintptr_t>(p) + page - 1) / page * page;
+            const std::uintptr_t end = (reinterpret_cast<std::uintptr_t>(p) + bytes) / page * page;
+            if (end <= begin) {
+                return;
+            }
+            ::syscall(SYS_mbind, begin, end - begin, MPOL_INTERLEAVE_MODE, &nodes,
+                      sizeof(nodes) * 8 + 1, MPOL_MF_MOVE_FLAG);
+#else
+            (void)p;
+            (void)bytes;
+#endif
+        }
+
+        // parallel_for calls func(chunk_start, chunk_end) over chunks covering
+        // [start, end) on the worker pool, which is defined further down, and
+        // rethrows the first exception func threw once the range is done.
+        inline void parallel_for(std::size_t start, std::size_t end,
+                                 const std::function<void(std::size_t, std::size_t)>& func);
+
         template <class Key, class Value, class Allocator, class PartialKey,
                   std::size_t SLOTS_PER_BUCKET>
         class bucket_container {
@@ -114,6 +324,15 @@ namespace std {
                     return occupied_flags[index];
                 }
 
+                bool empty() const {
+                    for (const bool flag : occupied_flags) {
+                        if (flag) {
+                            return false;
+                        }
+                    }
+                    return true;
+                }
+
             private:
                 std::array<typename std::aligned_storage<sizeof(storage_value_type),
                            alignof(storage_value_type)>::type, SLOTS_PER_BUCKET> values;
@@ -121,17 +340,40 @@ namespace std {
                 std::array<bool, SLOTS_PER_BUCKET> occupied_flags;
             };
 
-            bucket_container(size_type hashpower, const allocator_type& allocator)
+            using bucket_allocator_type = typename traits::template rebind_alloc<bucket>;
+
+        private:
+            // The occupancy summary has, for every block of OCCUPANCY_BLOCK
+            // buckets, a word counting its non-empty buckets, followed by a bit
+            // per bucket that is set while the bucket holds an element. The
+            // words are shared by buckets of different stripes, so they are
+            // updated atomically; whoever scans the summary holds all the locks.
+            using occupancy_word = std::atomic<uint64_t>;
+            using occupancy_allocator_type = typename traits::template rebind_alloc<occupancy_word>;
+            using occupancy_traits = std::allocator_traits<occupancy_allocator_type>;
+            static constexpr size_type OCCUPANCY_BITS = 64;
+            static constexpr size_type OCCUPANCY_BLOCK_WORDS =
+                1 + private_impl::OCCUPANCY_BLOCK / OCCUPANCY_BITS;
+
+        public:
+            bucket_container(size_type hashpower, const allocator_type& allocator,
+                             const placement_policy placement = placement_policy::local)
                 : allocator(allocator),
                   bucket_allocator(allocator),
+                  placement(placement),
                   hashpower_holder(hashpower),
-                  buckets(bucket_allocator.allocate(size())) {
+                  buckets(allocate_buckets(size())),
+                  occupancy(nullptr) {
                 static_assert(std::is_nothrow_constructible<bucket>::value,
                               "bucket_container requires bucket to be nothrow "
                               "constructible");
-                for (size_type i = 0; i < size(); ++i) {
-                    traits::construct(this->allocator, &buckets[i]);
+                try {
+                    occupancy = allocate_occupancy(size());
+                } catch (...) {
+                    bucket_allocator.deallocate(buckets, size());
+                    throw;
                 }
+                construct_buckets(0, size());
             }
 
             ~bucket_container() noexcept { destroy_buckets(); }
@@ -139,28 +381,43 @@ namespace std {
             bucket_container(const bucket_container& other)
                 : allocator(traits::select_on_container_copy_construction(other.allocator)),
                   bucket_allocator(allocator),
+                  placement(other.placement),
                   hashpower_holder(other.hashpower()),
-                  buckets(transfer(other.hashpower(), other, std::false_type())) {}
+                  buckets(nullptr),
+                  occupancy(nullptr) {
+                bucket_container copy = transfer(other.hashpower(), other, std::false_type());
+                take_arrays(copy);
+            }
 
             bucket_container(const bucket_container& other,
                              const allocator_type& allocator)
                 : allocator(allocator),
                   bucket_allocator(allocator),
+                  placement(other.placement),
                   hashpower_holder(other.hashpower()),
-                  buckets(transfer(other.hashpower(), other, std::false_type())) {}
+                  buckets(nullptr),
+                  occupancy(nullptr) {
+                bucket_container copy = transfer(other.hashpower(), other, std::false_type());
+                take_arrays(copy);
+            }
 
             bucket_container(bucket_container&& other)
                 : allocator(std::move(other.allocator))
                 , bucket_allocator(allocator)
+                , placement(other.placement)
                 , hashpower_holder(other.hashpower())
-                , buckets(std::move(other.buckets)) {
-                other.buckets = nullptr;
+                , buckets(nullptr)
+                , occupancy(nullptr) {
+                take_arrays(other);
             }
 
             bucket_container(bucket_container&& other,
                              const allocator_type& allocator)
                 : allocator(allocator)
-                , bucket_allocator(allocator) {
+                , bucket_allocator(allocator)
+                , placement(other.placement)
+                , buckets(nullptr)
+                , occupancy(nullptr) {
                 move_assign(other, std::false_type());
             }
 
@@ -169,13 +426,16 @@ namespace std {
                 copy_allocator(allocator, other.allocator,
                                typename traits::propagate_on_container_copy_assignment());
                 bucket_allocator = allocator;
+                placement = other.placement;
                 hashpower(other.hashpower());
-                buckets = transfer(other.hashpower(), other, std::false_type());
+                bucket_container copy = transfer(other.hashpower(), other, std::false_type());
+                take_arrays(copy);
                 return *this;
             }
 
             bucket_container& operator=(bucket_container&& other) {
                 destroy_buckets();
+                placement = other.placement;
                 move_assign(other, typename traits::propagate_on_container_move_assignment());
                 return *this;
             }
@@ -193,7 +453,49 @@ namespace std {
                 size_t other_hashpower = other.hashpower();
                 other.hashpower(hashpower());
                 hashpower(other_hashpower);
+                std::swap(placement, other.placement);
                 std::swap(buckets, other.buckets);
+                std::swap(occupancy, other.occupancy);
+            }
+
+            placement_policy get_placement_policy() const {
+                return placement;
+            }
+
+            // Sets the placement of bucket arrays allocated from now on. The
+            // current one is interleaved right away if that is the new policy.
+            void set_placement_policy(const placement_policy policy) {
+                placement = policy;
+                if (policy == placement_policy::interleave && buckets != nullptr) {
+                    interleave_pages<bucket_allocator_type>(buckets, size() * sizeof(bucket));
+                }
+            }
+
+            // An empty bucket is all zero bits, so buckets in zero-filled memory
+            // need not be constructed. Such memory comes from the allocator's
+            // allocate_zeroed(n), for allocators that have one, and its pages
+            // are only touched once a bucket is written to.
+            static constexpr bool zeroed_buckets =
+                has_allocate_zeroed<bucket_allocator_type>::value;
+            // Zero-filled buckets of trivially destructible elements are freed
+            // without looking at them.
+            static constexpr bool trivial_teardown =
+                zeroed_buckets && std::is_trivially_destructible<storage_value_type>::value;
+
+            // Whether grow_in_place can work. The elements are relocated with the
+            // memory that holds them, so they have to be trivially copyable.
+            static constexpr bool can_grow_in_place =
+                can_reallocate<typename traits::template rebind_alloc<bucket>>::value &&
+                std::is_trivially_copyable<Key>::value &&
+                std::is_trivially_copyable<Value>::value;
+
+            // grow_in_place extends the buckets to the given hashpower without
+            // copying them, by asking the allocator to reallocate the block. The
+            // existing buckets keep their contents and indexes. Returns false,
+            // leaving the container as it was, if the allocator cannot do it.
+            bool grow_in_place(size_type new_hashpower) {
+                return grow_in_place(new_hashpower,
+                                     std::integral_constant<bool, can_grow_in_place>());
             }
 
             size_type hashpower() const {
@@ -225,12 +527,34 @@ namespace std {
                              Args&&... args) {
                 bucket& b = buckets[index];
                 assert(!b.occupied(slot));
+                const bool was_empty = b.empty();
+                b.partial(slot) = partial_key;
+                traits::construct(allocator, std::addressof(b.storage_element(slot)),
+                                  std::piecewise_construct,
+                                  std::forward_as_tuple(std::forward<K>(k)),
+                                  std::forward_as_tuple(std::forward<Args>(args)...));
+                b.occupied(slot) = true;
+                if (was_empty) {
+                    mark_occupied(index, true);
+                }
+            }
+
+            // place_element is set_element for buckets that several threads
+            // fill at once, each in a slot it claimed. It cannot look at the
+            // other slots to tell whether the bucket was empty, so it updates
+            // the occupancy summary from the summary itself.
+            template <typename K, typename... Args>
+            void place_element(size_type index, size_type slot, partial_t partial_key,
+                               K&& k,
+                               Args&&... args) {
+                bucket& b = buckets[index];
                 b.partial(slot) = partial_key;
                 traits::construct(allocator, std::addressof(b.storage_element(slot)),
                                   std::piecewise_construct,
                                   std::forward_as_tuple(std::forward<K>(k)),
                                   std::forward_as_tuple(std::forward<Args>(args)...));
                 b.occupied(slot) = true;
+                mark_placed(index);
             }
 
             void erase_element(size_type index, size_type slot) {
@@ -238,6 +562,9 @@ namespace std {
                 assert(b.occupied(slot));
                 b.occupied(slot) = false;
                 traits::destroy(allocator, std::addressof(b.element(slot)));
+                if (b.empty()) {
+                    mark_occupied(index, false);
+                }
             }
 
             void move_element(size_type dst_index, size_type dst_slot,
@@ -252,48 +579,110 @@ namespace std {
                 erase_element(src_index, src_slot);
             }
 
+            // next_occupied returns the index of the first bucket in [index, last)
+            // that holds an element, or last if there is none. Empty blocks are
+            // skipped by their count and empty buckets by their bit, so a sparse
+            // array is scanned without touching its buckets.
+            size_type next_occupied(size_type index, size_type last) const {
+                while (index < last) {
+                    const occupancy_word* block = occupancy_block(index);
+                    if (block[0].load(std::memory_order_relaxed) == 0) {
+                        index = (index / private_impl::OCCUPANCY_BLOCK + 1) *
+                                private_impl::OCCUPANCY_BLOCK;
+                        continue;
+                    }
+                    const size_type bit = index % OCCUPANCY_BITS;
+                    const uint64_t word =
+                        block[1 + index % private_impl::OCCUPANCY_BLOCK / OCCUPANCY_BITS].load(
+                            std::memory_order_relaxed) >> bit;
+                    if (word != 0) {
+                        return std::min(last, index + std::countr_zero(word));
+                    }
+                    index += OCCUPANCY_BITS - bit;
+                }
+                return last;
+            }
+
+            size_type next_occupied(size_type index) const {
+                return next_occupied(index, size());
+            }
+
             void clear() noexcept {
                 static_assert(
                     std::is_nothrow_destructible<key_type>::value &&
                     std::is_nothrow_destructible<mapped_type>::value,
                     "bucket_container requires key and value to be nothrow "
                     "destructible");
-                for (size_type i = 0; i < size(); ++i) {
-                    bucket& b = buckets[i];
-                    for (size_type j = 0; j < SLOTS_PER_BUCKET; ++j) {
-                        if (b.occupied(j)) {
-                            erase_element(i, j);
-                        }
-                    }
-                }
+                for_each_range_nothrow(0, size(), [this](size_type i, size_type end) {
+                    clear_range(i, end);
+                });
             }
 
             void resize(size_type new_size) {
                 assert(new_size >= hashpower());
-                bucket* new_buckets = transfer(new_size, *this, std::true_type());
+                bucket_container resized = transfer(new_size, *this, std::true_type());
                 destroy_buckets();
-                buckets = new_buckets;
+                take_arrays(resized);
                 hashpower(new_size);
             }
 
         private:
+            bool grow_in_place(size_type new_hashpower, std::true_type) {
+                assert(new_hashpower >= hashpower());
+                const size_type old_size = size();
+                const size_type new_size = size_type(1) << new_hashpower;
+                occupancy_word* grown_occupancy = allocate_occupancy(new_size);
+                bucket* grown = bucket_allocator.reallocate(buckets, old_size, new_size);
+                if (grown == nullptr) {
+                    deallocate_occupancy(grown_occupancy, new_size);
+                    return false;
+                }
+                buckets = grown;
+                // The blocks of the existing buckets keep their place.
+                for (size_type i = 0; i < occupancy_length(old_size); ++i) {
+                    grown_occupancy[i].store(occupancy[i].load(std::memory_order_relaxed),
+                                             std::memory_order_relaxed);
+                }
+                deallocate_occupancy(occupancy, old_size);
+                occupancy = grown_occupancy;
+                if (placement == placement_policy::interleave) {
+                    interleave_pages<bucket_allocator_type>(&buckets[old_size],
+                                                            (new_size - old_size) * sizeof(bucket));
+                }
+                construct_buckets(old_size, new_size);
+                hashpower(new_hashpower);
+                return true;
+            }
+            bool grow_in_place(size_type, std::false_type) {
+                return false;
+            }
+
             void move_assign(bucket_container& src, std::true_type) {
                 allocator = std::move(src.allocator);
                 bucket_allocator = allocator;
                 hashpower(src.hashpower());
-                buckets = src.buckets;
-                src.buckets = nullptr;
+                take_arrays(src);
             }
             void move_assign(bucket_container& src, std::false_type) {
                 hashpower(src.hashpower());
                 if (allocator == src.allocator) {
-                    buckets = src.buckets;
-                    src.buckets = nullptr;
+                    take_arrays(src);
                 } else {
-                    buckets = transfer(src.hashpower(), src, std::true_type());
+                    bucket_container moved = transfer(src.hashpower(), src, std::true_type());
+                    take_arrays(moved);
                 }
             }
 
+            // take_arrays makes the buckets and occupancy summary of src, which
+            // uses an equal allocator, this container's, and leaves src without
+            // any. The current arrays have to be destroyed already.
+            void take_arrays(bucket_container& src) noexcept {
+                buckets = src.buckets;
+                occupancy = src.occupancy;
+                src.buckets = nullptr;
+                src.occupancy = nullptr;
+            }
+
             void destroy_buckets() noexcept {
                 if (buckets == nullptr) {
                     return;
@@ -301,12 +690,149 @@ namespace std {
                 static_assert(std::is_nothrow_destructible<bucket>::value,
                               "bucket_container requires bucket to be nothrow "
                               "destructible");
-                clear();
-                for (size_type i = 0; i < size(); ++i) {
-                    traits::destroy(allocator, &buckets[i]);
+                if (!trivial_teardown) {
+                    for_each_range_nothrow(0, size(), [this](size_type i, size_type end) {
+                        clear_range(i, end);
+                        for (; i < end; ++i) {
+                            traits::destroy(allocator, &buckets[i]);
+                        }
+                    });
                 }
                 bucket_allocator.deallocate(buckets, size());
+                deallocate_occupancy(occupancy, size());
                 buckets = nullptr;
+                occupancy = nullptr;
+            }
+
+            static size_type occupancy_length(size_type n) {
+                return (n + private_impl::OCCUPANCY_BLOCK - 1) / private_impl::OCCUPANCY_BLOCK *
+                       OCCUPANCY_BLOCK_WORDS;
+            }
+
+            occupancy_word* allocate_occupancy(size_type n) {
+                occupancy_allocator_type occupancy_allocator(allocator);
+                const size_type length = occupancy_length(n);
+                occupancy_word* p = occupancy_traits::allocate(occupancy_allocator, length);
+                for (size_type i = 0; i < length; ++i) {
+                    occupancy_traits::construct(occupancy_allocator, &p[i], 0);
+                }
+                return p;
+            }
+
+            void deallocate_occupancy(occupancy_word* p, size_type n) {
+                occupancy_allocator_type occupancy_allocator(allocator);
+                occupancy_traits::deallocate(occupancy_allocator, p, occupancy_length(n));
+            }
+
+            occupancy_word* occupancy_block(size_type index) const {
+                return &occupancy[index / private_impl::OCCUPANCY_BLOCK * OCCUPANCY_BLOCK_WORDS];
+            }
+
+            // Records that the bucket at index got its first element, or lost
+            // its last one.
+            void mark_occupied(size_type index, bool occupied) {
+                occupancy_word* block = occupancy_block(index);
+                occupancy_word& word =
+                    block[1 + index % private_impl::OCCUPANCY_BLOCK / OCCUPANCY_BITS];
+                const uint64_t bit = uint64_t(1) << (index % OCCUPANCY_BITS);
+                if (occupied) {
+                    block[0].fetch_add(1, std::memory_order_relaxed);
+                    word.fetch_or(bit, std::memory_order_relaxed);
+                } else {
+                    block[0].fetch_sub(1, std::memory_order_relaxed);
+                    word.fetch_and(~bit, std::memory_order_relaxed);
+                }
+            }
+
+            // Records that the bucket at index holds an element, counting it
+            // in its block only if no other element marked it first.
+            void mark_placed(size_type index) {
+                occupancy_word* block = occupancy_block(index);
+                occupancy_word& word =
+                    block[1 + index % private_impl::OCCUPANCY_BLOCK / OCCUPANCY_BITS];
+                const uint64_t bit = uint64_t(1) << (index % OCCUPANCY_BITS);
+                if (!(word.fetch_or(bit, std::memory_order_relaxed) & bit)) {
+                    block[0].fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            bucket* allocate_buckets(size_type n) {
+                bucket* p = allocate_buckets(n, std::integral_constant<bool, zeroed_buckets>());
+                if (placement == placement_policy::interleave) {
+                    interleave_pages<bucket_allocator_type>(p, n * sizeof(bucket));
+                }
+                return p;
+            }
+            bucket* allocate_buckets(size_type n, std::false_type) {
+                return bucket_allocator.allocate(n);
+            }
+            bucket* allocate_buckets(size_type n, std::true_type) {
+                return bucket_allocator.allocate_zeroed(n);
+            }
+
+            // Constructs the buckets in [first, last), unless they are zero-filled.
+            // Under parallel_first_touch the worker pool does it, writing
+            // zero-filled buckets as well, so that each page is first touched by
+            // one of the workers.
+            void construct_buckets(size_type first, size_type last) {
+                if (placement != placement_policy::parallel_first_touch) {
+                    if (!zeroed_buckets) {
+                        construct_range(first, last);
+                    }
+                    return;
+                }
+                for_each_range(first, last, [this](size_type start, size_type end) {
+                    if (zeroed_buckets) {
+                        std::memset(static_cast<void*>(&buckets[start]), 0,
+                                    (end - start) * sizeof(bucket));
+                    } else {
+                        construct_range(start, end);
+                    }
+                });
+            }
+
+            // for_each_range calls func(start, end) over chunks covering
+            // [first, last), on the worker pool if the allocator may be used
+            // from several threads at once, and on the calling thread
+            // otherwise.
+            template <typename F>
+            void for_each_range(size_type first, size_type last, F func) const {
+                if (allows_concurrent_use<allocator_type>::value) {
+                    parallel_for(first, last, func);
+                } else {
+                    func(first, last);
+                }
+            }
+
+            // for_each_range_nothrow is for_each_range for the noexcept teardown
+            // paths, with a func that does not throw. Handing the range to the
+            // worker pool can still fail, for lack of memory, before any chunk
+            // has run; func then covers the whole range on the calling thread.
+            template <typename F>
+            void for_each_range_nothrow(size_type first, size_type last, F func) const noexcept {
+                try {
+                    for_each_range(first, last, func);
+                } catch (...) {
+                    func(first, last);
+                }
+            }
+
+            void clear_range(size_type first, size_type last) noexcept {
+                for (size_type i = next_occupied(first, last); i < last;
+                     i = next_occupied(i + 1, last)) {
+                    bucket& b = buckets[i];
+                    for (size_type j = 0; j < SLOTS_PER_BUCKET; ++j) {
+                        if (b.occupied(j)) {
+                            erase_element(i, j);
+                        }
+                    }
+                }
+            }
+
+            void construct_range(size_type first, size_type last) {
+                for (size_type i = first; i < last; ++i) {
+                    traits::construct(allocator, &buckets[i]);
+                }
             }
 
             void move_or_copy(size_type dst_index, size_type dst_slot, bucket& src,
@@ -321,30 +847,33 @@ namespace std {
             }
 
             template <bool B>
-            bucket* transfer(size_type dst_hashpower,
+            bucket_container transfer(size_type dst_hashpower,
                              typename std::conditional<B, bucket_container&,
                              const bucket_container&>::type src,
                              std::integral_constant<bool, B> move) {
                 assert(dst_hashpower >= src.hashpower());
-                bucket_container dst(dst_hashpower, get_allocator());
-
-                for (size_t i = 0; i < src.size(); ++i) {
-                    for (size_t j = 0; j < SLOTS_PER_BUCKET; ++j) {
-                        if (src.buckets[i].occupied(j)) {
-                            dst.move_or_copy(i, j, src.buckets[i], j, move);
+                bucket_container dst(dst_hashpower, get_allocator(), placement);
+
+                // Every element keeps its index, so the workers write disjoint
+                // buckets.
+                for_each_range(0, src.size(), [&dst, &src, move](size_type i, size_type end) {
+                    for (i = src.next_occupied(i, end); i < end; i = src.next_occupied(i + 1, end)) {
+                        for (size_type j = 0; j < SLOTS_PER_BUCKET; ++j) {
+                            if (src.buckets[i].occupied(j)) {
+                                dst.move_or_copy(i, j, src.buckets[i], j, move);
+                            }
                         }
                     }
-                }
-
-                bucket* dst_pointer = dst.buckets;
-                dst.buckets = nullptr;
-                return dst_pointer;
+                });
+                return dst;
             }
 
             allocator_type allocator;
-            typename traits::template rebind_alloc<bucket> bucket_allocator;
+            bucket_allocator_type bucket_allocator;
+            placement_policy placement;
             std::atomic<size_type> hashpower_holder;
             bucket* buckets;
+            occupancy_word* occupancy;
         };
 
         using LOCKING_ACTIVE = std::integral_constant<bool, true>;
@@ -410,12 +939,22 @@ namespace std {
             }
 
             void write_unlock(LOCKING_ACTIVE) noexcept {
-                version.fetch_add(std::memory_order_release);
+                version.fetch_add(1, std::memory_order_release);
             }
 
             void write_unlock(LOCKING_INACTIVE) noexcept {
             }
 
+            // The readers of a versioned lock are optimistic and retry, which
+            // callers that run user code cannot, so shared locking takes it
+            // exclusively.
+            void lock_shared() noexcept {
+                write_lock(LOCKING_ACTIVE());
+            }
+            void unlock_shared() noexcept {
+                write_unlock(LOCKING_ACTIVE());
+            }
+
             size_t& elem_counter() noexcept {
                 return counter;
             }
@@ -445,9 +984,11 @@ namespace std {
             
             shared_mutex_adapter& operator = (const shared_mutex_adapter& other) {
                 counter = other.counter;
+                return *this;
             }
             version_type read_lock() noexcept {
                 mutex.lock_shared();
+                return 0;
             }
             bool try_read_unlock(version_type version) noexcept {
                 mutex.unlock_shared();
@@ -469,6 +1010,12 @@ namespace std {
             }
             void write_unlock(LOCKING_INACTIVE) noexcept {
             }
+            void lock_shared() noexcept {
+                mutex.lock_shared();
+            }
+            void unlock_shared() noexcept {
+                mutex.unlock_shared();
+            }
             
             size_t& elem_counter() noexcept {
                 return counter;
@@ -489,2005 +1036,5426 @@ namespace std {
             partial_t partial;
         };
 
-        // node holds one position in a cuckoo path. Since cuckoopath
-        // elements only define a sequence of alternate hashings for different hash
-        // values, we only need to keep track of the hash values being moved, rather
-        // than the keys themselves.
-        typedef struct {
-            size_type bucket;
-            size_type slot;
-            hash_value hv;
-        } node;
+        // hit_counters counts the lookups that found their key by where they
+        // found it. Counting is off until it is enabled, since with many
+        // threads even sharded counters put contended writes on every lookup.
+        // When it is on, each thread adds to one of a few counter sets on
+        // separate cache lines; reading sums them up.
+        class hit_counters {
+        public:
+            enum location { first_bucket, second_bucket, stash, NUM_LOCATIONS };
 
-        static constexpr uint8_t MAX_BFS_PATH_LEN = 5;
+            bool enabled() const {
+                return counting.load(std::memory_order_relaxed);
+            }
 
-        using nodes = std::array<node, MAX_BFS_PATH_LEN>;
+            void set_enabled(const bool enable) {
+                counting.store(enable, std::memory_order_relaxed);
+            }
 
-        static constexpr size_type const_pow(size_type a, size_type b) {
-            return (b == 0) ? 1 : a * const_pow(a, b - 1);
-        }
+            void add(const location where) {
+                if (enabled()) {
+                    shards[shard_index()].counts[where].fetch_add(1, std::memory_order_relaxed);
+                }
+            }
 
-        // bfs_slot holds the information for a BFS path through the table.
-#pragma pack(push, 1)
-        template<private_impl::size_type SLOTS_PER_BUCKET>
-        struct bfs_slot {
-            using size_type = private_impl::size_type;
-            // The bucket of the last item in the path.
-            size_type bucket;
-            // a compressed representation of the slots for each of the buckets in
-            // the path. pathcode is sort of like a base-slot_per_bucket number, and
-            // we need to hold at most MAX_BFS_PATH_LEN slots. Thus we need the
-            // maximum pathcode to be at least slot_per_bucket()^(MAX_BFS_PATH_LEN).
-            size_type pathcode;
-            static_assert(const_pow(SLOTS_PER_BUCKET, MAX_BFS_PATH_LEN) <
-                          std::numeric_limits<decltype(pathcode)>::max(),
-                          "pathcode may not be large enough to encode a cuckoo "
-                          "path");
-            // The 0-indexed position in the cuckoo path this slot occupies. It must
-            // be less than MAX_BFS_PATH_LEN, and also able to hold negative values.
-            int_fast8_t depth;
-            static_assert(MAX_BFS_PATH_LEN - 1 <=
-                          std::numeric_limits<decltype(depth)>::max(),
-                          "The depth type must able to hold a value of"
-                          " MAX_BFS_PATH_LEN - 1");
-            static_assert(-1 >= std::numeric_limits<decltype(depth)>::min(),
-                          "The depth type must be able to hold a value of -1");
-            bfs_slot() {}
-            bfs_slot(const size_type b, const size_type p, const decltype(depth) d)
-                : bucket(b)
-                , pathcode(p)
-                , depth(d) {
-                assert(d < MAX_BFS_PATH_LEN);
+            std::size_t load(const location where) const {
+                std::size_t sum = 0;
+                for (const shard& s : shards) {
+                    sum += s.counts[where].load(std::memory_order_relaxed);
+                }
+                return sum;
+            }
+
+            void reset() {
+                for (shard& s : shards) {
+                    for (auto& count : s.counts) {
+                        count.store(0, std::memory_order_relaxed);
+                    }
+                }
+            }
+
+        private:
+            static constexpr std::size_t NUM_SHARDS = 16;
+
+            struct alignas(64) shard {
+                std::array<std::atomic<std::size_t>, NUM_LOCATIONS> counts{};
+            };
+
+            static std::size_t shard_index() {
+                static std::atomic<std::size_t> next_thread(0);
+                static thread_local const std::size_t index =
+                    next_thread.fetch_add(1, std::memory_order_relaxed) % NUM_SHARDS;
+                return index;
             }
+
+            std::array<shard, NUM_SHARDS> shards;
+            // Only written when counting is switched, so the lookups that read
+            // it share the line without contention.
+            alignas(64) std::atomic<bool> counting{false};
         };
-#pragma pack(pop)
 
-// bfs_queue is the queue used to store bfs_slots for BFS cuckoo hashing.
-#pragma pack(push, 1)
-        template<private_impl::size_type SLOTS_PER_BUCKET>
-        class bfs_queue {
+        // stash_tag_array publishes which stash slots hold an element, and the
+        // full hash value of the key in each one, through atomics. A lookup only
+        // looks at the slots tagged with its own hash: such a key has the same
+        // two buckets, so the lookup's locks, or its version checks, cover the
+        // slot and no stash mutex is needed. A slot is published after its
+        // element is constructed and unpublished before it is destroyed, and its
+        // hash is only set while it is unpublished.
+        class stash_tag_array {
         public:
-            bfs_queue() noexcept : first(0), last(0)
-                {
+            stash_tag_array()
+                : published(0)
+            {
+                for (auto& hash : hashes) {
+                    hash.store(0, std::memory_order_relaxed);
                 }
+            }
 
-            void enqueue(bfs_slot<SLOTS_PER_BUCKET> x) {
-                assert(!full());
-                slots[last] = x;
-                last = increment(last);
+            stash_tag_array(const stash_tag_array& other)
+                : published(0)
+            {
+                *this = other;
             }
 
-            bfs_slot<SLOTS_PER_BUCKET> dequeue() {
-                assert(!empty());
-                bfs_slot<SLOTS_PER_BUCKET> &x = slots[first];
-                first = increment(first);
-                return x;
+            stash_tag_array& operator=(const stash_tag_array& other) {
+                for (std::size_t i = 0; i < STASH_SLOTS; ++i) {
+                    hashes[i].store(other.hash(i), std::memory_order_relaxed);
+                }
+                published.store(other.published_slots(), std::memory_order_release);
+                return *this;
             }
 
-            bool empty() const {
-                return first == last;
+            void swap(stash_tag_array& other) {
+                const stash_tag_array tmp(other);
+                other = *this;
+                *this = tmp;
             }
 
-            bool full() const {
-                return increment(last) == first;
+            std::size_t hash(const std::size_t slot) const {
+                return hashes[slot].load(std::memory_order_relaxed);
             }
 
-        private:
-            // The maximum size of the BFS queue. Note that unless it's less than
-            // slot_per_bucket()^MAX_BFS_PATH_LEN, it won't really mean anything.
-            static constexpr size_type MAX_CUCKOO_COUNT = 256;
-            static_assert((MAX_CUCKOO_COUNT & (MAX_CUCKOO_COUNT - 1)) == 0,
-                          "MAX_CUCKOO_COUNT should be a power of 2");
-            // A circular array of bfs_slots
-            bfs_slot<SLOTS_PER_BUCKET> slots[MAX_CUCKOO_COUNT];
-            // The index of the head of the queue in the array
-            size_type first;
-            // One past the index of the last_ item of the queue in the array.
-            size_type last;
+            void set_hash(const std::size_t slot, const std::size_t hash) {
+                hashes[slot].store(hash, std::memory_order_relaxed);
+            }
 
-            // returns the index in the queue after ind, wrapping around if
-            // necessary.
-            size_type increment(size_type index) const {
-                return (index + 1) & (MAX_CUCKOO_COUNT - 1);
+            std::size_t published_slots() const {
+                return published.load(std::memory_order_acquire);
             }
-        };
-#pragma pack(pop)
 
+            // The published slots tagged with the given hash, as a bitmask.
+            std::size_t published_with(const std::size_t hash) const {
+                const std::size_t slots = published_slots();
+                std::size_t result = 0;
+                for (std::size_t i = 0; i < STASH_SLOTS; ++i) {
+                    if ((slots & bit(i)) != 0 && this->hash(i) == hash) {
+                        result |= bit(i);
+                    }
+                }
+                return result;
+            }
 
-        /**
-         * Thrown when an automatic expansion is triggered, but the load factor of the
-         * table is below a minimum threshold, which can be set by the \ref
-         * cuckoohash_map::minimum_load_factor method. This can happen if the hash
-         * function does not properly distribute keys, or for certain adversarial
-         * workloads.
-         */
-        class load_factor_too_low : public std::exception {
-        public:
-            load_factor_too_low(const double loadfactor)
-                : loadfactor(loadfactor)
-                {
-                }
-            virtual const char* what() const noexcept override {
-                return "Automatic expansion triggered when load factor was below "
-                    "minimum threshold";
+            void publish(const std::size_t slot) {
+                published.fetch_or(bit(slot), std::memory_order_release);
             }
 
-            /**
-             * @return the load factor of the table when the exception was thrown
-             */
-            double load_factor() const { return loadfactor; }
-
-        private:
-            const double loadfactor;
-        };
-
-        /**
-         * Thrown when an expansion is triggered, but the hashpower specified is greater
-         * than the maximum, which can be set with the \ref
-         * cuckoohash_map::maximum_hashpower method.
-         */
-        class maximum_hashpower_exceeded : public std::exception {
-        public:
-            maximum_hashpower_exceeded(const size_t hash_power)
-                : hash_power(hash_power)
-                {
-                }
-            virtual const char* what() const noexcept override {
-                return "Expansion beyond maximum hashpower";
+            void unpublish(const std::size_t slot) {
+                published.fetch_and(~bit(slot), std::memory_order_release);
             }
-            size_t hashpower() const {
-                return hash_power;
+
+            void clear() {
+                published.store(0, std::memory_order_release);
             }
 
         private:
-            const size_t hash_power;
-        };
-    }
-
-    template <class Key,
-              class Value,
-              class Hasher = std::hash<Key>,
-              class Equality = std::equal_to<Key>,
-              class Allocator = std::allocator<pair<const Key, Value>> >
-    class concurrent_unordered_map {
-    public:
-        // types:
-        using key_type          = Key;
-        using mapped_type       = Value;
-        using value_type        = pair<const Key, Value>;
-        using hasher            = Hasher;
-        using key_equal         = Equality;
-        using allocator_type    = Allocator;
-        using size_type         = std::size_t;
-
-    private:
-        using partial_t = private_impl::partial_t;
-        using buckets_t = private_impl::bucket_container<Key, Value,
-                                                         Allocator, partial_t,
-                                                         private_impl::DEFAULT_SLOTS_PER_BUCKET>;
-        using bucket = typename buckets_t::bucket;
-
-        template <typename LOCK_TYPE>
-        class all_buckets_write_guard;
-
-    public:
+            static std::size_t bit(const std::size_t slot) {
+                return std::size_t(1) << slot;
+            }
 
-        class unordered_map_view {
-            std::reference_wrapper<concurrent_unordered_map<Key, Value, Hasher, Equality, Allocator>> delegate;
-            all_buckets_write_guard<std::private_impl::LOCKING_ACTIVE> guard;
+            std::atomic<std::size_t> published;
+            std::array<std::atomic<std::size_t>, STASH_SLOTS> hashes;
+        };
 
+        // scan_registry keeps track of the concurrent scans running over a
+        // table, for the operations that move elements from one lock stripe to
+        // another while a scan may be halfway through the table.
+        class scan_registry {
         public:
-            // types:
-            using key_type          = Key;
-            using mapped_type       = Value;
-            using value_type        = pair<const Key, Value>;
-            using hasher            = Hasher;
-            using key_equal         = Equality;
-            using allocator_type    = Allocator;
-
-            using pointer           = typename allocator_traits<Allocator>::pointer;
-            using const_pointer     = typename allocator_traits<Allocator>::const_pointer;
-            using reference         = value_type&;
-            using const_reference   = const value_type&;
-            using size_type         = concurrent_unordered_map<Key, Value, Hasher, Equality, Allocator>::size_type;
-            using difference_type   = std::ptrdiff_t;
-
-            class const_local_iterator {
-            public:
-                using difference_type = unordered_map_view::difference_type;
-                using value_type = unordered_map_view::value_type;
-                using pointer = unordered_map_view::const_pointer;
-                using reference = unordered_map_view::const_reference;
-                using iterator_category = std::bidirectional_iterator_tag;
-
-                const_local_iterator() = default;
-
-                bool operator==(const const_local_iterator& other) const {
-                    return data == other.data && slot == other.slot;
+            // A scan goes over positions: the lock stripes, and then the stash
+            // slots.
+            static constexpr const std::size_t NUM_POSITIONS = MAX_NUM_LOCKS + STASH_SLOTS;
+
+            static std::size_t stash_position(const std::size_t stash_slot) {
+                return MAX_NUM_LOCKS + stash_slot;
+            }
+
+            // What a scan shares with those operations. The scan marks the
+            // positions it is done with, holding their locks. An element moved
+            // out of one of them into one it is not done with has its hash
+            // recorded in skipped, so that the scan skips it rather than
+            // handing it out twice. A sweep, which has to get to every element
+            // that is in the table throughout, also has the hash of an element
+            // moved the other way recorded in owed, and looks it up once it is
+            // done with every position.
+            struct scan {
+                scan(std::size_t rehashes, bool sweep)
+                    : num_skipped(0)
+                    , rehashes(rehashes)
+                    , sweep(sweep)
+                {
+                    for (auto& word : done_words) {
+                        word.store(0, std::memory_order_relaxed);
+                    }
                 }
 
-                bool operator!=(const const_local_iterator& other) const {
-                    return !(operator==(other));
+                bool done(const std::size_t position) const {
+                    return (done_words[position / 64].load(std::memory_order_relaxed) &
+                            bit(position)) != 0;
                 }
 
-                reference operator*() const {
-                    return data->element(slot);
+                void mark_done(const std::size_t position) {
+                    done_words[position / 64].fetch_or(bit(position), std::memory_order_relaxed);
                 }
 
-                pointer operator->() const {
-                    return std::addressof(operator*());
+                // Marks the positions from first up to last.
+                void mark_done(std::size_t first, const std::size_t last) {
+                    for (; first < last; ++first) {
+                        mark_done(first);
+                    }
                 }
 
-                const_local_iterator& operator++() {
-                    if (slot < private_impl::DEFAULT_SLOTS_PER_BUCKET) {
-                        ++slot;
-                        while (slot < private_impl::DEFAULT_SLOTS_PER_BUCKET &&
-                               !data->occupied(slot)) {
-                            ++slot;
-                        }
+                // Removes one occurrence of hash from skipped, if it is there.
+                bool take_skipped(std::size_t hash) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!take(skipped, hash)) {
+                        return false;
                     }
-
-                    return *this;
+                    num_skipped.fetch_sub(1, std::memory_order_relaxed);
+                    return true;
                 }
 
-                const_local_iterator operator++(int) {
-                    const_local_iterator old(*this);
-                    ++(*this);
-                    return std::move(old);
+                // Returns the hashes owed to the scan, each once. Once the scan
+                // is done with every position, nothing is owed to it anymore.
+                std::vector<std::size_t> take_owed() {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    std::vector<std::size_t> result;
+                    result.swap(owed);
+                    std::sort(result.begin(), result.end());
+                    result.erase(std::unique(result.begin(), result.end()), result.end());
+                    return result;
                 }
 
-                const_local_iterator operator--() {
-                    --slot;
-                    while(!data->occupied(slot)) {
-                        --slot;
+                // skip and owe record a move past the scan. An element that
+                // moves back before the scan gets to it cancels the first move.
+                void skip(const std::size_t hash) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!take(owed, hash)) {
+                        skipped.push_back(hash);
+                        num_skipped.fetch_add(1, std::memory_order_relaxed);
                     }
-                    return *this;
-                }
-
-                const_local_iterator operator--(int) {
-                    const_local_iterator old(*this);
-                    --(*this);
-                    return std::move(old);
                 }
 
-            protected:
-                const_local_iterator(bucket* data, size_type slot) noexcept
-                    : data(data)
-                    , slot(slot) {
-                    if (slot < private_impl::DEFAULT_SLOTS_PER_BUCKET &&
-                        !data->occupied(slot)) {
-                        operator++();
+                void owe(const std::size_t hash) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (take(skipped, hash)) {
+                        num_skipped.fetch_sub(1, std::memory_order_relaxed);
+                    } else {
+                        owed.push_back(hash);
                     }
                 }
 
-                static const_local_iterator begin(bucket* data) {
-                    return const_local_iterator(data, 0);
+                std::mutex mutex;
+                std::vector<std::size_t> skipped;
+                std::atomic<std::size_t> num_skipped;
+                std::vector<std::size_t> owed;
+                // The registry's count of rehashes when the scan started.
+                const std::size_t rehashes;
+                const bool sweep;
+
+            private:
+                static std::uint64_t bit(const std::size_t position) {
+                    return std::uint64_t(1) << (position % 64);
                 }
 
-                static const_local_iterator end(bucket* data) {
-                    return const_local_iterator(data, private_impl::DEFAULT_SLOTS_PER_BUCKET);
+                static bool take(std::vector<std::size_t>& hashes, const std::size_t hash) {
+                    auto it = std::find(hashes.begin(), hashes.end(), hash);
+                    if (it == hashes.end()) {
+                        return false;
+                    }
+                    hashes.erase(it);
+                    return true;
                 }
 
-                bucket* data;
-                size_type slot;
-                friend class bucket_iterator;
-                friend class unordered_map_view;
+                std::array<std::atomic<std::uint64_t>, (NUM_POSITIONS + 63) / 64> done_words;
             };
 
-            class local_iterator : public const_local_iterator {
-            public:
-                using pointer = unordered_map_view::pointer;
-                using reference = unordered_map_view::reference;
+            scan_registry()
+                : count(0)
+                , rehash_count(0)
+            {
+            }
 
-                local_iterator() {}
+            void add(scan* s) {
+                std::lock_guard<std::mutex> lock(mutex);
+                scans.push_back(s);
+                count.fetch_add(1, std::memory_order_relaxed);
+            }
 
-                bool operator==(const local_iterator& it) const {
-                    return const_local_iterator::operator==(it);
-                }
+            void remove(scan* s) {
+                std::lock_guard<std::mutex> lock(mutex);
+                scans.erase(std::find(scans.begin(), scans.end(), s));
+                count.fetch_sub(1, std::memory_order_relaxed);
+            }
 
-                bool operator!=(const local_iterator& it) const {
-                    return const_local_iterator::operator!=(it);
+            // moved is called, with the locks of both positions taken, when an
+            // element moves from position from to position to; hash computes
+            // the element's hash. A scan that is done with either position
+            // marked it before the mover took its lock, so the mover sees it.
+            template <typename F>
+            void moved(const std::size_t from, const std::size_t to, F hash) {
+                if (count.load(std::memory_order_relaxed) == 0) {
+                    return;
                 }
-
-                reference operator*() {
-                    return const_local_iterator::data->element(const_local_iterator::slot);
+                std::lock_guard<std::mutex> lock(mutex);
+                for (scan* s : scans) {
+                    const bool from_done = s->done(from);
+                    if (from_done == s->done(to)) {
+                        continue;
+                    }
+                    if (from_done) {
+                        s->skip(hash());
+                    } else if (s->sweep) {
+                        s->owe(hash());
+                    }
                 }
+            }
 
-                pointer operator->() {
-                    return std::addressof(operator*());
+            // rehashed records that a resize is about to move elements to other
+            // lock stripes. The ranges cannot follow, so they stop. Every sweep
+            // is owed the elements at the positions it is not done with, and is
+            // then done with all of them: for_each_element is called, if a
+            // sweep runs, with a function to give each element's position and
+            // hash to. All the locks have to be taken.
+            template <typename F>
+            void rehashed(F for_each_element) {
+                rehash_count.fetch_add(1, std::memory_order_relaxed);
+                if (count.load(std::memory_order_relaxed) == 0) {
+                    return;
                 }
-
-                const_reference operator*() const {
-                    return const_local_iterator::data->element(const_local_iterator::slot);
+                std::lock_guard<std::mutex> lock(mutex);
+                std::vector<scan*> sweeps;
+                for (scan* s : scans) {
+                    if (s->sweep) {
+                        sweeps.push_back(s);
+                    }
                 }
-
-                const_pointer operator->() const {
-                    return std::addressof(operator*());
+                if (sweeps.empty()) {
+                    return;
+                }
+                for_each_element([&sweeps](std::size_t position, std::size_t hash) {
+                    for (scan* s : sweeps) {
+                        if (!s->done(position)) {
+                            s->owe(hash);
+                        }
+                    }
+                });
+                for (scan* s : sweeps) {
+                    s->mark_done(0, NUM_POSITIONS);
                 }
+            }
 
+            std::size_t rehashes() const {
+                return rehash_count.load(std::memory_order_relaxed);
+            }
 
-                local_iterator& operator++() {
-                    const_local_iterator::operator++();
-                    return *this;
-                }
+        private:
+            std::mutex mutex;
+            std::vector<scan*> scans;
+            std::atomic<std::size_t> count;
+            std::atomic<std::size_t> rehash_count;
+        };
 
-                local_iterator operator++(int) {
-                    iterator old(*this);
-                    const_local_iterator::operator++();
-                    return std::move(old);
+        // join_thread waits for thread to finish, without throwing, so that the
+        // table's noexcept operations can stop their helpers. A thread that
+        // would have to join itself, which is the only way join can fail here,
+        // is detached instead.
+        inline void join_thread(std::thread& thread) noexcept {
+            if (!thread.joinable()) {
+                return;
+            }
+            if (thread.get_id() != std::this_thread::get_id()) {
+                try {
+                    thread.join();
+                    return;
+                } catch (const std::system_error&) {
                 }
+            }
+            thread.detach();
+        }
 
-                local_iterator& operator--() {
-                    const_local_iterator::operator--();
-                    return *this;
-                }
+        // background_task runs at most one task at a time on a helper thread,
+        // which is spawned when a task is started. The owner has to join() it
+        // before anything the task uses is destroyed or moved away. Exceptions
+        // thrown by the task are dropped; whoever needed its work done will run
+        // into the same error in the foreground.
+        class background_task {
+        public:
+            background_task()
+                : running(false)
+            {
+            }
 
-                local_iterator operator--(int) {
-                    local_iterator old(*this);
-                    const_local_iterator::operator--();
-                    return std::move(old);
-                }
+            background_task(background_task&& other) noexcept
+                : running(false)
+            {
+                other.join();
+            }
 
-            private:
-                local_iterator(bucket* data, size_type slot) noexcept
-                   : const_local_iterator(data, slot)
-                    {
-                    }
+            background_task& operator=(background_task&& other) noexcept {
+                join();
+                other.join();
+                return *this;
+            }
 
-                static local_iterator begin(bucket* data) {
-                    return local_iterator(data, 0);
-                }
+            ~background_task() {
+                join();
+            }
 
-                static local_iterator end(bucket* data) {
-                    return local_iterator(data, private_impl::DEFAULT_SLOTS_PER_BUCKET);
+            // Starts the task unless one is still running, in which case it
+            // returns false.
+            template <typename F>
+            bool try_start(F task) {
+                if (running.exchange(true, std::memory_order_acq_rel)) {
+                    return false;
                 }
+                std::lock_guard<std::mutex> lock(mutex);
+                join_thread(thread);
+                thread = std::thread([this, task]() mutable {
+                    try {
+                        task();
+                    } catch (...) {
+                    }
+                    running.store(false, std::memory_order_release);
+                });
+                return true;
+            }
 
-                friend class bucket_iterator;
-                friend class unordered_map_view;
-            };
+            void join() noexcept {
+                std::lock_guard<std::mutex> lock(mutex);
+                join_thread(thread);
+            }
 
-            class const_iterator {
-            public:
-                using difference_type = unordered_map_view::difference_type;
-                using value_type = unordered_map_view::value_type;
-                using pointer = unordered_map_view::const_pointer;
-                using reference = unordered_map_view::const_reference;
-                using iterator_category = std::bidirectional_iterator_tag;
+        private:
+            std::atomic<bool> running;
+            std::mutex mutex;
+            std::thread thread;
+        };
 
-                const_iterator() {}
+        // periodic_task calls a function on a helper thread every interval until
+        // it is stopped. Like with background_task, the owner has to stop() it
+        // before anything the function uses is destroyed or moved away, and
+        // exceptions thrown by the function are dropped. start() and stop() must
+        // not race with each other.
+        class periodic_task {
+        public:
+            periodic_task()
+                : active(false)
+                , stopping(false)
+            {
+            }
 
-                bool operator==(const const_iterator& other) const {
-                    return buckets == other.buckets && bucket_index == other.bucket_index &&
-                        (bucket_position == other.bucket_position || bucket_index == buckets->size());
-                }
+            periodic_task(periodic_task&& other) noexcept
+                : active(false)
+                , stopping(false)
+            {
+                other.stop();
+            }
 
-                bool operator!=(const const_iterator& it) const {
-                    return !const_iterator::operator==(it);
-                }
+            periodic_task& operator=(periodic_task&& other) noexcept {
+                stop();
+                other.stop();
+                return *this;
+            }
 
-                reference operator*() const {
-                    return *bucket_position;
-                }
+            ~periodic_task() {
+                stop();
+            }
+
+            // Starts calling task every interval, stopping the previous task
+            // first.
+            template <typename F>
+            void start(const std::chrono::milliseconds interval, F task) {
+                stop();
+                stopping = false;
+                active.store(true, std::memory_order_release);
+                thread = std::thread([this, interval, task]() mutable {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    while (!wake.wait_for(lock, interval, [this] { return stopping; })) {
+                        lock.unlock();
+                        try {
+                            task();
+                        } catch (...) {
+                        }
+                        lock.lock();
+                    }
+                });
+            }
 
-                pointer operator->() const {
-                    return bucket_position.operator->();
+            // Stops the task, waiting for a running call to return.
+            void stop() noexcept {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
                 }
+                wake.notify_all();
+                join_thread(thread);
+                active.store(false, std::memory_order_release);
+            }
 
-                const_iterator& operator++() {
-                    increment();
-                    return *this;
-                }
+            bool running() const {
+                return active.load(std::memory_order_acquire);
+            }
 
-                const_iterator operator++(int) {
-                    const_iterator old(*this);
-                    ++(*this);
-                    return std::move(old);
-                }
+        private:
+            std::atomic<bool> active;
+            bool stopping;
+            std::mutex mutex;
+            std::condition_variable wake;
+            std::thread thread;
+        };
 
-                const_iterator& operator--() {
-                    decrement();
-                    return *this;
+        // epoch_domain tells when memory that threads may be reading without
+        // locks can be freed. A thread that looks at such memory does so inside
+        // an epoch_guard, which stores the global epoch in the thread's record.
+        // Whoever unpublishes the memory calls advance() and tags it with the
+        // epoch returned; it is safe to free once every thread inside a guard
+        // entered at a later epoch, since those threads can only have seen what
+        // replaced it. Records belong to one thread at a time and are reused
+        // once their thread exits. There is one domain for all tables, and it
+        // is never destroyed, because threads may exit after static destructors
+        // have run.
+        class epoch_domain {
+        public:
+            static epoch_domain& instance() {
+                static epoch_domain* domain = new epoch_domain();
+                return *domain;
+            }
+
+            void enter() {
+                record& r = local_record();
+                if (r.depth++ == 0) {
+                    // The exchange orders the store before the reads the guard
+                    // protects.
+                    r.epoch.exchange(global_epoch.load(std::memory_order_acquire),
+                                     std::memory_order_seq_cst);
                 }
+            }
 
-                const_iterator operator--(int) {
-                    const_iterator old(*this);
-                    --(*this);
-                    return std::move(old);
+            void exit() {
+                record& r = local_record();
+                if (--r.depth == 0) {
+                    r.epoch.store(IDLE, std::memory_order_release);
                 }
+            }
 
-            protected:
-                void increment() {
-                    ++bucket_position;
-                    if (bucket_position == local_iterator::end(&((*buckets)[bucket_index]))) {
-                        ++bucket_index;
-                        while (bucket_index < buckets->size()) {
-                            bucket_position = local_iterator::begin(&((*buckets)[bucket_index]));
-                            if (bucket_position != local_iterator::end(&((*buckets)[bucket_index]))) {
-                                break;
-                            }
-                            ++bucket_index;
-                        }
+            // advance returns the epoch to tag memory that was just unpublished
+            // with.
+            std::size_t advance() {
+                return global_epoch.fetch_add(1, std::memory_order_seq_cst);
+            }
+
+            // Memory tagged with an epoch below oldest_active_epoch() can be
+            // freed.
+            std::size_t oldest_active_epoch() {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                std::size_t oldest = global_epoch.load(std::memory_order_seq_cst);
+                std::lock_guard<std::mutex> lock(mutex);
+                for (const record* r : records) {
+                    const std::size_t e = r->epoch.load(std::memory_order_seq_cst);
+                    if (e != IDLE && e < oldest) {
+                        oldest = e;
                     }
                 }
+                return oldest;
+            }
 
-                void decrement() {
-                    if (bucket_index == buckets->size() ||
-                            local_iterator::begin(&((*buckets)[bucket_index])) == bucket_position) {
-                        --bucket_index;
-                        while (local_iterator::begin(&((*buckets)[bucket_index])) ==
-                               local_iterator::end(&((*buckets)[bucket_index]))) {
-                            --bucket_index;
-                        }
-                        bucket_position = local_iterator::end(&((*buckets)[bucket_index]));
-                        --bucket_position;
-                    } else {
-                        --bucket_position;
+        private:
+            static constexpr std::size_t IDLE = 0;
+
+            struct alignas(64) record {
+                std::atomic<std::size_t> epoch{IDLE};
+                // Nesting depth of the owner's guards.
+                std::size_t depth = 0;
+                // Guarded by the domain's mutex.
+                bool in_use = false;
+            };
+
+            // Hands the thread's record back to the domain when the thread exits.
+            struct registration {
+                record* owned = nullptr;
+                ~registration() {
+                    if (owned != nullptr) {
+                        instance().release(owned);
                     }
                 }
+            };
 
-                const_iterator(buckets_t* buckets, size_type bucket_index, size_type slot)
-                    : buckets(buckets)
-                    , bucket_index(bucket_index)
-                    , bucket_position(&(*buckets)[bucket_index != buckets->size() ? bucket_index : 0],
-                                      slot)
-                    {
-                        if (bucket_index < buckets->size() && bucket_position == local_iterator::end(&(*buckets)[bucket_index])) {
-                            increment();
-                        }
-                    }
+            epoch_domain()
+                : global_epoch(IDLE + 1)
+            {
+            }
 
-                const_local_iterator begin(bucket* bucket) {
-                    return const_local_iterator::begin(bucket);
+            record& local_record() {
+                static thread_local registration registered;
+                if (registered.owned == nullptr) {
+                    registered.owned = acquire();
                 }
+                return *registered.owned;
+            }
 
-                const_local_iterator end(bucket* bucket) {
-                    return const_local_iterator::end(bucket);
+            record* acquire() {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (record* r : records) {
+                    if (!r->in_use) {
+                        r->in_use = true;
+                        return r;
+                    }
                 }
+                records.push_back(new record());
+                records.back()->in_use = true;
+                return records.back();
+            }
 
-                buckets_t* buckets;
-                size_type bucket_index;
-                local_iterator bucket_position;
-                friend class unordered_map_view;
-            };
-
-            class iterator : public const_iterator {
-            public:
-                using difference_type = unordered_map_view::difference_type;
-                using value_type = unordered_map_view::value_type;
-                using pointer = unordered_map_view::pointer;
-                using const_pointer = unordered_map_view::const_pointer;
-                using reference = unordered_map_view::reference;
-                using const_reference = unordered_map_view::const_reference;
-                using iterator_category = std::bidirectional_iterator_tag;
+            void release(record* r) {
+                std::lock_guard<std::mutex> lock(mutex);
+                r->epoch.store(IDLE, std::memory_order_release);
+                r->depth = 0;
+                r->in_use = false;
+            }
 
-                iterator() {}
+            std::atomic<std::size_t> global_epoch;
+            std::mutex mutex;
+            std::vector<record*> records;
+        };
 
-                bool operator==(const iterator& other) const {
-                    return this->buckets == other.buckets && this->bucket_index == other.bucket_index &&
-                        (this->bucket_position == other.bucket_position || this->bucket_index == this->buckets->size());
-                }
-                bool operator!=(const iterator& it) const {
-                    return !operator==(it);
-                }
+        // epoch_guard keeps the calling thread inside the epoch domain for its
+        // lifetime. It has to be destroyed on the thread that created it.
+        class epoch_guard {
+        public:
+            epoch_guard() {
+                epoch_domain::instance().enter();
+            }
 
-                const_reference operator*() const {
-                    return *this->bucket_position;
-                }
-                reference operator*() {
-                    return *this->bucket_position;
-                }
+            ~epoch_guard() {
+                epoch_domain::instance().exit();
+            }
 
-                const_pointer operator->() const {
-                    return this->bucket_position.operator->();
-                }
-                pointer operator->() {
-                    return this->bucket_position.operator->();
-                }
+            epoch_guard(const epoch_guard&) = delete;
+            epoch_guard& operator=(const epoch_guard&) = delete;
+        };
 
-                iterator operator++() {
-                    const_iterator::increment();
-                    return *this;
+        // retired_memory holds the deleters of memory a table unpublished, until
+        // no thread can be looking at it anymore. Destroying it drops the
+        // deleters without running them; their captures own what they free.
+        class retired_memory {
+        public:
+            // Queues deleter, to be run by a later reclaim() once the grace
+            // period of the memory, which has to be unpublished already, is over.
+            void retire(std::function<void()> deleter) {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending.emplace_back(epoch_domain::instance().advance(), std::move(deleter));
+                empty.store(false, std::memory_order_release);
+            }
+
+            // Runs all the deleters. Only for when no other thread can be
+            // looking at the table.
+            void flush() {
+                std::deque<std::pair<std::size_t, std::function<void()>>> all;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    all.swap(pending);
+                    empty.store(true, std::memory_order_release);
                 }
-                iterator& operator++(int) {
-                    iterator old(*this);
-                    const_iterator::increment();
-                    return std::move(old);
+                for (auto& entry : all) {
+                    entry.second();
                 }
+            }
 
-                iterator operator--() {
-                    const_iterator::decrement();
-                    return *this;
-                }
-                iterator& operator--(int) {
-                    iterator old(*this);
-                    --(*this);
-                    return std::move(old);
+            // Runs the deleters whose grace period is over. Never waits for
+            // readers. Returns whether nothing is left to reclaim.
+            bool reclaim() {
+                if (empty.load(std::memory_order_acquire)) {
+                    return true;
                 }
-
-            private:
-                iterator(buckets_t* buckets, size_type bucket_index, size_type slot)
-                    : const_iterator(buckets, bucket_index, slot)
-                    {
+                const std::size_t oldest = epoch_domain::instance().oldest_active_epoch();
+                std::vector<std::function<void()>> ready;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    auto it = pending.begin();
+                    while (it != pending.end() && it->first < oldest) {
+                        ready.push_back(std::move(it->second));
+                        ++it;
                     }
-
-                local_iterator begin(bucket* bucket) {
-                    return local_iterator::begin(bucket);
+                    pending.erase(pending.begin(), it);
+                    empty.store(pending.empty(), std::memory_order_release);
                 }
-
-                local_iterator end(bucket* bucket) {
-                    return local_iterator::end(bucket);
+                for (auto& deleter : ready) {
+                    deleter();
                 }
+                return empty.load(std::memory_order_acquire);
+            }
 
-                friend class unordered_map_view;
-            };
+        private:
+            std::mutex mutex;
+            // Ordered by epoch, since epochs are taken under the mutex.
+            std::deque<std::pair<std::size_t, std::function<void()>>> pending;
+            std::atomic<bool> empty{true};
+        };
 
-            // construct/copy/destroy:
-            unordered_map_view() = delete;
-            unordered_map_view(concurrent_unordered_map<Key, Value, Hasher, Equality, Allocator>& delegate)
-                : delegate(delegate)
-                {
+        // cgroup_cpu_quota returns the CPU quota of the process' cgroup, rounded
+        // up to whole CPUs, or 0 if there is none.
+        inline std::size_t cgroup_cpu_quota() {
+            // cgroup v2 reports "<quota> <period>", or "max <period>".
+            std::ifstream v2("/sys/fs/cgroup/cpu.max");
+            std::string quota;
+            long long period = 0;
+            if (v2 >> quota >> period) {
+                if (quota == "max" || period <= 0) {
+                    return 0;
                 }
-
-            // iterators:
-            iterator begin() noexcept {
-                return iterator(&delegate.get().buckets, 0, 0);
-            }
-            const_iterator begin() const noexcept {
-                return const_iterator(&delegate.get().buckets, 0, 0);
+                return static_cast<std::size_t>((std::stoll(quota) + period - 1) / period);
             }
-            iterator end() noexcept {
-                return iterator(&delegate.get().buckets, delegate.get().buckets.size(), 0);
+            // cgroup v1 reports a quota of -1 when there is none.
+            std::ifstream v1_quota("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+            std::ifstream v1_period("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+            long long v1_quota_us = 0;
+            if (v1_quota >> v1_quota_us && v1_period >> period && v1_quota_us > 0 && period > 0) {
+                return static_cast<std::size_t>((v1_quota_us + period - 1) / period);
             }
-            const_iterator end() const noexcept {
-                return const_iterator(&delegate.get().buckets, delegate.get().buckets.size(), 0);
+            return 0;
+        }
+
+        // available_cpus returns how many CPUs the process can actually use: the
+        // size of its affinity mask, further limited by the cgroup CPU quota.
+        inline std::size_t available_cpus() {
+            std::size_t cpus = std::max(std::thread::hardware_concurrency(), 1U);
+#if defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+                cpus = CPU_COUNT(&set);
             }
-            const_iterator cbegin() const noexcept {
-                return const_iterator(&delegate.get().buckets, 0, 0);
+            try {
+                const std::size_t quota = cgroup_cpu_quota();
+                if (quota > 0) {
+                    cpus = std::min(cpus, quota);
+                }
+            } catch (...) {
+                // An unreadable quota is no quota.
             }
-            const_iterator cend() const noexcept {
-                return const_iterator(&delegate.get().buckets, delegate.get().buckets.size(), 0);
+#endif
+            return cpus;
+        }
+
+        // worker_pool runs the internal bulk work of the tables, like moving the
+        // buckets during a resize, on a set of threads that is created once, on
+        // first use, and shared by all tables. The range is handed out in chunks
+        // from a shared cursor, so a thread that drew sparse buckets simply takes
+        // more chunks. The calling thread works on the range too. Only one range
+        // runs at a time; a run that finds the pool busy, including one started
+        // from inside the pool, is processed on the calling thread alone.
+        class worker_pool {
+        public:
+            static worker_pool& instance() {
+                static worker_pool pool;
+                return pool;
             }
 
-            // capacity:
-            bool empty() const noexcept {
-                return delegate.get().size() == 0;
+            // Whether instance() may be used, which it may not once the pool
+            // has been destroyed at exit, for tables that outlive it.
+            static bool available() {
+                return !destroyed().load(std::memory_order_acquire);
             }
 
-            size_type size() const noexcept {
-                return delegate.get().size();
+            ~worker_pool() {
+                destroyed().store(true, std::memory_order_release);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                }
+                job_ready.notify_all();
+                for (std::thread& thread : threads) {
+                    thread.join();
+                }
             }
 
-            size_type max_size() const noexcept {
-                return 1U << delegate.get().buckets->maximum_hashpower();
+            // The number of threads a run uses, including the calling thread.
+            std::size_t concurrency() const {
+                return num_workers + 1;
             }
 
-            bool operator==(const unordered_map_view& other) const {
-                if (size() != other.size()) {
-                    return false;
+            // run calls func(chunk_start, chunk_end, eptr) over chunks covering
+            // [start, end). func stores an exception it caught in eptr, or lets
+            // it escape; the first one is rethrown once the whole range has been
+            // processed.
+            template <typename F>
+            void run(std::size_t start, std::size_t end, F func) {
+                if (end - start <= MIN_PARALLEL_CHUNK || num_workers == 0 ||
+                    busy.exchange(true, std::memory_order_acquire)) {
+                    std::exception_ptr eptr;
+                    func(start, end, eptr);
+                    if (eptr) {
+                        std::rethrow_exception(eptr);
+                    }
+                    return;
                 }
-                for (const auto& elem : other) {
-                    auto it = find(elem.first);
-                    if (it == end() || it->second != elem.second) {
-                        return false;
+                busy_guard release_busy{busy};
+                const std::size_t chunk =
+                    std::max(MIN_PARALLEL_CHUNK,
+                             (end - start) / (concurrency() * PARALLEL_CHUNKS_PER_WORKER));
+                std::atomic<std::size_t> cursor(start);
+                std::mutex error_mutex;
+                std::exception_ptr first_error;
+                std::function<void()> work = [&] {
+                    std::size_t chunk_start;
+                    while ((chunk_start = cursor.fetch_add(chunk, std::memory_order_relaxed)) < end) {
+                        std::exception_ptr eptr;
+                        try {
+                            func(chunk_start, std::min(chunk_start + chunk, end), eptr);
+                        } catch (...) {
+                            // Letting it escape would terminate a worker thread.
+                            eptr = std::current_exception();
+                        }
+                        if (eptr) {
+                            std::lock_guard<std::mutex> lock(error_mutex);
+                            if (!first_error) {
+                                first_error = eptr;
+                            }
+                        }
                     }
+                };
+                dispatch(work);
+                if (first_error) {
+                    std::rethrow_exception(first_error);
                 }
-                return true;
             }
 
-            bool operator!=(const unordered_map_view& other) const {
-                if (size() != other.size()) {
-                    return true;
-                }
-                for (const auto& elem : other) {
-                    auto it = find(elem.first);
-                    if (it == end() || it->second != elem.second) {
-                        return true;
-                    }
+        private:
+            // Hands the pool back to the next run, however the current one ends.
+            struct busy_guard {
+                std::atomic<bool>& busy;
+
+                ~busy_guard() {
+                    busy.store(false, std::memory_order_release);
                 }
-                return false;
-            }
+            };
 
-            // modifiers:
-            template<typename... Args>
-            pair<iterator, bool> emplace(Args&&... args) {
-                value_type x(std::forward(args)...);
-                return insert(std::move(x));
+            worker_pool()
+                : num_workers(available_cpus() - 1)
+                , busy(false)
+                , stopping(false)
+                , generation(0)
+                , job(nullptr)
+                , unfinished(0)
+            {
             }
 
-            pair<iterator, bool> insert(const value_type& x) {
-                hash_value hv = delegate.get().hashed_key(x.first);
-                auto b = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
-                table_position pos = delegate.get().cuckoo_insert_loop(hv, b, x.first);
-                if (pos.status == ok) {
-                    delegate.get().add_to_bucket(pos.index, pos.slot, hv.partial,
-                                                 x.first,
-                                                 x.second);
-                } else {
-                    assert(pos.status == failure_key_duplicated);
+            // dispatch runs work on every worker and on the calling thread, and
+            // returns once all of them are done.
+            void dispatch(std::function<void()>& work) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    // The threads are created lazily, so that tables which never
+                    // resize do not pay for them. If one cannot be started, the
+                    // ones that could, and the calling thread, take its share.
+                    try {
+                        while (threads.size() < num_workers) {
+                            threads.emplace_back([this] { worker_loop(); });
+                        }
+                    } catch (const std::system_error&) {
+                    }
+                    job = &work;
+                    unfinished = threads.size();
+                    ++generation;
                 }
-                return std::make_pair(iterator(&delegate.get().buckets, pos.index, pos.slot),
-                                               pos.status == ok);
+                job_ready.notify_all();
+                work();
+                std::unique_lock<std::mutex> lock(mutex);
+                job_done.wait(lock, [this] { return unfinished == 0; });
+                job = nullptr;
             }
-            pair<iterator, bool> insert(value_type&& x) {
-                hash_value hv = delegate.get().hashed_key(x.first);
-                auto b = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
-                table_position pos = delegate.get().cuckoo_insert_loop(hv, b, x.first);
-                if (pos.status == ok) {
-                    delegate.get().add_to_bucket(pos.index, pos.slot, hv.partial,
-                                                 std::move(const_cast<key_type&>(x.first)),
-                                                 std::move(x.second));
-                } else {
-                    assert(pos.status == failure_key_duplicated);
-                }
-                return std::make_pair(iterator(&delegate.get().buckets, pos.index, pos.slot),
-                                               pos.status == ok);
+
+            static std::atomic<bool>& destroyed() {
+                static std::atomic<bool> flag(false);
+                return flag;
             }
-            void insert(initializer_list<value_type> il) {
-                for (auto pos = il.begin(); pos != il.end(); ++pos)  {
-                    insert(*pos);
+
+            void worker_loop() {
+                std::size_t seen = 0;
+                std::unique_lock<std::mutex> lock(mutex);
+                while (true) {
+                    job_ready.wait(lock, [this, seen] { return stopping || generation != seen; });
+                    if (stopping) {
+                        return;
+                    }
+                    seen = generation;
+                    std::function<void()>* current = job;
+                    lock.unlock();
+                    (*current)();
+                    lock.lock();
+                    if (--unfinished == 0) {
+                        job_done.notify_all();
+                    }
                 }
             }
-            template<class InputIterator>
-            void insert(InputIterator first, InputIterator last) {
-                for (auto i = first; i != last; ++i) {
-                    insert(*i);
-                }
+
+            const std::size_t num_workers;
+            std::atomic<bool> busy;
+            std::mutex mutex;
+            std::condition_variable job_ready;
+            std::condition_variable job_done;
+            std::vector<std::thread> threads;
+            bool stopping;
+            std::size_t generation;
+            std::function<void()>* job;
+            std::size_t unfinished;
+        };
+
+        inline void parallel_for(std::size_t start, std::size_t end,
+                                 const std::function<void(std::size_t, std::size_t)>& func) {
+            if (!worker_pool::available()) {
+                func(start, end);
+                return;
             }
+            worker_pool::instance().run(start, end,
+                                        [&func](std::size_t chunk_start, std::size_t chunk_end,
+                                                std::exception_ptr& eptr) {
+                                            try {
+                                                func(chunk_start, chunk_end);
+                                            } catch (...) {
+                                                eptr = std::current_exception();
+                                            }
+                                        });
+        }
 
-            template <class M>
-            pair<iterator, bool> insert_or_assign(const key_type& key, M&& obj) {
-                hash_value hv = delegate.get().hashed_key(key);
-                auto b = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
-                table_position pos = delegate.get().cuckoo_insert_loop(hv, b, key);
-                if (pos.status == ok) {
-                    delegate.get().add_to_bucket(pos.index, pos.slot, hv.partial,
-                                           key,
-                                           std::forward<M>(obj));
-                } else {
-                    assert(pos.status == failure_key_duplicated);
-                    b.element(pos.slot) = std::forward<M>(obj);
-                }
-                return std::make_pair(iterator(delegate.get().buckets, pos.index, pos.slot),
-                                      pos.status == ok);
-            }
-            template <class M>
-            pair<iterator, bool> insert_or_assign(key_type&& key, M&& obj) {
-                hash_value hv = delegate.get().hashed_key(key);
-                auto b = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
-                table_position pos = delegate.get().cuckoo_insert_loop(hv, b, key);
-                if (pos.status == ok) {
-                    delegate.get().add_to_bucket(pos.index, pos.slot, hv.partial,
-                                           std::forward<key_type>(key),
-                                           std::forward<M>(obj));
-                } else {
-                    assert(pos.status == failure_key_duplicated);
-                    b.element(pos.slot) = std::forward<M>(obj);
-                }
-                return std::make_pair(iterator(delegate.get().buckets, pos.index, pos.slot),
-                                      pos.status == ok);
+        // node holds one position in a cuckoo path. Since cuckoopath
+        // elements only define a sequence of alternate hashings for different
+        // partial keys, we only need to keep track of the partial keys being
+        // moved, rather than the keys themselves.
+        typedef struct {
+            size_type bucket;
+            size_type slot;
+            partial_t partial;
+        } node;
 
-            }
+        static constexpr uint8_t MAX_BFS_PATH_LEN = 5;
+        static constexpr const std::size_t DEFAULT_MAX_CUCKOO_COUNT = 256;
+        static constexpr const std::size_t DEFAULT_MAX_RANDOM_WALK_LEN = 32;
 
-            iterator erase(iterator position) {
-                delegate.get().del_from_bucket(position.bucket_index, position.bucket_position.slot);
-                iterator result(&delegate.get().buckets, position.bucket_index, position.bucket_position.slot);
-                return result;
-            }
-            iterator erase(const_iterator position) {
-                delegate.get().del_from_bucket(position.bucket_index, position.bucket_position.slot);
-                iterator result(&delegate.get().buckets, position.bucket_index, position.bucket_position.slot);
-                return result;
-            }
-            size_type erase(const key_type& key) {
-                const hash_value hv = delegate.get().hashed_key(key);
-                const auto guard = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
-                const table_position pos =
-                    delegate.get().cuckoo_find(key, hv.partial, guard.first(), guard.second());
-                if (pos.status == ok) {
-                    delegate.get().del_from_bucket(pos.index, pos.slot);
-                    return 1;
-                } else {
-                    return 0;
-                }
-            }
+        template <std::size_t MAX_PATH_LEN>
+        using nodes = std::array<node, MAX_PATH_LEN>;
 
-            iterator erase(const_iterator first, const_iterator last) {
-                for (auto pos = first; pos != last; ++pos) {
-                    erase(pos);
-                }
-                return iterator(delegate.get().buckets, last.bucket_index, last.slot);
-            }
+        // Tags selecting the cuckoo path search performed by slot_search.
+        struct bfs_search_tag {};
+        struct random_walk_search_tag {};
 
-            void swap(unordered_map_view& other) noexcept {
-                guard.swap(other.guard);
-                delegate.swap(other);
+        static constexpr size_type const_pow(size_type a, size_type b) {
+            return (b == 0) ? 1 : a * const_pow(a, b - 1);
+        }
+
+        // bfs_slot holds the information for a BFS path through the table.
+#pragma pack(push, 1)
+        template<private_impl::size_type SLOTS_PER_BUCKET, private_impl::size_type MAX_BFS_PATH_LEN>
+        struct bfs_slot {
+            using size_type = private_impl::size_type;
+            // The bucket of the last item in the path.
+            size_type bucket;
+            // a compressed representation of the slots for each of the buckets in
+            // the path. pathcode is sort of like a base-slot_per_bucket number, and
+            // we need to hold at most MAX_BFS_PATH_LEN slots. Thus we need the
+            // maximum pathcode to be at least slot_per_bucket()^(MAX_BFS_PATH_LEN).
+            size_type pathcode;
+            static_assert(const_pow(SLOTS_PER_BUCKET, MAX_BFS_PATH_LEN) <
+                          std::numeric_limits<decltype(pathcode)>::max(),
+                          "pathcode may not be large enough to encode a cuckoo "
+                          "path");
+            // The 0-indexed position in the cuckoo path this slot occupies. It must
+            // be less than MAX_BFS_PATH_LEN, and also able to hold negative values.
+            int_fast8_t depth;
+            static_assert(MAX_BFS_PATH_LEN - 1 <=
+                          static_cast<size_type>(std::numeric_limits<decltype(depth)>::max()),
+                          "The depth type must able to hold a value of"
+                          " MAX_BFS_PATH_LEN - 1");
+            static_assert(-1 >= std::numeric_limits<decltype(depth)>::min(),
+                          "The depth type must be able to hold a value of -1");
+            bfs_slot() {}
+            bfs_slot(const size_type b, const size_type p, const decltype(depth) d)
+                : bucket(b)
+                , pathcode(p)
+                , depth(d) {
+                assert(d < static_cast<int>(MAX_BFS_PATH_LEN));
             }
+        };
+#pragma pack(pop)
 
-            void clear() noexcept {
-                delegate.get().buckets.clear();
-                auto& locks = delegate.get().get_current_locks();
-                for (size_type i = 0; i < locks.size(); ++i) {
-                    locks[i].elem_counter() = 0;
+// bfs_queue is the queue used to store bfs_slots for BFS cuckoo hashing.
+#pragma pack(push, 1)
+        template<private_impl::size_type SLOTS_PER_BUCKET, private_impl::size_type MAX_BFS_PATH_LEN,
+                 private_impl::size_type MAX_CUCKOO_COUNT>
+        class bfs_queue {
+        public:
+            using slot_type = bfs_slot<SLOTS_PER_BUCKET, MAX_BFS_PATH_LEN>;
+
+            bfs_queue() noexcept : first(0), last(0)
+                {
                 }
-            }
 
-            template<class H2, class P2>
-            void merge(concurrent_unordered_map<Key, Value, H2, P2, Allocator>& source) {
-                auto locked_table = source.lock_table();
-                insert(locked_table.begin(), locked_table.end());
+            void enqueue(slot_type x) {
+                assert(!full());
+                slots[last] = x;
+                last = increment(last);
             }
 
-            template<class H2, class P2>
-            void merge(concurrent_unordered_map<Key, Value, H2, P2, Allocator>&& source) {
-                auto locked_table = source.lock_table();
-                insert(locked_table.begin(), locked_table.end());
+            slot_type dequeue() {
+                assert(!empty());
+                slot_type &x = slots[first];
+                first = increment(first);
+                return x;
             }
 
-            // observers:
-            allocator_type get_allocator() const {
-                return delegate.get().get_allocator();
-            }
-            hasher hash_function() const {
-                return delegate.get().hash_function();
+            bool empty() const {
+                return first == last;
             }
-            key_equal key_eq() const {
-                return delegate.get().key_eq();
+
+            bool full() const {
+                return increment(last) == first;
             }
 
-            // map operations:
-            iterator find(const key_type& key) {
-                const hash_value hashvalue = delegate.get().hashed_key(key);
-                const auto guard = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hashvalue);
-                const table_position pos = delegate.get().cuckoo_find(key, hashvalue.partial,
-                                                                guard.first(), guard.second());
-                if (pos.status == ok) {
-                    return iterator(&delegate.get().buckets, pos.index, pos.slot);
-                } else {
-                    return end();
-                }
+        private:
+            // MAX_CUCKOO_COUNT is the maximum size of the BFS queue. Note that
+            // unless it's less than slot_per_bucket()^MAX_BFS_PATH_LEN, it won't
+            // really mean anything.
+            static_assert((MAX_CUCKOO_COUNT & (MAX_CUCKOO_COUNT - 1)) == 0,
+                          "MAX_CUCKOO_COUNT should be a power of 2");
+            // A circular array of bfs_slots
+            slot_type slots[MAX_CUCKOO_COUNT];
+            // The index of the head of the queue in the array
+            size_type first;
+            // One past the index of the last_ item of the queue in the array.
+            size_type last;
+
+            // returns the index in the queue after ind, wrapping around if
+            // necessary.
+            size_type increment(size_type index) const {
+                return (index + 1) & (MAX_CUCKOO_COUNT - 1);
             }
-            const_iterator find(const key_type& key) const {
-                const hash_value hashvalue = delegate.get().hashed_key(key);
-                const auto guard = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hashvalue);
-                const table_position pos = delegate.get().cuckoo_find(key, hashvalue.partial,
-                                                                guard.first(), guard.second());
-                if (pos.status == ok) {
-                    return iterator(&delegate.get().buckets, pos.index, pos.slot);
-                } else {
-                    return end();
+        };
+#pragma pack(pop)
+
+
+        /**
+         * Thrown when an automatic expansion is triggered, but the load factor of the
+         * table is below a minimum threshold, which can be set by the \ref
+         * cuckoohash_map::minimum_load_factor method. This can happen if the hash
+         * function does not properly distribute keys, or for certain adversarial
+         * workloads.
+         */
+        class load_factor_too_low : public std::exception {
+        public:
+            load_factor_too_low(const double loadfactor)
+                : loadfactor(loadfactor)
+                {
                 }
-            }
-            size_type count(const key_type& key) const {
-                return find(key) != cend();
-            }
-            pair<iterator, iterator> equal_range(const key_type& key) {
-                //DO we really need it?
-                auto start = find(key);
-                auto end = start;
-                ++end;
-                return make_pair(start, end);
-            }
-            pair<const_iterator, const_iterator> equal_range(const key_type& key) const {
-                //DO we really need it?
-                auto start = find(key);
-                auto end = start;
-                ++end;
-                return make_pair(start, end);
+            virtual const char* what() const noexcept override {
+                return "Automatic expansion triggered when load factor was below "
+                    "minimum threshold";
             }
 
-            // element access:
-            mapped_type& operator[](const key_type& key) {
-                auto result = insert(value_type(key, {}));
-                return result.first->second;
-            }
-            mapped_type& operator[](key_type&& key) {
-                auto result = insert(std::move(value_type(std::forward<key_type>(key), {})));
-                return result.first->second;
-            }
-            const mapped_type& at(const key_type& key) const {
-                auto it = find(key);
-                if (it == end()) {
-                    throw std::out_of_range("key not found in table");
-                } else {
-                    return it->second;
+            /**
+             * @return the load factor of the table when the exception was thrown
+             */
+            double load_factor() const { return loadfactor; }
+
+        private:
+            const double loadfactor;
+        };
+
+        /**
+         * Thrown when an expansion is triggered, but the hashpower specified is greater
+         * than the maximum, which can be set with the \ref
+         * cuckoohash_map::maximum_hashpower method.
+         */
+        class maximum_hashpower_exceeded : public std::exception {
+        public:
+            maximum_hashpower_exceeded(const size_t hash_power)
+                : hash_power(hash_power)
+                {
                 }
+            virtual const char* what() const noexcept override {
+                return "Expansion beyond maximum hashpower";
             }
-            mapped_type& at(const key_type& key) {
-                auto it = find(key);
-                if (it == end()) {
-                    throw std::out_of_range("key not found in table");
-                } else {
-                    return it->second;
-                }
+            size_t hashpower() const {
+                return hash_power;
             }
 
-            size_type bucket_count() const {
-                return delegate.get().buckets.size();
-            }
+        private:
+            const size_t hash_power;
+        };
+    }
 
-            size_type max_bucket_count() const {
-                return std::numeric_limits<size_type>::max() / SLOTS_PER_BUCKET;
+#if defined(__linux__)
+    // mmap_allocator allocates every block as its own anonymous memory mapping.
+    // It lets tables with trivially copyable keys and values grow with
+    // mremap(2): the kernel moves the pages of the bucket array instead of the
+    // table copying it, and only the elements whose bucket changes are moved.
+    // That keeps the peak memory of a doubling at twice the old table rather
+    // than three times. Every allocation takes at least one page, so it is
+    // meant for large tables. Tables using it read under shared locks, since
+    // mremap can unmap the old pages of a block while readers look at them.
+    template <typename T>
+    class mmap_allocator {
+    public:
+        using value_type = T;
+        using maps_own_pages = std::true_type;
+
+        mmap_allocator() noexcept {}
+
+        template <typename U>
+        mmap_allocator(const mmap_allocator<U>&) noexcept {}
+
+        T* allocate(std::size_t n) {
+            void* p = ::mmap(nullptr, bytes(n), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::bad_alloc();
             }
+            return static_cast<T*>(p);
+        }
 
-            size_type bucket_size(size_type n) {
-                size_type result = 0;
-                const auto& bucket = delegate.get().buckets[n];
-                for (size_type i = 0; i < SLOTS_PER_BUCKET; ++i) {
-                    if (bucket.occupied(i)) {
-                        ++result;
-                    }
-                }
-                return result;
-            }
-            size_type bucket(const key_type& key) const {
-                const hash_value hv = delegate.get().hashed_key(key);
-                const auto guard = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
-                const table_position pos =
-                    delegate.get().cuckoo_find(key, hv.partial, guard.first(), guard.second());
-                return bucket_size(pos.index);
-            }
+        // Anonymous mappings start out zero-filled, without touching a page.
+        T* allocate_zeroed(std::size_t n) {
+            return allocate(n);
+        }
 
-            local_iterator begin(size_type n) {
-                return local_iterator::begin(&delegate.get().buckets[n]);
-            }
-            const_local_iterator begin(size_type n) const {
-                return const_local_iterator::begin(&delegate.get().buckets[n]);
-            }
-            local_iterator end(size_type n) {
-                return local_iterator::end(&delegate.get().buckets[n]);
-            }
-            const_local_iterator end(size_type n) const {
-                return const_local_iterator::end(&delegate.get().buckets[n]);
-            }
-            const_local_iterator cbegin(size_type n) const {
-                return const_local_iterator::begin(&delegate.get().buckets[n]);
-            }
-            const_local_iterator cend(size_type n) const {
-                return const_local_iterator::end(&delegate.get().buckets[n]);
-            }
+        void deallocate(T* p, std::size_t n) noexcept {
+            ::munmap(p, bytes(n));
+        }
 
-            // hash policy:
-            void rehash(size_type n) {
-                delegate.get().template cuckoo_expand_simple<private_impl::LOCKING_INACTIVE, manual_resize>(n);
-            }
+        // reallocate grows a block returned by allocate(n) to new_n elements,
+        // moving its pages elsewhere if it cannot be extended where it is. The
+        // added memory is zeroed. Returns nullptr, leaving the block alone, if
+        // it cannot be grown.
+        T* reallocate(T* p, std::size_t n, std::size_t new_n) noexcept {
+            void* grown = ::mremap(p, bytes(n), bytes(new_n), MREMAP_MAYMOVE);
+            return grown == MAP_FAILED ? nullptr : static_cast<T*>(grown);
+        }
 
-            float load_factor() const noexcept {
-                return delegate.get().load_factor();
-                return delegate.get().load_factor();
-            }
+    private:
+        static std::size_t bytes(std::size_t n) {
+            return std::max<std::size_t>(n * sizeof(T), 1);
+        }
+    };
 
-        private:
-            unordered_map_view(concurrent_unordered_map<Key, Value, Hasher, Equality, Allocator>& delegate,
-                               all_buckets_write_guard<std::private_impl::LOCKING_ACTIVE>&& guard)
-                    : delegate(delegate)
-                    , guard(std::forward<all_buckets_write_guard<std::private_impl::LOCKING_ACTIVE>>(guard))
-            {
-            }
-            friend concurrent_unordered_map;
-        };
+    template <typename T, typename U>
+    bool operator==(const mmap_allocator<T>&, const mmap_allocator<U>&) noexcept {
+        return true;
+    }
 
-        // construct/destroy:
-        explicit concurrent_unordered_map(size_type n = 16,
-                                          const hasher& hash = hasher(),
-                                          const key_equal& key_comparator = key_equal(),
-                                          const allocator_type& allocator = allocator_type())
-            : allocator(allocator)
-            , hash(hash)
-            , key_comparator(key_comparator)
-            , buckets(reserve_calc(n), allocator)
-            , all_locks(allocator)
-            , minimum_load_factor_holder(private_impl::DEFAULT_MINIMUM_LOAD_FACTOR)
-            , maximum_hash_power_holder(private_impl::NO_MAXIMUM_HASHPOWER)
-            {
+    template <typename T, typename U>
+    bool operator!=(const mmap_allocator<T>&, const mmap_allocator<U>&) noexcept {
+        return false;
+    }
 
-                locks_t initial_locks(std::min(bucket_count(), size_type(std::private_impl::MAX_NUM_LOCKS)),
-                                      allocator);
-                all_locks.emplace_back(std::move(initial_locks));
-            }
-        template <typename InputIterator>
-        concurrent_unordered_map(InputIterator first, InputIterator last,
-                                 size_type n = private_impl::DEFAULT_SIZE,
-                                 const hasher& hash = hasher(),
-                                 const key_equal& key_comparator = key_equal(),
-                                 const allocator_type& allocator = allocator_type())
-            : allocator(allocator)
-            , hash(hash)
-            , key_comparator(key_comparator)
-            , buckets(reserve_calc(n), allocator)
-            , all_locks(allocator)
-            , minimum_load_factor_holder(private_impl::DEFAULT_MINIMUM_LOAD_FACTOR)
-            , maximum_hash_power_holder(private_impl::NO_MAXIMUM_HASHPOWER)
-            {
-                locks_t initial_locks(std::min(n, size_type(std::private_impl::MAX_NUM_LOCKS)), get_allocator());
-                all_locks.emplace_back(std::move(initial_locks));
-                for (auto i = first; i != last; ++i) {
-                    emplace(i->first, i->second);
-                }
-            }
-        concurrent_unordered_map(const allocator_type& allocator)
-            : allocator(allocator)
-            {
-            }
-        concurrent_unordered_map(concurrent_unordered_map&& source)
-            : allocator(std::move(source.allocator))
-            , hash(std::move(source.hash))
-            , key_comparator(std::move(source.key_comparator))
-            , buckets(std::move(source.buckets), std::move(source.allocator))
-            , all_locks(std::move(source.all_locks))
-            , minimum_load_factor_holder(source.minimum_load_factor_holder.
-                                         load(std::memory_order_acquire))
-            , maximum_hash_power_holder(source.maximum_hash_power_holder.
-                                       load(std::memory_order_acquire))
-        {
-        }
-        concurrent_unordered_map(concurrent_unordered_map&& source, const allocator_type& allocator)
-            : allocator(std::move(allocator))
-            , hash(std::move(source.hash))
-            , key_comparator(std::move(source.key_comparator))
-            , buckets(std::move(source.buckets), allocator)
-            , all_locks(std::move(source.locks), allocator)
-            , minimum_load_factor_holder(source.minimum_load_factor_holder.
-                                         load(std::memory_order_acquire))
-            , maximum_hash_power_holder(source.maximum_hash_power_holder.
-                                       load(std::memory_order_acquire))
-        {
-        }
-        concurrent_unordered_map(initializer_list<value_type> il,
-                                 size_type n = private_impl::DEFAULT_SIZE,
-                                 const hasher& hash = hasher(),
-                                 const key_equal& key_comparator = key_equal(),
-                                 const allocator_type& allocator = allocator_type())
-            : allocator(allocator)
-            , hash(hash)
-            , key_comparator(key_comparator)
-            , buckets(reserve_calc(n), allocator)
-            , all_locks(allocator)
-            , minimum_load_factor_holder(private_impl::DEFAULT_MINIMUM_LOAD_FACTOR)
-            , maximum_hash_power_holder(private_impl::NO_MAXIMUM_HASHPOWER)
-            {
-                all_locks.emplace_back(std::min(n, size_type(std::private_impl::MAX_NUM_LOCKS)), get_allocator());
-                for (auto i = il.begin(); i != il.end(); ++i) {
-                    emplace(i->first, i->second);
-                }
-            }
+    // huge_page_allocator backs large blocks with 2 MB pages, which cuts the
+    // TLB misses of random probes into big bucket and lock arrays; a table
+    // using it gets both. A large block comes from the reserved huge page pool
+    // (MAP_HUGETLB) when it has room, and otherwise from a 2 MB aligned mapping
+    // marked with MADV_HUGEPAGE, which transparent huge pages back when they
+    // are enabled. Blocks smaller than a huge page are plain mappings. Either
+    // way the memory is zero-filled.
+    template <typename T>
+    class huge_page_allocator {
+    public:
+        using value_type = T;
+        using maps_own_pages = std::true_type;
 
-        ~concurrent_unordered_map() = default;
+        huge_page_allocator() noexcept {}
 
-        unordered_map_view make_unordered_map_view(bool lock = false) noexcept {
-            if (lock) {
-                auto guard = snapshot_and_write_lock_all<std::private_impl::LOCKING_ACTIVE>();
-                return unordered_map_view(*this, std::move(guard));
-            } else {
-                return unordered_map_view(*this);
-            }
+        template <typename U>
+        huge_page_allocator(const huge_page_allocator<U>&) noexcept {}
+
+        T* allocate(std::size_t n) {
+            const std::size_t size = bytes(n);
+            if (size < private_impl::HUGE_PAGE_SIZE) {
+                return map(size);
+            }
+#if defined(MAP_HUGETLB)
+            void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) {
+                return static_cast<T*>(p);
+            }
+#endif
+            // Map an extra huge page and trim the ends, so the block starts on a
+            // huge page boundary and every page of it can be a huge one.
+            char* raw = reinterpret_cast<char*>(map(size + private_impl::HUGE_PAGE_SIZE));
+            const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(raw);
+            char* aligned = raw + ((private_impl::HUGE_PAGE_SIZE -
+                                    address % private_impl::HUGE_PAGE_SIZE) %
+                                   private_impl::HUGE_PAGE_SIZE);
+            if (aligned != raw) {
+                ::munmap(raw, aligned - raw);
+            }
+            ::munmap(aligned + size, raw + private_impl::HUGE_PAGE_SIZE - aligned);
+#if defined(MADV_HUGEPAGE)
+            ::madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+            return reinterpret_cast<T*>(aligned);
         }
 
-        // concurrent-safe assignment:
-        concurrent_unordered_map& operator=(concurrent_unordered_map&& source) noexcept {
-            if (this != &source) {
-                this->allocator = std::move(source.allocator);
-                this->hash = std::move(source.hash);
-                this->key_comparator = std::move(source.key_comparator);
-                this->buckets = std::move(source.buckets);
-                this->all_locks = std::move(source.all_locks);
-                this->minimum_load_factor_holder.store(source.minimum_load_factor_holder.
-                                                       load(std::memory_order_acquire),
-                                                       std::memory_order_release);
-                this->maximum_hash_power_holder.store(source.maximum_hash_power_holder.
-                                                     load(std::memory_order_acquire),
-                                                     std::memory_order_release);
-
-            }
-            return *this;
+        T* allocate_zeroed(std::size_t n) {
+            return allocate(n);
         }
 
-        concurrent_unordered_map& operator=(initializer_list<value_type> il) {
-            {
-                auto locked_table = make_unordered_map_view(true);
-                locked_table.clear();
-                locked_table.insert(il.begin(), il.end());
-            }
-            return *this;
+        void deallocate(T* p, std::size_t n) noexcept {
+            ::munmap(p, bytes(n));
         }
 
-        allocator_type get_allocator() const {
-            return allocator;
+    private:
+        // Large blocks are rounded up to whole huge pages, as MAP_HUGETLB
+        // mappings have to be.
+        static std::size_t bytes(std::size_t n) {
+            const std::size_t size = std::max<std::size_t>(n * sizeof(T), 1);
+            if (size < private_impl::HUGE_PAGE_SIZE) {
+                return size;
+            }
+            return (size + private_impl::HUGE_PAGE_SIZE - 1) / private_impl::HUGE_PAGE_SIZE *
+                   private_impl::HUGE_PAGE_SIZE;
         }
 
-        hasher hash_function() const {
-            return hash;
+        static T* map(std::size_t size) {
+            void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            return static_cast<T*>(p);
         }
+    };
 
-        key_equal key_eq() const {
-            return key_comparator;
-        }
+    template <typename T, typename U>
+    bool operator==(const huge_page_allocator<T>&, const huge_page_allocator<U>&) noexcept {
+        return true;
+    }
 
-        // concurrent-safe element retrieval:
-        experimental::optional<mapped_type> find(const key_type& key) const {
-            const hash_value hashvalue = hashed_key(key);
-            experimental::optional<mapped_type> result;
-            auto reader = [this, &result, &key, &hashvalue] (size_type first_index,
-                                                             size_type second_index) {
-                const table_position pos = cuckoo_find(key, hashvalue.partial,
-                                                       first_index, second_index);
-                if (pos.status == ok) {
-                    result = experimental::make_optional(buckets[pos.index].mapped(pos.slot));
-                }
-            };
-            const auto guard = snapshot_and_read_lock_two<decltype(reader)>(hashvalue);
-            guard.run(reader);
-            return result;
-        }
+    template <typename T, typename U>
+    bool operator!=(const huge_page_allocator<T>&, const huge_page_allocator<U>&) noexcept {
+        return false;
+    }
+#endif
+
+    // resize_policy collects the settings that decide when a table grows by
+    // itself and by how much:
+    //  - maximum_load_factor: above it, inserts expand the table on a
+    //    background thread before it fills up. NO_MAXIMUM_LOAD_FACTOR leaves
+    //    expansion to the inserts that find no free slot.
+    //  - growth_power: how much an automatic expansion adds to the hashpower;
+    //    1 doubles the table, 2 quadruples it.
+    //  - minimum_load_factor: automatic expansions below it throw
+    //    load_factor_too_low, which usually points at a bad hash function.
+    //  - maximum_hashpower: expansions beyond it throw
+    //    maximum_hashpower_exceeded.
+    struct resize_policy {
+        double maximum_load_factor = private_impl::NO_MAXIMUM_LOAD_FACTOR;
+        std::size_t growth_power = private_impl::DEFAULT_GROWTH_POWER;
+        double minimum_load_factor = private_impl::DEFAULT_MINIMUM_LOAD_FACTOR;
+        std::size_t maximum_hashpower = private_impl::NO_MAXIMUM_HASHPOWER;
+    };
 
-        mapped_type find(const key_type& key, const mapped_type& default_value) const {
-            return find(key).value_or(default_value);
-        }
+    // Displacement policies select how an insert looks for a cuckoo path when
+    // both buckets of the key are full. They are passed as the last template
+    // argument of concurrent_unordered_map.
+
+    // bfs_displacement runs a breadth-first search over cuckoo paths of at most
+    // MAX_PATH_LEN buckets, examining at most MAX_CUCKOO_COUNT slots. It finds
+    // the shortest path, so few elements are moved, but gives up early on
+    // nearly full tables. MAX_CUCKOO_COUNT must be a power of 2.
+    template <std::size_t MAX_PATH_LEN = private_impl::MAX_BFS_PATH_LEN,
+              std::size_t MAX_CUCKOO_COUNT = private_impl::DEFAULT_MAX_CUCKOO_COUNT>
+    struct bfs_displacement {
+        using search_tag = private_impl::bfs_search_tag;
+        static constexpr std::size_t max_path_length = MAX_PATH_LEN;
+        static constexpr std::size_t max_cuckoo_count = MAX_CUCKOO_COUNT;
+        static_assert(MAX_PATH_LEN > 0, "a cuckoo path holds at least one bucket");
+    };
 
-        // concurrent-safe modifiers:
-        template <typename F>
-        bool visit(const key_type& key, F functor) {
-            const hash_value hashvalue = hashed_key(key);
-            const auto guard = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hashvalue);
-            const table_position pos = cuckoo_find(key, hashvalue.partial,
-                                                   guard.first(), guard.second());
-            if (pos.status == ok) {
-                functor(buckets[pos.index].mapped(pos.slot));
-                return true;
-            }
-            return false;
-        }
+    // random_walk_displacement evicts a randomly chosen element at every step,
+    // for at most MAX_PATH_LEN steps. It inspects only one bucket per step, so
+    // it reaches much further than a BFS of the same cost and lets the table
+    // fill up higher before it is doubled, at the price of longer chains of
+    // moves.
+    template <std::size_t MAX_PATH_LEN = private_impl::DEFAULT_MAX_RANDOM_WALK_LEN>
+    struct random_walk_displacement {
+        using search_tag = private_impl::random_walk_search_tag;
+        static constexpr std::size_t max_path_length = MAX_PATH_LEN;
+        static_assert(MAX_PATH_LEN > 0, "a cuckoo path holds at least one bucket");
+    };
 
-        template <typename F>
-        bool visit(const key_type& key, F functor) const {
-            const hash_value hashvalue = hashed_key(key);
-            const auto guard = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hashvalue);
-            const table_position pos = cuckoo_find(key, hashvalue.partial,
-                                                   guard.first(), guard.second());
-            if (pos.status == ok) {
-                functor(buckets[pos.index].mapped(pos.slot));
-                return true;
-            }
-            return false;
-        }
+    template <class Key,
+              class Value,
+              class Hasher = std::hash<Key>,
+              class Equality = std::equal_to<Key>,
+              class Allocator = std::allocator<pair<const Key, Value>>,
+              class DisplacementPolicy = bfs_displacement<> >
+    class concurrent_unordered_map {
+    public:
+        // types:
+        using key_type          = Key;
+        using mapped_type       = Value;
+        using value_type        = pair<const Key, Value>;
+        using hasher            = Hasher;
+        using key_equal         = Equality;
+        using allocator_type    = Allocator;
+        using size_type         = std::size_t;
 
-        template<typename F>
-        void visit_all(F functor) {
-            locks_t& locks = get_current_locks();
-            for (auto i = 0; i < locks.size(); ++i) {
-                bucket_write_guard<private_impl::LOCKING_ACTIVE> guard(&locks, i);
-                const auto& bucket = buckets[i];
+    private:
+        using partial_t = private_impl::partial_t;
+        using buckets_t = private_impl::bucket_container<Key, Value,
+                                                         Allocator, partial_t,
+                                                         private_impl::DEFAULT_SLOTS_PER_BUCKET>;
+        using bucket = typename buckets_t::bucket;
 
-                for (size_type j = 0; j < SLOTS_PER_BUCKET; ++j) {
-                    if (bucket.occupied(i)) {
-                        functor(bucket.element(i));
-                    }
-                }
-            }
-        }
+        template <typename LOCK_TYPE>
+        class all_buckets_write_guard;
 
-        template<typename F>
-        void visit_all(F functor) const {
-            locks_t& locks = get_current_locks();
-            for (auto i = 0; i < locks.size(); ++i) {
-                bucket_write_guard<private_impl::LOCKING_ACTIVE> guard(&locks, i);
-                const auto& bucket = buckets[i];
+    public:
 
-                for (size_type j = 0; j < SLOTS_PER_BUCKET; ++j) {
-                    if (bucket.occupied(i)) {
-                        functor(bucket.element(i));
-                    }
-                }
-            }
-        }
+        class unordered_map_view {
+            std::reference_wrapper<concurrent_unordered_map> delegate;
+            all_buckets_write_guard<std::private_impl::LOCKING_ACTIVE> guard;
 
-        template <typename K, typename F, typename... Args>
-        bool emplace_or_visit(K&& key, F functor, Args&&... val) {
-            hash_value hv = hashed_key(key);
-            auto b = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hv);
-            table_position pos = cuckoo_insert_loop(hv, b, key);
-            if (pos.status == ok) {
-                add_to_bucket(pos.index, pos.slot, hv.partial, std::forward<K>(key),
-                              std::forward<Args>(val)...);
-            } else {
-                functor(buckets[pos.index].mapped(pos.slot));
-            }
-            return pos.status == ok;
-        }
+        public:
+            // types:
+            using key_type          = Key;
+            using mapped_type       = Value;
+            using value_type        = pair<const Key, Value>;
+            using hasher            = Hasher;
+            using key_equal         = Equality;
+            using allocator_type    = Allocator;
 
-        template <typename K, typename... Args>
-        bool emplace(K&& key, Args&&... val) {
-            hash_value hv = hashed_key(key);
-            auto b = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hv);
-            table_position pos = cuckoo_insert_loop(hv, b, key);
-            if (pos.status == ok) {
-                add_to_bucket(pos.index, pos.slot, hv.partial,
-                              std::forward<K>(key),
-                              std::forward<Args>(val)...);
-            }
+            using pointer           = typename allocator_traits<Allocator>::pointer;
+            using const_pointer     = typename allocator_traits<Allocator>::const_pointer;
+            using reference         = value_type&;
+            using const_reference   = const value_type&;
+            using size_type         = typename concurrent_unordered_map::size_type;
+            using difference_type   = std::ptrdiff_t;
 
-            return pos.status == ok;
-        }
+            class const_local_iterator {
+            public:
+                using difference_type = unordered_map_view::difference_type;
+                using value_type = unordered_map_view::value_type;
+                using pointer = unordered_map_view::const_pointer;
+                using reference = unordered_map_view::const_reference;
+                using iterator_category = std::bidirectional_iterator_tag;
 
-        template <typename K, typename... Args>
-        bool insert_or_assign(K&& key, Args&&... val)  {
-            hash_value hv = hashed_key(key);
-            auto b = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hv);
-            table_position pos = cuckoo_insert_loop(hv, b, key);
-            if (pos.status == ok) {
-                add_to_bucket(pos.index, pos.slot, hv.partial, std::forward<K>(key),
-                              std::forward<Args>(val)...);
-            } else {
-                if (std::is_assignable<mapped_type&, mapped_type>::value) {
-                    buckets[pos.index].mapped(pos.slot) = mapped_type(std::forward<Args>(val)...);
-                } else {
-                    buckets.erase_element(pos.index, pos.slot);
-                    buckets.set_element(pos.index, pos.slot, hv.partial, std::forward<K>(key),
-                                        std::forward<Args>(val)...);
-                }
-            }
-            return pos.status == ok;
-        }
+                const_local_iterator() = default;
 
-        template<typename K, typename... Args>
-        size_type update(K&& key, Args&&... val) {
-            const hash_value hv = hashed_key(key);
-            const auto guard = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hv);
-            const table_position pos = cuckoo_find(std::forward<K>(key), hv.partial, guard.first(), guard.second());
-            if (pos.status == ok) {
-                buckets[pos.index].mapped(pos.slot) = std::forward<mapped_type>(std::forward<Args>(val)...);
-                return 1;
-            } else {
-                return 0;
-            }
-        }
+                bool operator==(const const_local_iterator& other) const {
+                    return data == other.data && slot == other.slot;
+                }
 
-        template<typename K>
-        size_type erase(K&& key) {
-            const hash_value hv = hashed_key(key);
-            const auto guard = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hv);
-            const table_position pos =
-            cuckoo_find(std::forward<K>(key), hv.partial, guard.first(), guard.second());
-            if (pos.status == ok) {
-                del_from_bucket(pos.index, pos.slot);
-                return 1;
-            } else {
-                return 0;
-            }
-        }
+                bool operator!=(const const_local_iterator& other) const {
+                    return !(operator==(other));
+                }
 
-        template<typename K, typename F>
-        size_type erase_and_visit(K&& key, F functor) {
-            const hash_value hv = hashed_key(key);
-            const auto guard = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hv);
-            const table_position pos =
-                    cuckoo_find(std::forward<K>(key), hv.partial, guard.first(), guard.second());
-            if (pos.status == ok) {
-                if (functor(buckets[pos.index].mapped(pos.slot))) {
-                    del_from_bucket(pos.index, pos.slot);
+                reference operator*() const {
+                    return data->element(slot);
                 }
-                return 1;
-            } else {
-                return 0;
-            }
-        }
 
-        template<class H2, class P2>
-        void merge(concurrent_unordered_map<Key, Value, H2, P2, Allocator>& source) {
-            auto locked_table = source.lock_table();
-            insert(locked_table.begin(), locked_table.end());
-        }
-        template<class H2, class P2>
-        void merge(concurrent_unordered_map<Key, Value, H2, P2, Allocator>&& source) {
-            auto locked_table = source.lock_table();
-            insert(locked_table.begin(), locked_table.end());
-        }
+                pointer operator->() const {
+                    return std::addressof(operator*());
+                }
 
-        void swap(concurrent_unordered_map& other) noexcept {
-            std::swap(hash, other.hash);
-            std::swap(key_comparator, other.key_comparator);
-            buckets.swap(other.buckets);
-            all_locks.swap(other.all_locks);
+                const_local_iterator& operator++() {
+                    if (slot < private_impl::DEFAULT_SLOTS_PER_BUCKET) {
+                        ++slot;
+                        while (slot < private_impl::DEFAULT_SLOTS_PER_BUCKET &&
+                               !data->occupied(slot)) {
+                            ++slot;
+                        }
+                    }
 
-            other.minimum_load_factor_holder.store(
-                    minimum_load_factor_holder.exchange(other.minimum_load_factor(), std::memory_order_release),
-                    std::memory_order_release);
-            other.maximum_hash_power_holder.store(
-                    maximum_hash_power_holder.exchange(other.maximum_hashpower(), std::memory_order_release),
-                    std::memory_order_release);
-        }
+                    return *this;
+                }
 
-        void clear() noexcept {
-            auto unlocker = snapshot_and_write_lock_all<private_impl::LOCKING_ACTIVE>();
-            buckets.clear();
-            auto& locks = get_current_locks();
-            for (size_type i = 0; i < locks.size(); ++i) {
-                locks[i].elem_counter() = 0;
-            }
-        }
+                const_local_iterator operator++(int) {
+                    const_local_iterator old(*this);
+                    ++(*this);
+                    return std::move(old);
+                }
 
-    private:
-        template <typename U>
-        using rebind_alloc =
-        typename std::allocator_traits<allocator_type>::template rebind_alloc<U>;
+                const_local_iterator operator--() {
+                    --slot;
+                    while(!data->occupied(slot)) {
+                        --slot;
+                    }
+                    return *this;
+                }
 
-        using lock_t = typename std::conditional<std::is_pod<Value>::value,
-                                                 private_impl::versioned_synchronizer,
-                                                 private_impl::shared_mutex_adapter>::type;
-        using locks_t = std::vector<lock_t, rebind_alloc<lock_t>>;
-        using all_locks_t = std::list<locks_t, rebind_alloc<locks_t>>;
+                const_local_iterator operator--(int) {
+                    const_local_iterator old(*this);
+                    --(*this);
+                    return std::move(old);
+                }
 
-        using hash_value = private_impl::hash_value;
+            protected:
+                const_local_iterator(bucket* data, size_type slot) noexcept
+                    : data(data)
+                    , slot(slot) {
+                    if (slot < private_impl::DEFAULT_SLOTS_PER_BUCKET &&
+                        !data->occupied(slot)) {
+                        operator++();
+                    }
+                }
 
-        static constexpr auto SLOTS_PER_BUCKET = private_impl::DEFAULT_SLOTS_PER_BUCKET;
-        static constexpr auto MAX_BFS_PATH_LEN = private_impl::MAX_BFS_PATH_LEN;
+                static const_local_iterator begin(bucket* data) {
+                    return const_local_iterator(data, 0);
+                }
 
-        using bfs_slot = private_impl::bfs_slot<SLOTS_PER_BUCKET>;
-        using bfs_queue = private_impl::bfs_queue<SLOTS_PER_BUCKET>;
+                static const_local_iterator end(bucket* data) {
+                    return const_local_iterator(data, private_impl::DEFAULT_SLOTS_PER_BUCKET);
+                }
 
-        // Hashing types and functions
+                bucket* data;
+                size_type slot;
+                friend class bucket_iterator;
+                friend class unordered_map_view;
+            };
 
-        // true if the key is small and simple, which means using partial keys for
-        // lookup would probably slow us down
-        static constexpr bool is_simple =
-            std::is_pod<key_type>::value && sizeof(key_type) <= 8;
+            class local_iterator : public const_local_iterator {
+            public:
+                using pointer = unordered_map_view::pointer;
+                using reference = unordered_map_view::reference;
 
-        // The partial key must only depend on the hash value. It cannot change with
-        // the hashpower, because, in order for `cuckoo_fast_double` to work
-        // properly, the alt_index must only grow by one bit at the top each time we
-        // expand the table.
-        static partial_t partial_key(const size_type hash) {
-            const uint64_t hash_64bit = hash;
-            const uint32_t hash_32bit = (static_cast<uint32_t>(hash_64bit) ^
-                                         static_cast<uint32_t>(hash_64bit >> 32));
-            const uint16_t hash_16bit = (static_cast<uint16_t>(hash_32bit) ^
-                                         static_cast<uint16_t>(hash_32bit >> 16));
-            const uint16_t hash_8bit = (static_cast<uint8_t>(hash_16bit) ^
-                                        static_cast<uint8_t>(hash_16bit >> 8));
-            return hash_8bit;
-        }
+                local_iterator() {}
 
-        template <typename K>
-        hash_value hashed_key(const K& key) const {
-            const size_type h = hash(key);
-            return {h, partial_key(h)};
-        }
+                bool operator==(const local_iterator& it) const {
+                    return const_local_iterator::operator==(it);
+                }
 
-        template <typename K>
-        size_type hashed_key_only_hash(const K &key) const {
-            return hash(key);
-        }
+                bool operator!=(const local_iterator& it) const {
+                    return const_local_iterator::operator!=(it);
+                }
 
-        // Status codes for internal functions
-        enum operation_status {
-            ok,
-            failure,
-            failure_key_not_found,
-            failure_key_duplicated,
-            failure_table_full,
-            failure_under_expansion,
-        };
+                reference operator*() {
+                    return const_local_iterator::data->element(const_local_iterator::slot);
+                }
 
-        // A composite type for functions that need to return a table position, and
-        // a status code.
-        struct table_position {
-            size_type index;
-            size_type slot;
-            operation_status status;
-        };
+                pointer operator->() {
+                    return std::addressof(operator*());
+                }
 
-        // hashsize returns the number of buckets corresponding to a given
-        // hashpower.
-        static inline size_type hashsize(const size_type hashpower) {
-            return size_type(1) << hashpower;
-        }
+                const_reference operator*() const {
+                    return const_local_iterator::data->element(const_local_iterator::slot);
+                }
 
+                const_pointer operator->() const {
+                    return std::addressof(operator*());
+                }
+
+
+                local_iterator& operator++() {
+                    const_local_iterator::operator++();
+                    return *this;
+                }
+
+                local_iterator operator++(int) {
+                    iterator old(*this);
+                    const_local_iterator::operator++();
+                    return std::move(old);
+                }
+
+                local_iterator& operator--() {
+                    const_local_iterator::operator--();
+                    return *this;
+                }
+
+                local_iterator operator--(int) {
+                    local_iterator old(*this);
+                    const_local_iterator::operator--();
+                    return std::move(old);
+                }
+
+            private:
+                local_iterator(bucket* data, size_type slot) noexcept
+                   : const_local_iterator(data, slot)
+                    {
+                    }
+
+                static local_iterator begin(bucket* data) {
+                    return local_iterator(data, 0);
+                }
+
+                static local_iterator end(bucket* data) {
+                    return local_iterator(data, private_impl::DEFAULT_SLOTS_PER_BUCKET);
+                }
+
+                friend class bucket_iterator;
+                friend class unordered_map_view;
+            };
+
+            class const_iterator {
+            public:
+                using difference_type = unordered_map_view::difference_type;
+                using value_type = unordered_map_view::value_type;
+                using pointer = unordered_map_view::const_pointer;
+                using reference = unordered_map_view::const_reference;
+                using iterator_category = std::bidirectional_iterator_tag;
+
+                const_iterator() {}
+
+                bool operator==(const const_iterator& other) const {
+                    return owner == other.owner && bucket_index == other.bucket_index &&
+                        (bucket_position == other.bucket_position ||
+                         bucket_index == owner->total_bucket_count());
+                }
+
+                bool operator!=(const const_iterator& it) const {
+                    return !const_iterator::operator==(it);
+                }
+
+                reference operator*() const {
+                    return *bucket_position;
+                }
+
+                pointer operator->() const {
+                    return bucket_position.operator->();
+                }
+
+                const_iterator& operator++() {
+                    increment();
+                    return *this;
+                }
+
+                const_iterator operator++(int) {
+                    const_iterator old(*this);
+                    ++(*this);
+                    return std::move(old);
+                }
+
+                const_iterator& operator--() {
+                    decrement();
+                    return *this;
+                }
+
+                const_iterator operator--(int) {
+                    const_iterator old(*this);
+                    --(*this);
+                    return std::move(old);
+                }
+
+            protected:
+                // The iteration range covers the main buckets followed by the
+                // overflow stash buckets, see concurrent_unordered_map::bucket_at.
+                // Empty buckets are skipped with the occupancy summaries.
+                void increment() {
+                    ++bucket_position;
+                    if (bucket_position == local_iterator::end(&owner->bucket_at(bucket_index))) {
+                        bucket_index = owner->next_occupied_bucket(bucket_index + 1);
+                        if (bucket_index < owner->total_bucket_count()) {
+                            bucket_position = local_iterator::begin(&owner->bucket_at(bucket_index));
+                        }
+                    }
+                }
+
+                void decrement() {
+                    if (bucket_index == owner->total_bucket_count() ||
+                            local_iterator::begin(&owner->bucket_at(bucket_index)) == bucket_position) {
+                        --bucket_index;
+                        while (local_iterator::begin(&owner->bucket_at(bucket_index)) ==
+                               local_iterator::end(&owner->bucket_at(bucket_index))) {
+                            --bucket_index;
+                        }
+                        bucket_position = local_iterator::end(&owner->bucket_at(bucket_index));
+                        --bucket_position;
+                    } else {
+                        --bucket_position;
+                    }
+                }
+
+                const_iterator(concurrent_unordered_map* owner, size_type bucket_index, size_type slot)
+                    : owner(owner)
+                    , bucket_index(bucket_index)
+                    , bucket_position(&owner->bucket_at(bucket_index != owner->total_bucket_count()
+                                                        ? bucket_index : 0),
+                                      slot)
+                    {
+                        if (bucket_index < owner->total_bucket_count() &&
+                            bucket_position == local_iterator::end(&owner->bucket_at(bucket_index))) {
+                            increment();
+                        }
+                    }
+
+                const_local_iterator begin(bucket* bucket) {
+                    return const_local_iterator::begin(bucket);
+                }
+
+                const_local_iterator end(bucket* bucket) {
+                    return const_local_iterator::end(bucket);
+                }
+
+                concurrent_unordered_map* owner;
+                size_type bucket_index;
+                local_iterator bucket_position;
+                friend class unordered_map_view;
+            };
+
+            class iterator : public const_iterator {
+            public:
+                using difference_type = unordered_map_view::difference_type;
+                using value_type = unordered_map_view::value_type;
+                using pointer = unordered_map_view::pointer;
+                using const_pointer = unordered_map_view::const_pointer;
+                using reference = unordered_map_view::reference;
+                using const_reference = unordered_map_view::const_reference;
+                using iterator_category = std::bidirectional_iterator_tag;
+
+                iterator() {}
+
+                bool operator==(const iterator& other) const {
+                    return this->owner == other.owner && this->bucket_index == other.bucket_index &&
+                        (this->bucket_position == other.bucket_position ||
+                         this->bucket_index == this->owner->total_bucket_count());
+                }
+                bool operator!=(const iterator& it) const {
+                    return !operator==(it);
+                }
+
+                const_reference operator*() const {
+                    return *this->bucket_position;
+                }
+                reference operator*() {
+                    return *this->bucket_position;
+                }
+
+                const_pointer operator->() const {
+                    return this->bucket_position.operator->();
+                }
+                pointer operator->() {
+                    return this->bucket_position.operator->();
+                }
+
+                iterator operator++() {
+                    const_iterator::increment();
+                    return *this;
+                }
+                iterator& operator++(int) {
+                    iterator old(*this);
+                    const_iterator::increment();
+                    return std::move(old);
+                }
+
+                iterator operator--() {
+                    const_iterator::decrement();
+                    return *this;
+                }
+                iterator& operator--(int) {
+                    iterator old(*this);
+                    --(*this);
+                    return std::move(old);
+                }
+
+            private:
+                iterator(concurrent_unordered_map* owner, size_type bucket_index, size_type slot)
+                    : const_iterator(owner, bucket_index, slot)
+                    {
+                    }
+
+                local_iterator begin(bucket* bucket) {
+                    return local_iterator::begin(bucket);
+                }
+
+                local_iterator end(bucket* bucket) {
+                    return local_iterator::end(bucket);
+                }
+
+                friend class unordered_map_view;
+            };
+
+            // construct/copy/destroy:
+            unordered_map_view() = delete;
+            unordered_map_view(concurrent_unordered_map& delegate)
+                : delegate(delegate)
+                {
+                }
+
+            // iterators:
+            iterator begin() noexcept {
+                return iterator(&delegate.get(), 0, 0);
+            }
+            const_iterator begin() const noexcept {
+                return const_iterator(&delegate.get(), 0, 0);
+            }
+            iterator end() noexcept {
+                return iterator(&delegate.get(), delegate.get().total_bucket_count(), 0);
+            }
+            const_iterator end() const noexcept {
+                return const_iterator(&delegate.get(), delegate.get().total_bucket_count(), 0);
+            }
+            const_iterator cbegin() const noexcept {
+                return const_iterator(&delegate.get(), 0, 0);
+            }
+            const_iterator cend() const noexcept {
+                return const_iterator(&delegate.get(), delegate.get().total_bucket_count(), 0);
+            }
+
+            // capacity:
+            bool empty() const noexcept {
+                return delegate.get().size() == 0;
+            }
+
+            size_type size() const noexcept {
+                return delegate.get().size();
+            }
+
+            size_type max_size() const noexcept {
+                return 1U << delegate.get().buckets->maximum_hashpower();
+            }
+
+            bool operator==(const unordered_map_view& other) const {
+                if (size() != other.size()) {
+                    return false;
+                }
+                for (const auto& elem : other) {
+                    auto it = find(elem.first);
+                    if (it == end() || it->second != elem.second) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            bool operator!=(const unordered_map_view& other) const {
+                if (size() != other.size()) {
+                    return true;
+                }
+                for (const auto& elem : other) {
+                    auto it = find(elem.first);
+                    if (it == end() || it->second != elem.second) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // modifiers:
+            template<typename... Args>
+            pair<iterator, bool> emplace(Args&&... args) {
+                value_type x(std::forward(args)...);
+                return insert(std::move(x));
+            }
+
+            pair<iterator, bool> insert(const value_type& x) {
+                hash_value hv = delegate.get().hashed_key(x.first);
+                auto b = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
+                table_position pos = delegate.get().cuckoo_insert_loop(hv, b, x.first);
+                if (pos.status == ok) {
+                    delegate.get().add_to_bucket(pos.index, pos.slot, hv.partial,
+                                                 x.first,
+                                                 x.second);
+                } else {
+                    assert(pos.status == failure_key_duplicated);
+                }
+                return std::make_pair(iterator(&delegate.get(), pos.index, pos.slot),
+                                               pos.status == ok);
+            }
+            pair<iterator, bool> insert(value_type&& x) {
+                hash_value hv = delegate.get().hashed_key(x.first);
+                auto b = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
+                table_position pos = delegate.get().cuckoo_insert_loop(hv, b, x.first);
+                if (pos.status == ok) {
+                    delegate.get().add_to_bucket(pos.index, pos.slot, hv.partial,
+                                                 std::move(const_cast<key_type&>(x.first)),
+                                                 std::move(x.second));
+                } else {
+                    assert(pos.status == failure_key_duplicated);
+                }
+                return std::make_pair(iterator(&delegate.get(), pos.index, pos.slot),
+                                               pos.status == ok);
+            }
+            void insert(initializer_list<value_type> il) {
+                for (auto pos = il.begin(); pos != il.end(); ++pos)  {
+                    insert(*pos);
+                }
+            }
+            template<class InputIterator>
+            void insert(InputIterator first, InputIterator last) {
+                for (auto i = first; i != last; ++i) {
+                    insert(*i);
+                }
+            }
+
+            template <class M>
+            pair<iterator, bool> insert_or_assign(const key_type& key, M&& obj) {
+                hash_value hv = delegate.get().hashed_key(key);
+                auto b = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
+                table_position pos = delegate.get().cuckoo_insert_loop(hv, b, key);
+                if (pos.status == ok) {
+                    delegate.get().add_to_bucket(pos.index, pos.slot, hv.partial,
+                                           key,
+                                           std::forward<M>(obj));
+                } else {
+                    assert(pos.status == failure_key_duplicated);
+                    b.element(pos.slot) = std::forward<M>(obj);
+                }
+                return std::make_pair(iterator(&delegate.get(), pos.index, pos.slot),
+                                      pos.status == ok);
+            }
+            template <class M>
+            pair<iterator, bool> insert_or_assign(key_type&& key, M&& obj) {
+                hash_value hv = delegate.get().hashed_key(key);
+                auto b = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
+                table_position pos = delegate.get().cuckoo_insert_loop(hv, b, key);
+                if (pos.status == ok) {
+                    delegate.get().add_to_bucket(pos.index, pos.slot, hv.partial,
+                                           std::forward<key_type>(key),
+                                           std::forward<M>(obj));
+                } else {
+                    assert(pos.status == failure_key_duplicated);
+                    b.element(pos.slot) = std::forward<M>(obj);
+                }
+                return std::make_pair(iterator(&delegate.get(), pos.index, pos.slot),
+                                      pos.status == ok);
+
+            }
+
+            iterator erase(iterator position) {
+                delegate.get().del_from_bucket(position.bucket_index, position.bucket_position.slot);
+                iterator result(&delegate.get(), position.bucket_index, position.bucket_position.slot);
+                return result;
+            }
+            iterator erase(const_iterator position) {
+                delegate.get().del_from_bucket(position.bucket_index, position.bucket_position.slot);
+                iterator result(&delegate.get(), position.bucket_index, position.bucket_position.slot);
+                return result;
+            }
+            size_type erase(const key_type& key) {
+                const hash_value hv = delegate.get().hashed_key(key);
+                const auto guard = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
+                const table_position pos =
+                    delegate.get().cuckoo_find(key, hv, guard.first(), guard.second());
+                if (pos.status == ok) {
+                    delegate.get().del_from_bucket(pos.index, pos.slot);
+                    return 1;
+                } else {
+                    return 0;
+                }
+            }
+
+            iterator erase(const_iterator first, const_iterator last) {
+                for (auto pos = first; pos != last; ++pos) {
+                    erase(pos);
+                }
+                return iterator(&delegate.get(), last.bucket_index, last.slot);
+            }
+
+            void swap(unordered_map_view& other) noexcept {
+                guard.swap(other.guard);
+                delegate.swap(other);
+            }
+
+            void clear() noexcept {
+                delegate.get().buckets.clear();
+                delegate.get().clear_stash();
+                auto& locks = delegate.get().get_current_locks();
+                for (size_type i = 0; i < locks.size(); ++i) {
+                    locks[i].elem_counter() = 0;
+                }
+            }
+
+            template<class H2, class P2>
+            void merge(concurrent_unordered_map<Key, Value, H2, P2, Allocator, DisplacementPolicy>& source) {
+                auto locked_table = source.lock_table();
+                insert(locked_table.begin(), locked_table.end());
+            }
+
+            template<class H2, class P2>
+            void merge(concurrent_unordered_map<Key, Value, H2, P2, Allocator, DisplacementPolicy>&& source) {
+                auto locked_table = source.lock_table();
+                insert(locked_table.begin(), locked_table.end());
+            }
+
+            // observers:
+            allocator_type get_allocator() const {
+                return delegate.get().get_allocator();
+            }
+            hasher hash_function() const {
+                return delegate.get().hash_function();
+            }
+            key_equal key_eq() const {
+                return delegate.get().key_eq();
+            }
+
+            // map operations:
+            iterator find(const key_type& key) {
+                const hash_value hashvalue = delegate.get().hashed_key(key);
+                const auto guard = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hashvalue);
+                const table_position pos = delegate.get().cuckoo_find(key, hashvalue,
+                                                                guard.first(), guard.second());
+                if (pos.status == ok) {
+                    return iterator(&delegate.get(), pos.index, pos.slot);
+                } else {
+                    return end();
+                }
+            }
+            const_iterator find(const key_type& key) const {
+                const hash_value hashvalue = delegate.get().hashed_key(key);
+                const auto guard = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hashvalue);
+                const table_position pos = delegate.get().cuckoo_find(key, hashvalue,
+                                                                guard.first(), guard.second());
+                if (pos.status == ok) {
+                    return iterator(&delegate.get(), pos.index, pos.slot);
+                } else {
+                    return end();
+                }
+            }
+            size_type count(const key_type& key) const {
+                return find(key) != cend();
+            }
+            pair<iterator, iterator> equal_range(const key_type& key) {
+                //DO we really need it?
+                auto start = find(key);
+                auto end = start;
+                ++end;
+                return make_pair(start, end);
+            }
+            pair<const_iterator, const_iterator> equal_range(const key_type& key) const {
+                //DO we really need it?
+                auto start = find(key);
+                auto end = start;
+                ++end;
+                return make_pair(start, end);
+            }
+
+            // element access:
+            mapped_type& operator[](const key_type& key) {
+                auto result = insert(value_type(key, {}));
+                return result.first->second;
+            }
+            mapped_type& operator[](key_type&& key) {
+                auto result = insert(std::move(value_type(std::forward<key_type>(key), {})));
+                return result.first->second;
+            }
+            const mapped_type& at(const key_type& key) const {
+                auto it = find(key);
+                if (it == end()) {
+                    throw std::out_of_range("key not found in table");
+                } else {
+                    return it->second;
+                }
+            }
+            mapped_type& at(const key_type& key) {
+                auto it = find(key);
+                if (it == end()) {
+                    throw std::out_of_range("key not found in table");
+                } else {
+                    return it->second;
+                }
+            }
+
+            size_type bucket_count() const {
+                return delegate.get().buckets.size();
+            }
+
+            size_type max_bucket_count() const {
+                return std::numeric_limits<size_type>::max() / SLOTS_PER_BUCKET;
+            }
+
+            size_type bucket_size(size_type n) {
+                size_type result = 0;
+                const auto& bucket = delegate.get().buckets[n];
+                for (size_type i = 0; i < SLOTS_PER_BUCKET; ++i) {
+                    if (bucket.occupied(i)) {
+                        ++result;
+                    }
+                }
+                return result;
+            }
+            size_type bucket(const key_type& key) const {
+                const hash_value hv = delegate.get().hashed_key(key);
+                const auto guard = delegate.get().template snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
+                const table_position pos =
+                    delegate.get().cuckoo_find(key, hv, guard.first(), guard.second());
+                return bucket_size(pos.index);
+            }
+
+            local_iterator begin(size_type n) {
+                return local_iterator::begin(&delegate.get().buckets[n]);
+            }
+            const_local_iterator begin(size_type n) const {
+                return const_local_iterator::begin(&delegate.get().buckets[n]);
+            }
+            local_iterator end(size_type n) {
+                return local_iterator::end(&delegate.get().buckets[n]);
+            }
+            const_local_iterator end(size_type n) const {
+                return const_local_iterator::end(&delegate.get().buckets[n]);
+            }
+            const_local_iterator cbegin(size_type n) const {
+                return const_local_iterator::begin(&delegate.get().buckets[n]);
+            }
+            const_local_iterator cend(size_type n) const {
+                return const_local_iterator::end(&delegate.get().buckets[n]);
+            }
+
+            // hash policy:
+            void rehash(size_type n) {
+                delegate.get().template cuckoo_expand_simple<private_impl::LOCKING_INACTIVE, manual_resize>(n);
+            }
+
+            float load_factor() const noexcept {
+                return delegate.get().load_factor();
+                return delegate.get().load_factor();
+            }
+
+        private:
+            unordered_map_view(concurrent_unordered_map& delegate,
+                               all_buckets_write_guard<std::private_impl::LOCKING_ACTIVE>&& guard)
+                    : delegate(delegate)
+                    , guard(std::forward<all_buckets_write_guard<std::private_impl::LOCKING_ACTIVE>>(guard))
+            {
+            }
+            friend concurrent_unordered_map;
+        };
+
+        // concurrent_range iterates over the table without stopping it. It
+        // takes the lock of one lock stripe at a time, shared, while it hands
+        // out the elements in that stripe's buckets, and then goes over the
+        // stash the same way. Each element is handed out at most once, but the
+        // range is no snapshot: elements that other threads insert or erase
+        // meanwhile may or may not show up, and so may elements that they move
+        // from a stripe the range has not reached to one it is done with. A
+        // resize that moves the elements to other lock stripes, which only
+        // happens to tables with fewer buckets than lock stripes or when
+        // rehashing, ends the range early; see interrupted.
+        //
+        // The iterators are single pass, and all of them move the range
+        // along. While the range holds a lock, the iterating thread must not
+        // otherwise use the table.
+        class concurrent_range;
+
+        // construct/destroy:
+        explicit concurrent_unordered_map(size_type n = 16,
+                                          const hasher& hash = hasher(),
+                                          const key_equal& key_comparator = key_equal(),
+                                          const allocator_type& allocator = allocator_type())
+            : allocator(allocator)
+            , hash(hash)
+            , key_comparator(key_comparator)
+            , buckets(reserve_calc(n), allocator)
+            , all_locks(allocator)
+            , old_buckets(0, allocator)
+            , migration_cursor(0)
+            , stripes_left(0)
+            , expanding(false)
+            , expansion_source_hp(0)
+            , expansion_in_place(false)
+            , old_bucket_array(nullptr)
+            , minimum_load_factor_holder(private_impl::DEFAULT_MINIMUM_LOAD_FACTOR)
+            , maximum_hash_power_holder(private_impl::NO_MAXIMUM_HASHPOWER)
+            , maximum_displacement_work_holder(private_impl::NO_MAXIMUM_DISPLACEMENT_WORK)
+            , shrink_load_factor_holder(private_impl::NO_AUTOMATIC_SHRINK)
+            , maximum_load_factor_holder(private_impl::NO_MAXIMUM_LOAD_FACTOR)
+            , growth_power_holder(private_impl::DEFAULT_GROWTH_POWER)
+            , placement_holder(placement_policy::local)
+            , below_shrink_load_factor(false)
+            , stash(reserve_calc(private_impl::STASH_SLOTS), allocator)
+            , stash_count(0)
+            , stash_reserved(0)
+            {
+
+                locks_t initial_locks(std::min(bucket_count(), size_type(std::private_impl::MAX_NUM_LOCKS)),
+                                      allocator);
+                all_locks.emplace_back(std::move(initial_locks));
+            }
+        template <typename InputIterator>
+        concurrent_unordered_map(InputIterator first, InputIterator last,
+                                 size_type n = private_impl::DEFAULT_SIZE,
+                                 const hasher& hash = hasher(),
+                                 const key_equal& key_comparator = key_equal(),
+                                 const allocator_type& allocator = allocator_type())
+            : allocator(allocator)
+            , hash(hash)
+            , key_comparator(key_comparator)
+            , buckets(reserve_calc(bulk_load_size(first, last, n)), allocator)
+            , all_locks(allocator)
+            , old_buckets(0, allocator)
+            , migration_cursor(0)
+            , stripes_left(0)
+            , expanding(false)
+            , expansion_source_hp(0)
+            , expansion_in_place(false)
+            , old_bucket_array(nullptr)
+            , minimum_load_factor_holder(private_impl::DEFAULT_MINIMUM_LOAD_FACTOR)
+            , maximum_hash_power_holder(private_impl::NO_MAXIMUM_HASHPOWER)
+            , maximum_displacement_work_holder(private_impl::NO_MAXIMUM_DISPLACEMENT_WORK)
+            , shrink_load_factor_holder(private_impl::NO_AUTOMATIC_SHRINK)
+            , maximum_load_factor_holder(private_impl::NO_MAXIMUM_LOAD_FACTOR)
+            , growth_power_holder(private_impl::DEFAULT_GROWTH_POWER)
+            , placement_holder(placement_policy::local)
+            , below_shrink_load_factor(false)
+            , stash(reserve_calc(private_impl::STASH_SLOTS), allocator)
+            , stash_count(0)
+            , stash_reserved(0)
+            {
+                locks_t initial_locks(std::min(bucket_count(), size_type(std::private_impl::MAX_NUM_LOCKS)),
+                                      get_allocator());
+                all_locks.emplace_back(std::move(initial_locks));
+                bulk_load(first, last);
+            }
+        concurrent_unordered_map(const allocator_type& allocator)
+            : allocator(allocator)
+            , old_buckets(0, allocator)
+            , migration_cursor(0)
+            , stripes_left(0)
+            , expanding(false)
+            , expansion_source_hp(0)
+            , expansion_in_place(false)
+            , old_bucket_array(nullptr)
+            , minimum_load_factor_holder(private_impl::DEFAULT_MINIMUM_LOAD_FACTOR)
+            , maximum_hash_power_holder(private_impl::NO_MAXIMUM_HASHPOWER)
+            , shrink_load_factor_holder(private_impl::NO_AUTOMATIC_SHRINK)
+            , maximum_load_factor_holder(private_impl::NO_MAXIMUM_LOAD_FACTOR)
+            , growth_power_holder(private_impl::DEFAULT_GROWTH_POWER)
+            , placement_holder(placement_policy::local)
+            , below_shrink_load_factor(false)
+            {
+            }
+        concurrent_unordered_map(concurrent_unordered_map&& source)
+            : maintenance(std::move(source.maintenance))
+            , background_expansion(std::move(source.quiesce().background_expansion))
+            , background_reclaim(std::move(source.background_reclaim))
+            , allocator(std::move(source.allocator))
+            , hash(std::move(source.hash))
+            , key_comparator(std::move(source.key_comparator))
+            , buckets(std::move(source.buckets), std::move(source.allocator))
+            , all_locks(std::move(source.all_locks))
+            , old_buckets(0, allocator)
+            , migration_cursor(0)
+            , stripes_left(0)
+            , expanding(false)
+            , expansion_source_hp(0)
+            , expansion_in_place(false)
+            , old_bucket_array(nullptr)
+            , minimum_load_factor_holder(source.minimum_load_factor_holder.
+                                         load(std::memory_order_acquire))
+            , maximum_hash_power_holder(source.maximum_hash_power_holder.
+                                       load(std::memory_order_acquire))
+            , maximum_displacement_work_holder(source.maximum_displacement_work_holder.
+                                               load(std::memory_order_acquire))
+            , shrink_load_factor_holder(source.shrink_load_factor_holder.
+                                        load(std::memory_order_acquire))
+            , maximum_load_factor_holder(source.maximum_load_factor_holder.
+                                         load(std::memory_order_acquire))
+            , growth_power_holder(source.growth_power_holder.load(std::memory_order_acquire))
+            , placement_holder(source.placement_holder.load(std::memory_order_acquire))
+            , below_shrink_load_factor(false)
+            , stash(std::move(source.stash))
+            , stash_count(source.stash_count.load(std::memory_order_acquire))
+            , stash_reserved(source.stash_reserved)
+            , stash_tags(source.stash_tags)
+        {
+            // The retired lock arrays moved over with the list that holds them.
+            source.retired.flush();
+        }
+        concurrent_unordered_map(concurrent_unordered_map&& source, const allocator_type& allocator)
+            : maintenance(std::move(source.maintenance))
+            , background_expansion(std::move(source.quiesce().background_expansion))
+            , background_reclaim(std::move(source.background_reclaim))
+            , allocator(std::move(allocator))
+            , hash(std::move(source.hash))
+            , key_comparator(std::move(source.key_comparator))
+            , buckets(std::move(source.buckets), allocator)
+            , all_locks(std::move(source.locks), allocator)
+            , old_buckets(0, allocator)
+            , migration_cursor(0)
+            , stripes_left(0)
+            , expanding(false)
+            , expansion_source_hp(0)
+            , expansion_in_place(false)
+            , old_bucket_array(nullptr)
+            , minimum_load_factor_holder(source.minimum_load_factor_holder.
+                                         load(std::memory_order_acquire))
+            , maximum_hash_power_holder(source.maximum_hash_power_holder.
+                                       load(std::memory_order_acquire))
+            , maximum_displacement_work_holder(source.maximum_displacement_work_holder.
+                                               load(std::memory_order_acquire))
+            , shrink_load_factor_holder(source.shrink_load_factor_holder.
+                                        load(std::memory_order_acquire))
+            , maximum_load_factor_holder(source.maximum_load_factor_holder.
+                                         load(std::memory_order_acquire))
+            , growth_power_holder(source.growth_power_holder.load(std::memory_order_acquire))
+            , placement_holder(source.placement_holder.load(std::memory_order_acquire))
+            , below_shrink_load_factor(false)
+            , stash(std::move(source.stash))
+            , stash_count(source.stash_count.load(std::memory_order_acquire))
+            , stash_reserved(source.stash_reserved)
+            , stash_tags(source.stash_tags)
+        {
+            // The retired lock arrays moved over with the list that holds them.
+            source.retired.flush();
+        }
+        concurrent_unordered_map(initializer_list<value_type> il,
+                                 size_type n = private_impl::DEFAULT_SIZE,
+                                 const hasher& hash = hasher(),
+                                 const key_equal& key_comparator = key_equal(),
+                                 const allocator_type& allocator = allocator_type())
+            : allocator(allocator)
+            , hash(hash)
+            , key_comparator(key_comparator)
+            , buckets(reserve_calc(bulk_load_size(il.begin(), il.end(), n)), allocator)
+            , all_locks(allocator)
+            , old_buckets(0, allocator)
+            , migration_cursor(0)
+            , stripes_left(0)
+            , expanding(false)
+            , expansion_source_hp(0)
+            , expansion_in_place(false)
+            , old_bucket_array(nullptr)
+            , minimum_load_factor_holder(private_impl::DEFAULT_MINIMUM_LOAD_FACTOR)
+            , maximum_hash_power_holder(private_impl::NO_MAXIMUM_HASHPOWER)
+            , maximum_displacement_work_holder(private_impl::NO_MAXIMUM_DISPLACEMENT_WORK)
+            , shrink_load_factor_holder(private_impl::NO_AUTOMATIC_SHRINK)
+            , maximum_load_factor_holder(private_impl::NO_MAXIMUM_LOAD_FACTOR)
+            , growth_power_holder(private_impl::DEFAULT_GROWTH_POWER)
+            , placement_holder(placement_policy::local)
+            , below_shrink_load_factor(false)
+            , stash(reserve_calc(private_impl::STASH_SLOTS), allocator)
+            , stash_count(0)
+            , stash_reserved(0)
+            {
+                all_locks.emplace_back(std::min(bucket_count(), size_type(std::private_impl::MAX_NUM_LOCKS)),
+                                       get_allocator());
+                bulk_load(il.begin(), il.end());
+            }
+
+        ~concurrent_unordered_map() {
+            maintenance.stop();
+            background_expansion.join();
+            background_reclaim.join();
+        }
+
+        // The view is locked even when lock is false while a maintenance
+        // thread runs, since that thread resizes and compacts the table
+        // behind an unlocked view's back.
+        unordered_map_view make_unordered_map_view(bool lock = false) noexcept {
+            // The view walks the buckets directly, so any incremental expansion
+            // has to be finished first.
+            quiesce();
+            if (lock || maintenance.running()) {
+                auto guard = snapshot_and_write_lock_all<std::private_impl::LOCKING_ACTIVE>();
+                return unordered_map_view(*this, std::move(guard));
+            } else {
+                return unordered_map_view(*this);
+            }
+        }
+
+        // make_concurrent_range returns a range over the table that other
+        // threads can keep using while it is iterated; see concurrent_range.
+        // The table must outlive the range.
+        concurrent_range make_concurrent_range() const {
+            return concurrent_range(this);
+        }
+
+        // concurrent-safe assignment:
+        concurrent_unordered_map& operator=(concurrent_unordered_map&& source) noexcept {
+            if (this != &source) {
+                maintenance.stop();
+                source.maintenance.stop();
+                quiesce();
+                source.quiesce();
+                background_reclaim.join();
+                source.background_reclaim.join();
+                retired.flush();
+                source.retired.flush();
+                this->background_expansion = std::move(source.background_expansion);
+                this->allocator = std::move(source.allocator);
+                this->hash = std::move(source.hash);
+                this->key_comparator = std::move(source.key_comparator);
+                this->buckets = std::move(source.buckets);
+                this->all_locks = std::move(source.all_locks);
+                this->minimum_load_factor_holder.store(source.minimum_load_factor_holder.
+                                                       load(std::memory_order_acquire),
+                                                       std::memory_order_release);
+                this->maximum_hash_power_holder.store(source.maximum_hash_power_holder.
+                                                     load(std::memory_order_acquire),
+                                                     std::memory_order_release);
+                this->maximum_displacement_work_holder.store(
+                        source.maximum_displacement_work_holder.load(std::memory_order_acquire),
+                        std::memory_order_release);
+                this->shrink_load_factor_holder.store(
+                        source.shrink_load_factor_holder.load(std::memory_order_acquire),
+                        std::memory_order_release);
+                this->maximum_load_factor_holder.store(
+                        source.maximum_load_factor_holder.load(std::memory_order_acquire),
+                        std::memory_order_release);
+                this->growth_power_holder.store(
+                        source.growth_power_holder.load(std::memory_order_acquire),
+                        std::memory_order_release);
+                this->placement_holder.store(
+                        source.placement_holder.load(std::memory_order_acquire),
+                        std::memory_order_release);
+                this->stash = std::move(source.stash);
+                this->stash_count.store(source.stash_count.load(std::memory_order_acquire),
+                                        std::memory_order_release);
+                this->stash_reserved = source.stash_reserved;
+                this->stash_tags = source.stash_tags;
+
+            }
+            return *this;
+        }
+
+        concurrent_unordered_map& operator=(initializer_list<value_type> il) {
+            {
+                auto locked_table = make_unordered_map_view(true);
+                locked_table.clear();
+                locked_table.insert(il.begin(), il.end());
+            }
+            return *this;
+        }
+
+        allocator_type get_allocator() const {
+            return allocator;
+        }
+
+        hasher hash_function() const {
+            return hash;
+        }
+
+        key_equal key_eq() const {
+            return key_comparator;
+        }
+
+        // Bounds the displacement work of a single insert to the given number of
+        // bucket reads during the cuckoo path search. An insert that runs out of
+        // budget parks its key in the stash instead, and once the stash is half
+        // full the table is expanded on a background thread, which also puts the
+        // stashed keys back into the table. Only when the stash is completely
+        // full does an insert still expand the table itself. The default,
+        // NO_MAXIMUM_DISPLACEMENT_WORK, searches as far as the displacement
+        // policy allows and expands inline.
+        void maximum_displacement_work(size_type work) {
+            if (work == 0) {
+                throw std::invalid_argument("maximum displacement work cannot be 0");
+            }
+            maximum_displacement_work_holder.store(work, std::memory_order_release);
+        }
+        size_type maximum_displacement_work() const {
+            return maximum_displacement_work_holder.load(std::memory_order_acquire);
+        }
+
+        // Grows the table in one step to room for at least n elements. The final
+        // buckets and lock array are allocated once, and the elements are moved
+        // straight to their final buckets, instead of doubling the table
+        // repeatedly. Does nothing if the table is large enough already. Takes
+        // all the locks.
+        void reserve(size_type n) {
+            const size_type new_hp = reserve_calc(n);
+            if (new_hp <= hashpower()) {
+                return;
+            }
+            if (!std::is_nothrow_move_constructible<key_type>::value ||
+                !std::is_nothrow_move_constructible<mapped_type>::value) {
+                cuckoo_expand_simple<private_impl::LOCKING_ACTIVE, manual_resize>(new_hp);
+                return;
+            }
+            cuckoo_reserve<private_impl::LOCKING_ACTIVE, manual_resize>(hashpower(), new_hp);
+        }
+
+        // Halves the table, as often as it takes, down to the smallest size that
+        // can hold the current elements. Takes all the locks.
+        void shrink_to_fit() {
+            if (!std::is_nothrow_move_constructible<key_type>::value ||
+                !std::is_nothrow_move_constructible<mapped_type>::value) {
+                cuckoo_expand_simple<private_impl::LOCKING_ACTIVE, manual_resize>(
+                        reserve_calc(size()));
+                return;
+            }
+            auto unlocker = snapshot_and_write_lock_all<private_impl::LOCKING_ACTIVE>();
+            cuckoo_shrink(hashpower(), reserve_calc(size()));
+        }
+
+        // Sets the load factor below which erases halve the table on the
+        // background expansion thread. It has to stay below the threshold for
+        // two consecutive checks, which keeps a table that merely passes through
+        // a low load factor from being resized. NO_AUTOMATIC_SHRINK, the
+        // default, turns automatic shrinking off.
+        void shrink_load_factor(const double slf) {
+            if (slf < 0.0 || slf > private_impl::MAXIMUM_SHRINK_LOAD_FACTOR) {
+                throw std::invalid_argument("shrink load factor " + std::to_string(slf) +
+                                            " has to be between 0 and " +
+                                            std::to_string(private_impl::MAXIMUM_SHRINK_LOAD_FACTOR));
+            }
+            shrink_load_factor_holder.store(slf, std::memory_order_release);
+        }
+        double shrink_load_factor() const {
+            return shrink_load_factor_holder.load(std::memory_order_acquire);
+        }
+
+        // Sets the load factor below which automatic expansions throw
+        // load_factor_too_low. It has to stay below the maximum load factor.
+        void minimum_load_factor(const double mlf) {
+            std::resize_policy policy = get_resize_policy();
+            policy.minimum_load_factor = mlf;
+            set_resize_policy(policy);
+        }
+        double minimum_load_factor() const {
+            return minimum_load_factor_holder.load(std::memory_order_acquire);
+        }
+
+        // Sets the largest hashpower the table may grow to. Expansions beyond it
+        // throw maximum_hashpower_exceeded.
+        void maximum_hashpower(const size_type mhp) {
+            std::resize_policy policy = get_resize_policy();
+            policy.maximum_hashpower = mhp;
+            set_resize_policy(policy);
+        }
+        size_type maximum_hashpower() const {
+            return maximum_hash_power_holder.load(std::memory_order_acquire);
+        }
+
+        // Sets the load factor above which inserts expand the table on the
+        // background expansion thread, before it runs out of room and cuckoo
+        // paths get long. NO_MAXIMUM_LOAD_FACTOR, the default, leaves expansion
+        // to the inserts that find the table full.
+        void maximum_load_factor(const double mlf) {
+            std::resize_policy policy = get_resize_policy();
+            policy.maximum_load_factor = mlf;
+            set_resize_policy(policy);
+        }
+        double maximum_load_factor() const {
+            return maximum_load_factor_holder.load(std::memory_order_acquire);
+        }
+
+        // Sets how much an automatic expansion adds to the hashpower. The
+        // default of 1 doubles the table; larger steps trade memory for fewer
+        // expansions while the table fills up. Tables with a bucket for every
+        // lock stripe take a larger step as that many incremental doublings.
+        void growth_power(const size_type gp) {
+            std::resize_policy policy = get_resize_policy();
+            policy.growth_power = gp;
+            set_resize_policy(policy);
+        }
+        size_type growth_power() const {
+            return growth_power_holder.load(std::memory_order_acquire);
+        }
+
+        // Applies all the settings of a resize_policy at once. Throws
+        // std::invalid_argument, without changing anything, if one of them is
+        // out of range.
+        void set_resize_policy(const std::resize_policy& policy) {
+            if (policy.minimum_load_factor < 0.0) {
+                throw std::invalid_argument("load factor " +
+                                            std::to_string(policy.minimum_load_factor) +
+                                            " cannot be less than 0");
+            } else if (policy.minimum_load_factor > 1.0) {
+                throw std::invalid_argument("load factor " +
+                                            std::to_string(policy.minimum_load_factor) +
+                                            " cannot be greater than 1");
+            }
+            if (policy.maximum_load_factor != private_impl::NO_MAXIMUM_LOAD_FACTOR &&
+                (policy.maximum_load_factor <= policy.minimum_load_factor ||
+                 policy.maximum_load_factor > 1.0)) {
+                throw std::invalid_argument("maximum load factor " +
+                                            std::to_string(policy.maximum_load_factor) +
+                                            " has to be above the minimum load factor "
+                                            "and at most 1");
+            }
+            if (policy.growth_power == 0) {
+                throw std::invalid_argument("growth power cannot be 0");
+            }
+            if (hashpower() > policy.maximum_hashpower) {
+                throw std::invalid_argument("maximum hashpower " +
+                                            std::to_string(policy.maximum_hashpower) +
+                                            " is less than current hashpower");
+            }
+            minimum_load_factor_holder.store(policy.minimum_load_factor,
+                                             std::memory_order_release);
+            maximum_hash_power_holder.store(policy.maximum_hashpower, std::memory_order_release);
+            maximum_load_factor_holder.store(policy.maximum_load_factor,
+                                             std::memory_order_release);
+            growth_power_holder.store(policy.growth_power, std::memory_order_release);
+        }
+        std::resize_policy get_resize_policy() const {
+            std::resize_policy policy;
+            policy.maximum_load_factor = maximum_load_factor();
+            policy.growth_power = growth_power();
+            policy.minimum_load_factor = minimum_load_factor();
+            policy.maximum_hashpower = maximum_hashpower();
+            return policy;
+        }
+
+        // Sets where the pages of the bucket and lock arrays go on NUMA
+        // machines; see placement_policy. Bucket arrays allocated by later
+        // resizes follow the new policy, and under interleave the current ones
+        // are moved right away. Does nothing on single-node machines.
+        void set_placement_policy(const placement_policy policy) {
+            auto unlocker = snapshot_and_write_lock_all<private_impl::LOCKING_ACTIVE>();
+            placement_holder.store(policy, std::memory_order_release);
+            buckets.set_placement_policy(policy);
+            old_buckets.set_placement_policy(policy);
+            if (policy != placement_policy::local) {
+                locks_t& locks = get_current_locks();
+                private_impl::interleave_pages<rebind_alloc<lock_t>>(locks.data(),
+                                                                     locks.size() * sizeof(lock_t));
+            }
+        }
+        placement_policy get_placement_policy() const {
+            return placement_holder.load(std::memory_order_acquire);
+        }
+
+        // Starts a maintenance thread for this table, which looks at its load
+        // factor every interval and resizes it ahead of demand: it expands the
+        // table above the maximum load factor or once the stash is half full,
+        // and, when no element was added or removed since its last look, halves
+        // it below the shrink load factor or moves stashed keys back into the
+        // buckets. Inserts and erases then leave resizing to it, and only
+        // expand the table themselves when it is full. The thread is stopped by
+        // stop_maintenance, by moving or swapping the table, and when the table
+        // is destroyed. Views made while it runs always hold the table's locks.
+        // Once elements were added or removed, it also compacts the table, a
+        // few lock stripes per look; see compact.
+        void start_maintenance(const std::chrono::milliseconds interval =
+                                       private_impl::DEFAULT_MAINTENANCE_INTERVAL) {
+            size_type last_size = size();
+            size_type compaction_cursor = std::private_impl::MAX_NUM_LOCKS;
+            maintenance.start(interval, [this, last_size, compaction_cursor]() mutable {
+                maintain(last_size, compaction_cursor);
+            });
+        }
+
+        void stop_maintenance() {
+            maintenance.stop();
+        }
+
+        bool maintenance_running() const {
+            return maintenance.running();
+        }
+
+        // compact moves keys that were displaced into their second bucket back
+        // into their first one wherever it has a free slot, so that finding them
+        // takes one bucket probe instead of two. It goes over the table one lock
+        // stripe at a time, holding only the locks of the two buckets of the key
+        // it moves, so it can run alongside other operations. Returns the
+        // number of keys moved.
+        size_type compact() {
+            return compact_stripes(0, std::private_impl::MAX_NUM_LOCKS);
+        }
+
+        // While hit counting is on, the lookups of find and visit that found
+        // their key are counted by whether they found it in its first bucket.
+        // It is off by default, because every counted lookup does an atomic
+        // add on a cache line shared with other threads. first_bucket_hit_ratio
+        // is the share of counted lookups that hit their first bucket, or 1 if
+        // there were none; a low ratio means many lookups pay for a second
+        // bucket probe, which compact helps with. The counts start from zero
+        // when the table is constructed and on reset_hit_counters, are kept
+        // when counting is switched off, and stay with the table object when
+        // its contents are moved or swapped.
+        void set_hit_counting(const bool enable) {
+            hits.set_enabled(enable);
+        }
+
+        bool hit_counting() const {
+            return hits.enabled();
+        }
+
+        double first_bucket_hit_ratio() const {
+            const size_type first = hits.load(private_impl::hit_counters::first_bucket);
+            const size_type total = first + hits.load(private_impl::hit_counters::second_bucket) +
+                                    hits.load(private_impl::hit_counters::stash);
+            return total == 0 ? 1.0 : static_cast<double>(first) / total;
+        }
+
+        void reset_hit_counters() {
+            hits.reset();
+        }
+
+        // concurrent-safe element retrieval:
+        experimental::optional<mapped_type> find(const key_type& key) const {
+            const hash_value hashvalue = hashed_key(key);
+            experimental::optional<mapped_type> result;
+            private_impl::hit_counters::location where = private_impl::hit_counters::first_bucket;
+            auto reader = [this, &result, &key, &hashvalue, &where] (const bucket& first,
+                                                                     const bucket& second) {
+                result = experimental::nullopt;
+                int slot = try_read_from_bucket(first, hashvalue.partial, key);
+                if (slot != -1) {
+                    result = experimental::make_optional(first.mapped(slot));
+                    where = private_impl::hit_counters::first_bucket;
+                    return;
+                }
+                slot = try_read_from_bucket(second, hashvalue.partial, key);
+                if (slot != -1) {
+                    result = experimental::make_optional(second.mapped(slot));
+                    where = private_impl::hit_counters::second_bucket;
+                    return;
+                }
+                if (stash_count.load(std::memory_order_acquire) != 0) {
+                    const table_position pos = stash_find(key, hashvalue);
+                    if (pos.status == ok) {
+                        result = experimental::make_optional(bucket_at(pos.index).mapped(pos.slot));
+                        where = private_impl::hit_counters::stash;
+                    }
+                }
+            };
+            snapshot_and_read_two(hashvalue, reader);
+            if (result) {
+                hits.add(where);
+            }
+            return result;
+        }
+
+        mapped_type find(const key_type& key, const mapped_type& default_value) const {
+            return find(key).value_or(default_value);
+        }
+
+        // concurrent-safe modifiers:
+        template <typename F>
+        bool visit(const key_type& key, F functor) {
+            const hash_value hashvalue = hashed_key(key);
+            const auto guard = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hashvalue);
+            const table_position pos = cuckoo_find(key, hashvalue,
+                                                   guard.first(), guard.second());
+            if (pos.status == ok) {
+                hits.add(hit_location(pos, guard.first()));
+                functor(bucket_at(pos.index).mapped(pos.slot));
+                return true;
+            }
+            return false;
+        }
+
+        template <typename F>
+        bool visit(const key_type& key, F functor) const {
+            const hash_value hashvalue = hashed_key(key);
+            const auto guard = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hashvalue);
+            const table_position pos = cuckoo_find(key, hashvalue,
+                                                   guard.first(), guard.second());
+            if (pos.status == ok) {
+                hits.add(hit_location(pos, guard.first()));
+                functor(bucket_at(pos.index).mapped(pos.slot));
+                return true;
+            }
+            return false;
+        }
+
+        // visit_all calls functor on every element, given as a value_type&. It
+        // goes over the table one lock stripe at a time, taking each stripe's
+        // lock once for all of the stripe's buckets, so other operations wait
+        // at most for one stripe. With parallel set, the stripes are shared
+        // out among the worker pool, and functor has to be safe to call from
+        // several threads at once. functor must not use the table. Every
+        // element that is in the table while it runs is visited exactly once,
+        // even if other operations move it to make room, or resize the table;
+        // elements that are inserted or erased meanwhile may or may not be.
+        template<typename F>
+        void visit_all(F functor, const bool parallel = false) {
+            sweep(parallel, [this, &functor](size_type stripe, scan_state& scan) {
+                visit_stripe(stripe, scan, functor);
+                return size_type(0);
+            }, [this, &functor](size_type index, size_type slot) {
+                functor(bucket_at(index).element(slot));
+                return size_type(0);
+            });
+        }
+
+        // The const visit_all gives functor a const value_type&, and takes the
+        // stripe locks shared. With the shared locks of tables whose values are
+        // not POD, or whose allocator can reallocate, several of them and
+        // lookups in the stripe being visited can run at once. The optimistic
+        // versioned locks of the other tables cannot be taken shared by code
+        // that runs functor, so there the stripe is locked exclusively, and
+        // lookups in it spin until functor is done with the stripe.
+        template<typename F>
+        void visit_all(F functor, const bool parallel = false) const {
+            sweep(parallel, [this, &functor](size_type stripe, scan_state& scan) {
+                visit_stripe(stripe, scan, functor);
+                return size_type(0);
+            }, [this, &functor](size_type index, size_type slot) {
+                functor(bucket_at(index).element(slot));
+                return size_type(0);
+            });
+        }
+
+        template <typename K, typename F, typename... Args>
+        bool emplace_or_visit(K&& key, F functor, Args&&... val) {
+            hash_value hv = hashed_key(key);
+            auto b = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hv);
+            table_position pos = cuckoo_insert_loop(hv, b, key);
+            if (pos.status == ok) {
+                add_to_bucket(pos.index, pos.slot, hv.partial, std::forward<K>(key),
+                              std::forward<Args>(val)...);
+            } else {
+                functor(bucket_at(pos.index).mapped(pos.slot));
+            }
+            return pos.status == ok;
+        }
+
+        template <typename K, typename... Args>
+        bool emplace(K&& key, Args&&... val) {
+            hash_value hv = hashed_key(key);
+            auto b = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hv);
+            table_position pos = cuckoo_insert_loop(hv, b, key);
+            if (pos.status == ok) {
+                add_to_bucket(pos.index, pos.slot, hv.partial,
+                              std::forward<K>(key),
+                              std::forward<Args>(val)...);
+            }
+
+            return pos.status == ok;
+        }
+
+        template <typename K, typename... Args>
+        bool insert_or_assign(K&& key, Args&&... val)  {
+            hash_value hv = hashed_key(key);
+            auto b = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hv);
+            table_position pos = cuckoo_insert_loop(hv, b, key);
+            if (pos.status == ok) {
+                add_to_bucket(pos.index, pos.slot, hv.partial, std::forward<K>(key),
+                              std::forward<Args>(val)...);
+            } else {
+                if (std::is_assignable<mapped_type&, mapped_type>::value) {
+                    bucket_at(pos.index).mapped(pos.slot) = mapped_type(std::forward<Args>(val)...);
+                } else {
+                    replace_in_bucket(pos.index, pos.slot, hv.partial, std::forward<K>(key),
+                                      std::forward<Args>(val)...);
+                }
+            }
+            return pos.status == ok;
+        }
+
+        template<typename K, typename... Args>
+        size_type update(K&& key, Args&&... val) {
+            const hash_value hv = hashed_key(key);
+            const auto guard = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hv);
+            const table_position pos = cuckoo_find(std::forward<K>(key), hv, guard.first(), guard.second());
+            if (pos.status == ok) {
+                bucket_at(pos.index).mapped(pos.slot) = std::forward<mapped_type>(std::forward<Args>(val)...);
+                return 1;
+            } else {
+                return 0;
+            }
+        }
+
+        template<typename K>
+        size_type erase(K&& key) {
+            const hash_value hv = hashed_key(key);
+            const auto guard = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hv);
+            const table_position pos =
+            cuckoo_find(std::forward<K>(key), hv, guard.first(), guard.second());
+            if (pos.status == ok) {
+                del_from_bucket(pos.index, pos.slot);
+                maybe_shrink_in_background();
+                return 1;
+            } else {
+                return 0;
+            }
+        }
+
+        // erase_if removes the elements for which pred returns true, given the
+        // element as a const value_type&, and returns how many it removed. It
+        // sweeps the table one lock stripe at a time, holding only the lock of
+        // the stripe whose buckets it looks at, so it can run alongside other
+        // operations, which wait at most for one stripe. With parallel set, the
+        // stripes are shared out among the worker pool, and pred has to be safe
+        // to call from several threads at once; tables whose allocator may not
+        // be used from several threads, see allows_concurrent_use, sweep on the
+        // calling thread regardless. pred must not use the table. Like
+        // visit_all, it looks at every element that is in the table while it
+        // runs exactly once, so none of those that pred holds for is left;
+        // elements that are inserted meanwhile may or may not be looked at.
+        template <typename Pred>
+        size_type erase_if(Pred pred, const bool parallel = false) {
+            const bool in_parallel =
+                    parallel && private_impl::allows_concurrent_use<allocator_type>::value;
+            return sweep(in_parallel, [this, &pred](size_type stripe, scan_state& scan) {
+                return erase_stripe_if(stripe, scan, pred);
+            }, [this, &pred](size_type index, size_type slot) {
+                if (!pred(static_cast<const value_type&>(bucket_at(index).element(slot)))) {
+                    return size_type(0);
+                }
+                del_from_bucket(index, slot);
+                return size_type(1);
+            });
+        }
+
+        template<typename K, typename F>
+        size_type erase_and_visit(K&& key, F functor) {
+            const hash_value hv = hashed_key(key);
+            const auto guard = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hv);
+            const table_position pos =
+                    cuckoo_find(std::forward<K>(key), hv, guard.first(), guard.second());
+            if (pos.status == ok) {
+                if (functor(bucket_at(pos.index).mapped(pos.slot))) {
+                    del_from_bucket(pos.index, pos.slot);
+                    maybe_shrink_in_background();
+                }
+                return 1;
+            } else {
+                return 0;
+            }
+        }
+
+        template<class H2, class P2>
+        void merge(concurrent_unordered_map<Key, Value, H2, P2, Allocator, DisplacementPolicy>& source) {
+            auto locked_table = source.lock_table();
+            insert(locked_table.begin(), locked_table.end());
+        }
+        template<class H2, class P2>
+        void merge(concurrent_unordered_map<Key, Value, H2, P2, Allocator, DisplacementPolicy>&& source) {
+            auto locked_table = source.lock_table();
+            insert(locked_table.begin(), locked_table.end());
+        }
+
+        void swap(concurrent_unordered_map& other) noexcept {
+            maintenance.stop();
+            other.maintenance.stop();
+            quiesce();
+            other.quiesce();
+            background_reclaim.join();
+            other.background_reclaim.join();
+            retired.flush();
+            other.retired.flush();
+            std::swap(hash, other.hash);
+            std::swap(key_comparator, other.key_comparator);
+            buckets.swap(other.buckets);
+            all_locks.swap(other.all_locks);
+
+            other.minimum_load_factor_holder.store(
+                    minimum_load_factor_holder.exchange(other.minimum_load_factor(), std::memory_order_release),
+                    std::memory_order_release);
+            other.maximum_hash_power_holder.store(
+                    maximum_hash_power_holder.exchange(other.maximum_hashpower(), std::memory_order_release),
+                    std::memory_order_release);
+            other.maximum_displacement_work_holder.store(
+                    maximum_displacement_work_holder.exchange(other.maximum_displacement_work(),
+                                                              std::memory_order_release),
+                    std::memory_order_release);
+            other.shrink_load_factor_holder.store(
+                    shrink_load_factor_holder.exchange(other.shrink_load_factor(),
+                                                       std::memory_order_release),
+                    std::memory_order_release);
+            other.maximum_load_factor_holder.store(
+                    maximum_load_factor_holder.exchange(other.maximum_load_factor(),
+                                                        std::memory_order_release),
+                    std::memory_order_release);
+            other.growth_power_holder.store(
+                    growth_power_holder.exchange(other.growth_power(), std::memory_order_release),
+                    std::memory_order_release);
+            other.placement_holder.store(
+                    placement_holder.exchange(other.get_placement_policy(),
+                                              std::memory_order_release),
+                    std::memory_order_release);
+            swap_stash(other);
+        }
+
+        void clear() noexcept {
+            auto unlocker = snapshot_and_write_lock_all<private_impl::LOCKING_ACTIVE>();
+            buckets.clear();
+            clear_stash();
+            auto& locks = get_current_locks();
+            for (size_type i = 0; i < locks.size(); ++i) {
+                locks[i].elem_counter() = 0;
+            }
+        }
+
+    private:
+        template <typename U>
+        using rebind_alloc =
+        typename std::allocator_traits<allocator_type>::template rebind_alloc<U>;
+
+        // Optimistic readers may still look at a bucket array that a resize
+        // replaced. Replaced arrays are freed after a grace period, but growing
+        // one in place can unmap its old pages at once, so allocators that can
+        // reallocate get shared locks.
+        using lock_t = typename std::conditional<std::is_pod<Value>::value &&
+                                                 !private_impl::can_reallocate<allocator_type>::value,
+                                                 private_impl::versioned_synchronizer,
+                                                 private_impl::shared_mutex_adapter>::type;
+        using locks_t = std::vector<lock_t, rebind_alloc<lock_t>>;
+        using all_locks_t = std::list<locks_t, rebind_alloc<locks_t>>;
+
+        using hash_value = private_impl::hash_value;
+        using scan_state = private_impl::scan_registry::scan;
+
+        static constexpr auto SLOTS_PER_BUCKET = private_impl::DEFAULT_SLOTS_PER_BUCKET;
+        static constexpr size_type MAX_PATH_LEN = DisplacementPolicy::max_path_length;
+        static_assert(private_impl::STASH_SLOTS % SLOTS_PER_BUCKET == 0 &&
+                      private_impl::STASH_SLOTS <= std::numeric_limits<size_type>::digits,
+                      "the stash must consist of whole buckets and fit its reservation mask");
+
+        using nodes = private_impl::nodes<MAX_PATH_LEN>;
+        using bfs_slot = private_impl::bfs_slot<SLOTS_PER_BUCKET, MAX_PATH_LEN>;
+
+        // Hashing types and functions
+
+        // true if the key is small and simple, which means using partial keys for
+        // lookup would probably slow us down
+        static constexpr bool is_simple =
+            std::is_pod<key_type>::value && sizeof(key_type) <= 8;
+
+        // The partial key must only depend on the hash value. It cannot change with
+        // the hashpower, because, in order for `cuckoo_fast_double` to work
+        // properly, the alt_index must only grow by one bit at the top each time we
+        // expand the table.
+        static partial_t partial_key(const size_type hash) {
+            const uint64_t hash_64bit = hash;
+            const uint32_t hash_32bit = (static_cast<uint32_t>(hash_64bit) ^
+                                         static_cast<uint32_t>(hash_64bit >> 32));
+            const uint16_t hash_16bit = (static_cast<uint16_t>(hash_32bit) ^
+                                         static_cast<uint16_t>(hash_32bit >> 16));
+            const uint16_t hash_8bit = (static_cast<uint8_t>(hash_16bit) ^
+                                        static_cast<uint8_t>(hash_16bit >> 8));
+            return hash_8bit;
+        }
+
+        template <typename K>
+        hash_value hashed_key(const K& key) const {
+            const size_type h = hash(key);
+            return {h, partial_key(h)};
+        }
+
+        template <typename K>
+        size_type hashed_key_only_hash(const K &key) const {
+            return hash(key);
+        }
+
+        // Status codes for internal functions
+        enum operation_status {
+            ok,
+            failure,
+            failure_key_not_found,
+            failure_key_duplicated,
+            failure_table_full,
+            failure_under_expansion,
+        };
+
+        // A composite type for functions that need to return a table position, and
+        // a status code.
+        struct table_position {
+            size_type index;
+            size_type slot;
+            operation_status status;
+        };
+
+        // hashsize returns the number of buckets corresponding to a given
+        // hashpower.
+        static inline size_type hashsize(const size_type hashpower) {
+            return size_type(1) << hashpower;
+        }
+
+
+        // hashmask returns the bitmask for the buckets array corresponding to a
+        // given hashpower.
+        static inline size_type hashmask(const size_type hashpower) {
+            return hashsize(hashpower) - 1;
+        }
+
+        // index_hash returns the first possible bucket that the given hashed key
+        // could be.
+        static inline size_type index_hash(const size_type hashpower,
+                                           const size_type hashvalue) {
+            return hashvalue & hashmask(hashpower);
+        }
+
+        // alt_index returns the other possible bucket that the given hashed key
+        // could be. It takes the first possible bucket as a parameter. Note that
+        // this function will return the first possible bucket if index is the
+        // second possible bucket, so alt_index(ti, partial, alt_index(ti, partial,
+        // index_hash(ti, hv))) == index_hash(ti, hv).
+        static inline size_type alt_index(const size_type hashpower, const partial_t partial,
+                                          const size_type index) {
+            // ensure tag is nonzero for the multiply. 0xc6a4a7935bd1e995 is the
+            // hash constant from 64-bit MurmurHash2
+            const size_type nonzero_tag = static_cast<size_type>(partial) + 1;
+            return (index ^ (nonzero_tag * 0xc6a4a7935bd1e995)) & hashmask(hashpower);
+        }
+
+        size_type hashpower() const { return buckets.hashpower(); }
+
+        // try_read_from_bucket will search the bucket for the given key and return
+        // the index of the slot if found, or -1 if not found.
+        template <typename K>
+        int try_read_from_bucket(const bucket& b, const partial_t partial,
+                                 const K& key) const {
+            // Silence a warning from MSVC about partial being unused if is_simple.
+            (void)partial;
+            for (size_type i = 0; i < SLOTS_PER_BUCKET; ++i) {
+                if (!b.occupied(i) || (!is_simple && partial != b.partial(i))) {
+                    continue;
+                } else if (key_comparator(b.key(i), key)) {
+                    return i;
+                }
+            }
+            return -1;
+        }
+
+        template <typename K>
+        table_position cuckoo_find(const K& key, const hash_value& hashvalue,
+                                   const size_type first, const size_type second) const {
+            int slot = try_read_from_bucket(buckets[first], hashvalue.partial, key);
+            if (slot != -1) {
+                return table_position{first, static_cast<size_type>(slot), ok};
+            }
+            slot = try_read_from_bucket(buckets[second], hashvalue.partial, key);
+            if (slot != -1) {
+                return table_position{second, static_cast<size_type>(slot), ok};
+            }
+            if (stash_count.load(std::memory_order_acquire) != 0) {
+                return stash_find(key, hashvalue);
+            }
+            return table_position{0, 0, failure_key_not_found};
+        }
+
+        // lock_index converts an index into buckets to an index into locks.
+        static inline size_type lock_index(const size_type bucket_index) {
+            return bucket_index & (std::private_impl::MAX_NUM_LOCKS - 1);
+        }
+
+        template <typename LOCK_TYPE>
+        class bucket_write_guard {
+        public:
+            bucket_write_guard() {}
+            bucket_write_guard(locks_t* locks, size_type index)
+                : locks(locks, unlocker{index})
+                {
+                }
+
+        private:
+            struct unlocker {
+                size_type index;
+                void operator()(locks_t* p) const {
+                    (*p)[lock_index(index)].write_unlock(LOCK_TYPE());
+                }
+            };
+
+            std::unique_ptr<locks_t, unlocker> locks;
+        };
+
+        class bucket_read_guard {
+        public:
+            bucket_read_guard() {}
+            bucket_read_guard(locks_t* locks, size_type index)
+                : locks(locks, unlocker{index})
+                {
+                }
+
+        private:
+            struct unlocker {
+                size_type index;
+                void operator()(locks_t* p) const {
+                    (*p)[lock_index(index)].unlock_shared();
+                }
+            };
+
+            std::unique_ptr<locks_t, unlocker> locks;
+        };
+
+        template <typename LOCK_TYPE>
+        class two_buckets_write_guard {
+        public:
+            two_buckets_write_guard() {}
+
+            two_buckets_write_guard(locks_t* locks, size_type first, size_type second)
+                : locks(locks, two_buckets_unlocker{first, second}) {
+            }
+
+            size_type first() const {
+                return locks.get_deleter().first;
+            }
+
+            size_type second() const {
+                return locks.get_deleter().second;
+            }
+
+            bool is_active() const {
+                return static_cast<bool>(locks);
+            }
+
+            void unlock() {
+                locks.reset(nullptr);
+            }
+
+        private:
+            struct two_buckets_unlocker {
+                size_type first, second;
+
+                void operator()(locks_t *p) const {
+                    const size_type l1 = lock_index(first);
+                    const size_type l2 = lock_index(second);
+                    (*p)[l1].write_unlock(LOCK_TYPE());
+                    if (l1 != l2) {
+                        (*p)[l2].write_unlock(LOCK_TYPE());
+                    }
+                }
+            };
+
+            std::unique_ptr<locks_t, two_buckets_unlocker> locks;
+        };
+
+    public:
+        // Defined here rather than with the rest of the interface because it
+        // holds the lock guards above.
+        class concurrent_range {
+        public:
+            class iterator {
+            public:
+                using difference_type = std::ptrdiff_t;
+                using value_type = concurrent_unordered_map::value_type;
+                using pointer = const value_type*;
+                using reference = const value_type&;
+                using iterator_category = std::input_iterator_tag;
+
+                iterator() : range(nullptr) {}
+
+                bool operator==(const iterator& other) const {
+                    return at_end() == other.at_end();
+                }
+
+                bool operator!=(const iterator& other) const {
+                    return !(operator==(other));
+                }
+
+                reference operator*() const {
+                    return range->current();
+                }
+
+                pointer operator->() const {
+                    return std::addressof(operator*());
+                }
+
+                iterator& operator++() {
+                    range->advance();
+                    return *this;
+                }
+
+                void operator++(int) {
+                    range->advance();
+                }
+
+            private:
+                explicit iterator(concurrent_range* range) : range(range) {}
+
+                bool at_end() const {
+                    return range == nullptr || range->done;
+                }
+
+                concurrent_range* range;
+                friend concurrent_range;
+            };
+
+            concurrent_range(const concurrent_range&) = delete;
+            concurrent_range& operator=(const concurrent_range&) = delete;
+
+            concurrent_range(concurrent_range&& other) noexcept
+                : map(other.map)
+                , scan(std::move(other.scan))
+                , read_guard(std::move(other.read_guard))
+                , write_guard(std::move(other.write_guard))
+                , stash_guard(std::move(other.stash_guard))
+                , hp(other.hp)
+                , stripe(other.stripe)
+                , index(other.index)
+                , slot(other.slot)
+                , started(other.started)
+                , in_stash(other.in_stash)
+                , done(other.done)
+                , was_interrupted(other.was_interrupted)
+            {
+            }
+
+            ~concurrent_range() {
+                release();
+                if (scan) {
+                    map->scans.remove(scan.get());
+                }
+            }
+
+            // begin starts the iteration the first time it is called, and
+            // returns an iterator at the range's current position.
+            iterator begin() {
+                if (!started) {
+                    started = true;
+                    lock_stripe();
+                    settle();
+                }
+                return iterator(this);
+            }
+
+            iterator end() {
+                return iterator();
+            }
+
+            // Whether a resize ended the range before it got to every stripe.
+            bool interrupted() const {
+                return was_interrupted;
+            }
+
+        private:
+            explicit concurrent_range(const concurrent_unordered_map* map)
+                : map(map)
+                , scan(new scan_state(map->scans.rehashes(), false))
+                , hp(0)
+                , stripe(0)
+                , index(0)
+                , slot(0)
+                , started(false)
+                , in_stash(false)
+                , done(false)
+                , was_interrupted(false)
+            {
+                map->scans.add(scan.get());
+            }
+
+            const value_type& current() const {
+                if (in_stash) {
+                    return map->stash[index / SLOTS_PER_BUCKET].element(index % SLOTS_PER_BUCKET);
+                }
+                return map->buckets[index].element(slot);
+            }
+
+            void advance() {
+                if (in_stash) {
+                    stash_guard.unlock();
+                    ++index;
+                } else {
+                    ++slot;
+                }
+                settle();
+            }
+
+            // settle moves on from the current position, included, to the
+            // next element to hand out, locking stripes and stash slots as it
+            // goes.
+            void settle() {
+                while (!done && !in_stash) {
+                    for (; index < hashsize(hp); index += std::private_impl::MAX_NUM_LOCKS, slot = 0) {
+                        const bucket& b = map->buckets[index];
+                        for (; slot < SLOTS_PER_BUCKET; ++slot) {
+                            if (b.occupied(slot) && !moved_here(b, slot)) {
+                                return;
+                            }
+                        }
+                    }
+                    scan->mark_done(stripe);
+                    release();
+                    ++stripe;
+                    lock_stripe();
+                }
+                for (; !done && index < private_impl::STASH_SLOTS; ++index) {
+                    if (lock_stash_slot()) {
+                        return;
+                    }
+                }
+                if (!done) {
+                    finish(false);
+                }
+            }
+
+            // Whether the element was moved here from a stripe the range was
+            // done with, and has been handed out already.
+            bool moved_here(const bucket& b, const size_type slot) const {
+                return scan->num_skipped.load(std::memory_order_relaxed) != 0 &&
+                       scan->take_skipped(map->hashed_key_only_hash(b.key(slot)));
+            }
+
+            // lock_stripe takes the lock of stripe, or starts on the stash if
+            // the table has no such stripe.
+            void lock_stripe() {
+                while (true) {
+                    hp = map->hashpower();
+                    if (stripe >= std::min(hashsize(hp), std::private_impl::MAX_NUM_LOCKS)) {
+                        scan->mark_done(stripe, std::private_impl::MAX_NUM_LOCKS);
+                        in_stash = true;
+                        index = 0;
+                        return;
+                    }
+                    try {
+                        if (map->expansion_in_progress()) {
+                            // Only a write lock moves the stripe's buckets over.
+                            write_guard = map->template write_lock_one<private_impl::LOCKING_ACTIVE>(
+                                    hp, stripe);
+                        } else {
+                            read_guard = map->read_lock_one(hp, stripe);
+                        }
+                    } catch (hashpower_changed&) {
+                        continue;
+                    }
+                    if (map->scans.rehashes() != scan->rehashes) {
+                        finish(true);
+                        return;
+                    }
+                    index = stripe;
+                    slot = 0;
+                    return;
+                }
+            }
+
+            // lock_stash_slot takes the locks of the key in stash slot index,
+            // like every operation on a stashed key, and returns whether the
+            // slot still holds it once they are taken.
+            bool lock_stash_slot() {
+                const size_type stash_index = index / SLOTS_PER_BUCKET;
+                const size_type stash_slot = index % SLOTS_PER_BUCKET;
+                while (map->stash_count.load(std::memory_order_acquire) != 0) {
+                    hp = map->hashpower();
+                    size_type hash;
+                    partial_t partial;
+                    {
+                        std::lock_guard<std::mutex> lock(map->stash_mutex);
+                        if (!map->stash[stash_index].occupied(stash_slot)) {
+                            return false;
+                        }
+                        hash = map->stash_tags.hash(index);
+                        partial = map->stash[stash_index].partial(stash_slot);
+                    }
+                    const size_type first = index_hash(hp, hash);
+                    try {
+                        stash_guard = map->template write_lock_two<private_impl::LOCKING_ACTIVE>(
+                                hp, first, alt_index(hp, partial, first));
+                    } catch (hashpower_changed&) {
+                        continue;
+                    }
+                    if (map->scans.rehashes() != scan->rehashes) {
+                        finish(true);
+                        return false;
+                    }
+                    std::lock_guard<std::mutex> lock(map->stash_mutex);
+                    if (map->stash[stash_index].occupied(stash_slot) &&
+                        map->stash_tags.hash(index) == hash) {
+                        return true;
+                    }
+                    stash_guard.unlock();
+                }
+                return false;
+            }
+
+            void finish(const bool interrupted) {
+                release();
+                done = true;
+                was_interrupted = interrupted;
+            }
+
+            void release() {
+                read_guard = bucket_read_guard();
+                write_guard = bucket_write_guard<private_impl::LOCKING_ACTIVE>();
+                stash_guard.unlock();
+            }
+
+            const concurrent_unordered_map* map;
+            std::unique_ptr<scan_state> scan;
+            bucket_read_guard read_guard;
+            bucket_write_guard<private_impl::LOCKING_ACTIVE> write_guard;
+            two_buckets_write_guard<private_impl::LOCKING_ACTIVE> stash_guard;
+            // The hashpower the current stripe was locked with, and the
+            // position: the stripe, and the bucket and slot in it, or the
+            // stash slot once in_stash is set.
+            size_type hp;
+            size_type stripe;
+            size_type index;
+            size_type slot;
+            bool started;
+            bool in_stash;
+            bool done;
+            bool was_interrupted;
+
+            friend concurrent_unordered_map;
+        };
+
+    private:
+
+        template <typename LOCK_TYPE>
+        class all_buckets_write_guard {
+        public:
+            all_buckets_write_guard()
+                    : all_locks(nullptr)
+            {
+            }
+
+            all_buckets_write_guard(const concurrent_unordered_map* map,
+                                    typename all_locks_t::iterator first_locked)
+                : all_locks(&map->all_locks, unlocker(map, first_locked))
+                {
+                }
+
+            bool is_active() const {
+                return static_cast<bool>(all_locks);
+            }
+
+            void unlock() {
+                all_locks.reset(nullptr);
+            }
+
+            void release() {
+                all_locks.release();
+            }
+
+        private:
+            struct unlocker {
+                const concurrent_unordered_map* map;
+                typename all_locks_t::iterator first_locked;
+
+                unlocker()
+                        : map(nullptr)
+                {
+                }
+
+                unlocker(const concurrent_unordered_map* map,
+                         typename all_locks_t::iterator first_locked)
+                        : map(map)
+                        , first_locked(first_locked)
+                {
+                }
+
+                void operator()(all_locks_t* p) const {
+                    if (p != nullptr) {
+                        // Once the current array is unlocked, another resize can
+                        // append a new one, whose locks are not ours to release.
+                        const auto last = std::prev(p->end());
+                        for (auto it = first_locked; it != std::next(last); ++it) {
+                            locks_t& locks = *it;
+                            for (auto& lock : locks) {
+                                lock.write_unlock(LOCK_TYPE());
+                            }
+                        }
+                        // A resize under the guard may have replaced the lock
+                        // array it started with.
+                        map->retire_lock_arrays(first_locked, last);
+                    }
+                }
+            };
+
+            std::unique_ptr<all_locks_t, unlocker> all_locks;
+        };
+
+        // This exception is thrown whenever we try to lock a bucket, but the
+        // hashpower is not what was expected
+        class hashpower_changed {};
+
+        // After taking a lock on the table for the given bucket, this function will
+        // check the hashpower to make sure it is the same as what it was before the
+        // lock was taken. If it isn't unlock the bucket and throw a
+        // hashpower_changed exception. The lock is released in the given locks
+        // container, which is not necessarily the current one anymore. The
+        // container has to be checked as well, since a table that was doubled and
+        // halved again has its old hashpower but a new lock array.
+        template <typename LOCK_TYPE>
+        inline void check_hashpower(const size_type old_hashpower, locks_t& locks,
+                                    const size_type lock) const {
+            if (hashpower() != old_hashpower || &locks != &get_current_locks()) {
+                locks[lock].write_unlock(LOCK_TYPE());
+                throw hashpower_changed();
+            }
+        }
+
+        // locks the given bucket index.
+        //
+        // throws hashpower_changed if it changed after taking the lock.
+        template <typename LOCK_TYPE>
+        inline bucket_write_guard<LOCK_TYPE> write_lock_one(const size_type hashpower,
+                                                            const size_type index) const {
+            const size_type l = lock_index(index);
+            // The lock array may be retired until the lock is taken and checked.
+            private_impl::epoch_guard epoch;
+            locks_t& locks = get_current_locks();
+            locks[l].write_lock(LOCK_TYPE());
+            check_hashpower<LOCK_TYPE>(hashpower, locks, l);
+            migrate_stripe(l);
+            return bucket_write_guard<LOCK_TYPE>(&locks, index);
+        }
+
+        // takes the lock of the given bucket index shared, see lock_shared.
+        // Unlike write_lock_one, it cannot migrate the bucket's stripe, so
+        // callers take the write lock while an expansion is in progress.
+        //
+        // throws hashpower_changed if it changed after taking the lock, or an
+        // expansion started, which callers that checked for one before can
+        // race with.
+        bucket_read_guard read_lock_one(const size_type hashpower, const size_type index) const {
+            const size_type l = lock_index(index);
+            private_impl::epoch_guard epoch;
+            locks_t& locks = get_current_locks();
+            locks[l].lock_shared();
+            if (hashpower != this->hashpower() || &locks != &get_current_locks() ||
+                expansion_in_progress()) {
+                locks[l].unlock_shared();
+                throw hashpower_changed();
+            }
+            return bucket_read_guard(&locks, index);
+        }
+
+        // locks the two bucket indexes, always locking the earlier index first to
+        // avoid deadlock. If the two indexes are the same, it just locks one.
+        //
+        // throws hashpower_changed if it changed after taking the lock.
+        template <typename LOCK_TYPE>
+        two_buckets_write_guard<LOCK_TYPE> write_lock_two(const size_type hashpower, const size_type first,
+                                                          const size_type second) const {
+            size_type l1 = lock_index(first);
+            size_type l2 = lock_index(second);
+            if (l2 < l1) {
+                std::swap(l1, l2);
+            }
+            private_impl::epoch_guard epoch;
+            locks_t& locks = get_current_locks();
+            assert(l1 < locks.size());
+            assert(l2 < locks.size());
+
+            locks[l1].write_lock(LOCK_TYPE());
+            check_hashpower<LOCK_TYPE>(hashpower, locks, l1);
+            if (l2 != l1) {
+                locks[l2].write_lock(LOCK_TYPE());
+            }
+            migrate_stripe(l1);
+            migrate_stripe(l2);
+            return two_buckets_write_guard<LOCK_TYPE>(&locks, first, second);
+        }
+
+        // snapshot_and_write_lock_all takes all the locks, and returns a deleter object
+        // that releases the locks upon destruction. Note that after taking all the
+        // locks, it is okay to resize the buckets_ container, since no other threads
+        // should be accessing the buckets.
+        //
+        // Any incremental expansion in progress is finished once the locks are
+        // taken, so the caller always sees a single buckets container.
+        template <typename LOCK_TYPE>
+        all_buckets_write_guard<LOCK_TYPE> snapshot_and_write_lock_all() const {
+            if (!LOCK_TYPE()) {
+                finish_expansion();
+                return all_buckets_write_guard<LOCK_TYPE>();
+            }
+
+            retired.reclaim();
+            // all_locks_ should never decrease in size, so if it is non-empty now, it
+            // will remain non-empty
+            assert(!all_locks.empty());
+            while (true) {
+                // Migrating what is left of an incremental expansion under all
+                // the locks would stall every other thread for it, so help it
+                // along a stripe at a time first.
+                while (help_expansion()) {
+                }
+                private_impl::epoch_guard epoch;
+                auto current_locks = std::prev(all_locks.end());
+                for (auto& lock : *current_locks) {
+                    lock.write_lock(LOCK_TYPE());
+                }
+                if (current_locks == std::prev(all_locks.end())) {
+                    if (expansion_in_progress() &&
+                        migration_cursor.load(std::memory_order_relaxed) <
+                        std::private_impl::MAX_NUM_LOCKS) {
+                        // Another expansion started in the meantime.
+                        for (auto& lock : *current_locks) {
+                            lock.write_unlock(LOCK_TYPE());
+                        }
+                        continue;
+                    }
+                    // Once we have taken all the locks of the "current" container,
+                    // nobody else can do locking operations on the table. Only
+                    // the stripes other helpers claimed but did not lock yet can
+                    // be left to migrate.
+                    all_buckets_write_guard<LOCK_TYPE> guard(this, current_locks);
+                    finish_expansion();
+                    return guard;
+                }
+                // A resize replaced the lock array while we were taking its locks.
+                for (auto& lock : *current_locks) {
+                    lock.write_unlock(LOCK_TYPE());
+                }
+            }
+        }
+
+        // retire_lock_arrays hands the lock arrays from first up to last, which
+        // replaced them, to the reclamation queue. Threads that picked one of
+        // them up before the resize notice that it is no longer current once
+        // they hold its lock, so it can be freed after their grace period.
+        void retire_lock_arrays(typename all_locks_t::iterator first,
+                                typename all_locks_t::iterator last) const {
+            for (auto it = first; it != last; ++it) {
+                retired.retire([it] {
+                    locks_t(it->get_allocator()).swap(*it);
+                });
+            }
+        }
+
+        // retire_buckets hands the bucket array of old, which the table must
+        // not reach anymore, to the deferred reclamation queue and leaves old
+        // empty. Optimistic readers may still be looking at the array, and
+        // freeing a large one takes a while, so it is freed once the readers
+        // are done and, for large arrays, on a helper thread, instead of under
+        // the locks of the resize.
+        void retire_buckets(buckets_t& old) const {
+            const bool large = old.size() >= private_impl::BACKGROUND_RECLAIM_BUCKETS;
+            auto retiree = std::make_shared<buckets_t>(0, get_allocator());
+            retiree->swap(old);
+            retired.retire([retiree]() mutable {
+                retiree.reset();
+            });
+            if (large) {
+                background_reclaim.try_start([this] {
+                    for (size_type i = 0; i < private_impl::RECLAIM_RETRIES && !retired.reclaim();
+                         ++i) {
+                        std::this_thread::sleep_for(private_impl::RECLAIM_RETRY_INTERVAL);
+                    }
+                });
+            }
+        }
+
+        template <typename LOCK_TYPE>
+        std::pair<two_buckets_write_guard<LOCK_TYPE>, bucket_write_guard<LOCK_TYPE>>
+            write_lock_three(const size_type hp, const size_type i1, const size_type i2,
+                             const size_type i3) const {
+            std::array<size_type, 3> l{{lock_index(i1), lock_index(i2), lock_index(i3)}};
+            // Lock in order.
+            if (l[2] < l[1])
+                std::swap(l[2], l[1]);
+            if (l[2] < l[0])
+                std::swap(l[2], l[0]);
+            if (l[1] < l[0])
+                std::swap(l[1], l[0]);
+            private_impl::epoch_guard epoch;
+            locks_t& locks = get_current_locks();
+            locks[l[0]].write_lock(LOCK_TYPE());
+            check_hashpower<LOCK_TYPE>(hp, locks, l[0]);
+            if (l[1] != l[0]) {
+                locks[l[1]].write_lock(LOCK_TYPE());
+            }
+            if (l[2] != l[1]) {
+                locks[l[2]].write_lock(LOCK_TYPE());
+            }
+            for (const size_type stripe : l) {
+                migrate_stripe(stripe);
+            }
+            return std::make_pair(two_buckets_write_guard<LOCK_TYPE>(&locks, i1, i2),
+                                  bucket_write_guard<LOCK_TYPE>((lock_index(i3) == lock_index(i1) ||
+                                                                 lock_index(i3) == lock_index(i2))
+                                                                ? nullptr
+                                                                : &locks,
+                                                                i3));
+        }
+
+        // snapshot_and_write_lock_two loads locks the buckets associated with the given
+        // hash value, making sure the hashpower doesn't change before the locks are
+        // taken. Thus it ensures that the buckets and locks corresponding to the
+        // hash value will stay correct as long as the locks are held. It returns
+        // the bucket indices associated with the hash value and the current
+        // hashpower.
+        template <typename LOCK_TYPE>
+        two_buckets_write_guard<LOCK_TYPE> snapshot_and_write_lock_two(const hash_value& hashvalue) const {
+            if (LOCK_TYPE()) {
+                // Writers pay for a running expansion by migrating one more
+                // stripe, so it finishes even if some stripes are never touched.
+                help_expansion();
+            }
+            while (true) {
+                // Store the current hashpower we're using to compute the buckets
+                const size_type old_hashpower = hashpower();
+                const size_type first = index_hash(old_hashpower, hashvalue.hash);
+                const size_type second = alt_index(old_hashpower, hashvalue.partial, first);
+                try {
+                    return write_lock_two<LOCK_TYPE>(old_hashpower, first, second);
+                } catch (hashpower_changed &) {
+                    // The hashpower changed while taking the locks. Try again.
+                    continue;
+                }
+            }
+        }
+
+        // snapshot_and_read_two runs reader on the two buckets associated with the
+        // given hash value without taking their write locks. With versioned locks
+        // the read is optimistic and is repeated until neither stripe changed
+        // around it; otherwise both stripes are held in shared mode. The buckets
+        // are recomputed whenever the hashpower changed before the read. While an
+        // incremental expansion is running, a bucket whose stripe was not
+        // migrated yet is read from the table being doubled instead; a key's two
+        // stripes are the same in both tables. The reader is given the buckets
+        // themselves, may run more than once and has to start from scratch every
+        // time.
+        template <typename ReadOperation>
+        void snapshot_and_read_two(const hash_value& hashvalue, ReadOperation reader) const {
+            while (true) {
+                const size_type hp = hashpower();
+                const size_type first = index_hash(hp, hashvalue.hash);
+                const size_type second = alt_index(hp, hashvalue.partial, first);
+                size_type l1 = lock_index(first);
+                size_type l2 = lock_index(second);
+                if (l2 < l1) {
+                    std::swap(l1, l2);
+                }
+                private_impl::epoch_guard epoch;
+                locks_t& locks = get_current_locks();
+                const bool expanding_now = expansion_in_progress();
+                while (true) {
+                    const auto first_version = locks[l1].read_lock();
+                    const auto second_version =
+                        (l2 != l1) ? locks[l2].read_lock() : first_version;
+                    const bucket* old = expanding_now ?
+                                        old_bucket_array.load(std::memory_order_acquire) : nullptr;
+                    const bool stale = hashpower() != hp || expansion_in_progress() != expanding_now ||
+                                       (expanding_now && old == nullptr) ||
+                                       &locks != &get_current_locks();
+                    if (!stale) {
+                        reader(bucket_to_read(old, hp, first), bucket_to_read(old, hp, second));
+                    }
+                    const bool unchanged =
+                        (l2 == l1 || locks[l2].try_read_unlock(second_version)) &&
+                        locks[l1].try_read_unlock(first_version);
+                    if (stale) {
+                        break;
+                    }
+                    if (unchanged) {
+                        return;
+                    }
+                }
+            }
+        }
+
+        // bucket_to_read is the bucket a lookup in the table with hashpower hp
+        // reads for index: the one in the table being doubled, given by old, if
+        // an incremental expansion is running and has not migrated its stripe
+        // yet. The stripe has to be read-locked.
+        const bucket& bucket_to_read(const bucket* old, const size_type hp,
+                                     const size_type index) const {
+            if (old != nullptr && !migrated_stripes[lock_index(index)]) {
+                return old[index & hashmask(hp - 1)];
+            }
+            return buckets[index];
+        }
+
+        // The overflow stash holds the few keys for which no cuckoo path could be
+        // found, so that one unlucky insert does not double the whole table. Stash
+        // buckets are addressed right after the main buckets, which lets a
+        // table_position (and the view iterators) refer to either of them.
+        //
+        // A stashed key is only inserted, erased or moved by a thread holding the
+        // locks of both of its buckets, exactly like a key stored in the table.
+        // stash_mutex only serializes the changes to the stash and the scans over
+        // it; lookups find their key's slots through stash_tags without it.
+        bool is_stash_index(const size_type index) const {
+            return index >= buckets.size();
+        }
+
+        bucket& bucket_at(const size_type index) {
+            return is_stash_index(index) ? stash[index - buckets.size()] : buckets[index];
+        }
+
+        const bucket& bucket_at(const size_type index) const {
+            return is_stash_index(index) ? stash[index - buckets.size()] : buckets[index];
+        }
+
+        size_type total_bucket_count() const {
+            return buckets.size() + stash.size();
+        }
+
+        // hit_location tells where a lookup whose first bucket was first_index
+        // found its key.
+        private_impl::hit_counters::location hit_location(const table_position& pos,
+                                                          const size_type first_index) const {
+            if (is_stash_index(pos.index)) {
+                return private_impl::hit_counters::stash;
+            }
+            return pos.index == first_index ? private_impl::hit_counters::first_bucket
+                                            : private_impl::hit_counters::second_bucket;
+        }
+
+        // next_occupied_bucket returns the index, as taken by bucket_at, of the
+        // first bucket at or after index that holds an element, or
+        // total_bucket_count() if there is none.
+        size_type next_occupied_bucket(size_type index) const {
+            if (index < buckets.size()) {
+                index = buckets.next_occupied(index);
+                if (index < buckets.size()) {
+                    return index;
+                }
+            }
+            return buckets.size() + stash.next_occupied(index - buckets.size());
+        }
+
+        static size_type stash_bit(const size_type stash_slot) {
+            return size_type(1) << stash_slot;
+        }
+
+        // stash_find looks for the key among the stash slots tagged with its hash.
+        // The caller must hold the key's bucket locks, or read them optimistically.
+        template <typename K>
+        table_position stash_find(const K& key, const hash_value& hashvalue) const {
+            const size_type candidates = stash_tags.published_with(hashvalue.hash);
+            for (size_type i = 0; candidates != 0 && i < private_impl::STASH_SLOTS; ++i) {
+                if ((candidates & stash_bit(i)) == 0) {
+                    continue;
+                }
+                const bucket& b = stash[i / SLOTS_PER_BUCKET];
+                const size_type slot = i % SLOTS_PER_BUCKET;
+                if (b.occupied(slot) && key_comparator(b.key(slot), key)) {
+                    return table_position{buckets.size() + i / SLOTS_PER_BUCKET, slot, ok};
+                }
+            }
+            return table_position{0, 0, failure_key_not_found};
+        }
+
+        // stash_insert is the fallback for an insert whose cuckoo search failed.
+        // With both buckets locked again it re-checks them, since another thread
+        // may have made room or inserted the key in the meantime, and otherwise
+        // reserves a stash slot. The element is constructed in the reserved slot
+        // by add_to_bucket. Returns failure_table_full if the stash is full too.
+        template <typename K, typename LOCK_TYPE>
+        table_position stash_insert(const hash_value hashvalue,
+                                    two_buckets_write_guard<LOCK_TYPE>& guard,
+                                    K& key) {
+            const table_position pos = find_insert_position(hashvalue, guard, key);
+            if (pos.status != failure_table_full) {
+                return pos;
+            }
+            std::lock_guard<std::mutex> lock(stash_mutex);
+            for (size_type i = 0; i < private_impl::STASH_SLOTS; ++i) {
+                if ((stash_reserved & stash_bit(i)) == 0) {
+                    stash_reserved |= stash_bit(i);
+                    stash_tags.set_hash(i, hashvalue.hash);
+                    return table_position{buckets.size() + i / SLOTS_PER_BUCKET,
+                                          i % SLOTS_PER_BUCKET, ok};
+                }
+            }
+            return table_position{0, 0, failure_table_full};
+        }
+
+        template <typename K, typename... Args>
+        void add_to_stash(const size_type index, const size_type slot,
+                          const partial_t partial, K&& key, Args&&... val) {
+            std::lock_guard<std::mutex> lock(stash_mutex);
+            try {
+                stash.set_element(index, slot, partial, std::forward<K>(key),
+                                  std::forward<Args>(val)...);
+            } catch (...) {
+                stash_reserved &= ~stash_bit(index * SLOTS_PER_BUCKET + slot);
+                throw;
+            }
+            stash_tags.publish(index * SLOTS_PER_BUCKET + slot);
+            stash_count.fetch_add(1, std::memory_order_release);
+        }
+
+        void del_from_stash(const size_type index, const size_type slot) {
+            std::lock_guard<std::mutex> lock(stash_mutex);
+            stash_tags.unpublish(index * SLOTS_PER_BUCKET + slot);
+            stash.erase_element(index, slot);
+            stash_reserved &= ~stash_bit(index * SLOTS_PER_BUCKET + slot);
+            stash_count.fetch_sub(1, std::memory_order_release);
+        }
+
+        // try_unstash moves the element in the given stash slot into bucket
+        // `index`, provided the bucket is one of the element's two buckets and has
+        // a free slot. The caller must hold stash_mutex and the lock of `index`:
+        // every other operation on the stashed key takes both of its bucket locks,
+        // so holding one of them is enough to move it.
+        bool try_unstash(const size_type stash_slot, const size_type index) {
+            const bucket& from = stash[stash_slot / SLOTS_PER_BUCKET];
+            if (!from.occupied(stash_slot % SLOTS_PER_BUCKET) ||
+                !stash_slot_fits(stash_slot, index)) {
+                return false;
+            }
+            const bucket& to = buckets[index];
+            for (size_type i = 0; i < SLOTS_PER_BUCKET; ++i) {
+                if (!to.occupied(i)) {
+                    unstash_to(stash_slot, index, i);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // stash_slot_fits tells whether index is one of the two buckets of the
+        // key tagged in the given stash slot.
+        bool stash_slot_fits(const size_type stash_slot, const size_type index) const {
+            const size_type hash = stash_tags.hash(stash_slot);
+            const size_type hp = hashpower();
+            const size_type first = index_hash(hp, hash);
+            return first == index || alt_index(hp, partial_key(hash), first) == index;
+        }
+
+        // unstash_to moves the element in the given stash slot to the free slot
+        // `slot` of bucket `index`, one of its two buckets. The caller must hold
+        // stash_mutex and the locks of the element's buckets, or of `index` alone
+        // as in try_unstash; a scan holds both while it looks at the stash slot.
+        void unstash_to(const size_type stash_slot, const size_type index, const size_type slot) {
+            const size_type stash_index = stash_slot / SLOTS_PER_BUCKET;
+            const size_type from_slot = stash_slot % SLOTS_PER_BUCKET;
+            bucket& from = stash[stash_index];
+            scans.moved(private_impl::scan_registry::stash_position(stash_slot), lock_index(index),
+                        [this, stash_slot] { return stash_tags.hash(stash_slot); });
+            buckets.set_element(index, slot, from.partial(from_slot), from.movable_key(from_slot),
+                                std::move(from.mapped(from_slot)));
+            stash_tags.unpublish(stash_slot);
+            stash.erase_element(stash_index, from_slot);
+            stash_reserved &= ~stash_bit(stash_slot);
+            stash_count.fetch_sub(1, std::memory_order_release);
+            ++get_current_locks()[lock_index(index)].elem_counter();
+        }
+
+        // drain_stash moves stashed keys back into bucket `index` after a slot of
+        // it has been freed. The caller must hold the bucket's lock. The stash
+        // mutex is only taken if a stashed key belongs in the bucket. Keys whose
+        // move constructor may throw stay stashed until the next resize, since
+        // this runs on the erase path.
+        void drain_stash(const size_type index) {
+            if (!std::is_nothrow_move_constructible<key_type>::value ||
+                !std::is_nothrow_move_constructible<mapped_type>::value ||
+                stash_count.load(std::memory_order_acquire) == 0) {
+                return;
+            }
+            const size_type published = stash_tags.published_slots();
+            size_type candidates = 0;
+            for (size_type i = 0; i < private_impl::STASH_SLOTS; ++i) {
+                if ((published & stash_bit(i)) != 0 && stash_slot_fits(i, index)) {
+                    candidates |= stash_bit(i);
+                }
+            }
+            if (candidates == 0) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(stash_mutex);
+            for (size_type i = 0; i < private_impl::STASH_SLOTS; ++i) {
+                if ((candidates & stash_bit(i)) != 0) {
+                    try_unstash(i, index);
+                }
+            }
+        }
+
+        // drain_stash_all re-homes every stashed key that fits into one of its
+        // buckets. It is called after a resize, with all the locks taken.
+        void drain_stash_all() {
+            if (stash_count.load(std::memory_order_acquire) == 0) {
+                return;
+            }
+            const size_type hp = hashpower();
+            std::lock_guard<std::mutex> lock(stash_mutex);
+            for (size_type i = 0; i < private_impl::STASH_SLOTS; ++i) {
+                const bucket& b = stash[i / SLOTS_PER_BUCKET];
+                if (!b.occupied(i % SLOTS_PER_BUCKET)) {
+                    continue;
+                }
+                const size_type first = index_hash(hp, stash_tags.hash(i));
+                const size_type second = alt_index(hp, b.partial(i % SLOTS_PER_BUCKET), first);
+                migrate_stripe(lock_index(first));
+                migrate_stripe(lock_index(second));
+                if (!try_unstash(i, first)) {
+                    try_unstash(i, second);
+                }
+            }
+        }
+
+        // unstash_by_displacement moves the stashed keys back into the table
+        // without taking all the locks. For each key it takes the locks of its
+        // two buckets and, if both are full, runs a cuckoo search to make room,
+        // just like an insert of the key would; the search is not bounded by the
+        // maximum displacement work, since no insert is waiting for it. Keys
+        // whose move constructor may throw stay stashed until the next resize.
+        void unstash_by_displacement() {
+            if (!std::is_nothrow_move_constructible<key_type>::value ||
+                !std::is_nothrow_move_constructible<mapped_type>::value) {
+                return;
+            }
+            for (size_type i = 0; i < private_impl::STASH_SLOTS &&
+                                  stash_count.load(std::memory_order_acquire) != 0; ++i) {
+                if ((stash_tags.published_slots() & stash_bit(i)) == 0) {
+                    continue;
+                }
+                const size_type hash = stash_tags.hash(i);
+                const hash_value hashvalue{hash, partial_key(hash)};
+                auto guard = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hashvalue);
+                // With the key's locks held, a slot tagged with its hash cannot
+                // change.
+                auto still_stashed = [this, i, hash] {
+                    return (stash_tags.published_with(hash) & stash_bit(i)) != 0;
+                };
+                if (!still_stashed()) {
+                    continue;
+                }
+                size_type index = guard.first();
+                int slot = free_slot(buckets[index]);
+                if (slot < 0) {
+                    index = guard.second();
+                    slot = free_slot(buckets[index]);
+                }
+                if (slot < 0) {
+                    size_type insert_bucket, insert_slot;
+                    size_type work = private_impl::NO_MAXIMUM_DISPLACEMENT_WORK;
+                    if (run_cuckoo(guard, insert_bucket, insert_slot, work) != ok ||
+                        !still_stashed()) {
+                        continue;
+                    }
+                    index = insert_bucket;
+                    slot = static_cast<int>(insert_slot);
+                }
+                std::lock_guard<std::mutex> lock(stash_mutex);
+                unstash_to(i, index, static_cast<size_type>(slot));
+            }
+        }
+
+        // free_slot returns the first free slot of the bucket, or -1.
+        static int free_slot(const bucket& b) {
+            for (size_type i = 0; i < SLOTS_PER_BUCKET; ++i) {
+                if (!b.occupied(i)) {
+                    return static_cast<int>(i);
+                }
+            }
+            return -1;
+        }
 
-        // hashmask returns the bitmask for the buckets array corresponding to a
-        // given hashpower.
-        static inline size_type hashmask(const size_type hashpower) {
-            return hashsize(hashpower) - 1;
+        // maybe_drain_stash_in_background checks every LOAD_FACTOR_CHECK_INTERVAL
+        // inserts of the calling thread whether keys are parked in the stash, and
+        // if so moves them back on the background expansion thread; see
+        // unstash_by_displacement. The stash then empties as displacement makes
+        // room for its keys, rather than only when their buckets see an erase or
+        // the table is resized.
+        template <typename LOCK_TYPE>
+        void maybe_drain_stash_in_background() {
+            if (!LOCK_TYPE() || !std::is_nothrow_move_constructible<key_type>::value ||
+                !std::is_nothrow_move_constructible<mapped_type>::value ||
+                stash_count.load(std::memory_order_relaxed) == 0) {
+                return;
+            }
+            static thread_local size_type inserts = 0;
+            if (++inserts % private_impl::LOAD_FACTOR_CHECK_INTERVAL != 0) {
+                return;
+            }
+            background_expansion.try_start([this] {
+                unstash_by_displacement();
+            });
         }
 
-        // index_hash returns the first possible bucket that the given hashed key
-        // could be.
-        static inline size_type index_hash(const size_type hashpower,
-                                           const size_type hashvalue) {
-            return hashvalue & hashmask(hashpower);
+        void clear_stash() noexcept {
+            std::lock_guard<std::mutex> lock(stash_mutex);
+            stash_tags.clear();
+            stash.clear();
+            stash_reserved = 0;
+            stash_count.store(0, std::memory_order_release);
         }
 
-        // alt_index returns the other possible bucket that the given hashed key
-        // could be. It takes the first possible bucket as a parameter. Note that
-        // this function will return the first possible bucket if index is the
-        // second possible bucket, so alt_index(ti, partial, alt_index(ti, partial,
-        // index_hash(ti, hv))) == index_hash(ti, hv).
-        static inline size_type alt_index(const size_type hashpower, const partial_t partial,
-                                          const size_type index) {
-            // ensure tag is nonzero for the multiply. 0xc6a4a7935bd1e995 is the
-            // hash constant from 64-bit MurmurHash2
-            const size_type nonzero_tag = static_cast<size_type>(partial) + 1;
-            return (index ^ (nonzero_tag * 0xc6a4a7935bd1e995)) & hashmask(hashpower);
+        // Swaps the stash contents; the stash mutexes stay with their tables.
+        // Both tables must be locked, or not yet visible to other threads.
+        void swap_stash(concurrent_unordered_map& other) {
+            stash.swap(other.stash);
+            other.stash_count.store(
+                    stash_count.exchange(other.stash_count.load(std::memory_order_acquire),
+                                         std::memory_order_acq_rel),
+                    std::memory_order_release);
+            std::swap(stash_reserved, other.stash_reserved);
+            stash_tags.swap(other.stash_tags);
         }
 
-        size_type hashpower() const { return buckets.hashpower(); }
+        template <typename K, typename LOCK_TYPE>
+        table_position cuckoo_insert_loop(hash_value hashvalue,
+                                          two_buckets_write_guard<LOCK_TYPE>& guard,
+                                          K& key) {
+            table_position pos;
+            const size_type max_work = maximum_displacement_work();
+            while (true) {
+                assert(guard.is_active());
+                const size_type old_hashpower = hashpower();
+                size_type work = max_work;
+                pos = cuckoo_insert(hashvalue, guard, key, work);
+                switch (pos.status) {
+                case ok:
+                    maybe_grow_in_background<LOCK_TYPE>();
+                    maybe_drain_stash_in_background<LOCK_TYPE>();
+                    return pos;
+                case failure_key_duplicated:
+                    return pos;
+                case failure_table_full:
+                    // Rather than doubling the table for a single unlucky key,
+                    // park it in the stash if there is room left.
+                    guard = snapshot_and_write_lock_two<LOCK_TYPE>(hashvalue);
+                    pos = stash_insert(hashvalue, guard, key);
+                    if (pos.status != failure_table_full) {
+                        if (max_work != private_impl::NO_MAXIMUM_DISPLACEMENT_WORK) {
+                            maybe_expand_in_background<LOCK_TYPE>(old_hashpower);
+                        }
+                        return pos;
+                    }
+                    guard.unlock();
+                    // Expand the table and try again, re-grabbing the locks
+                    cuckoo_grow<LOCK_TYPE, automatic_resize>(old_hashpower);
+                    guard = snapshot_and_write_lock_two<LOCK_TYPE>(hashvalue);
+                    break;
+                case failure_under_expansion:
+                    // The table was under expansion while we were cuckooing. Re-grab the
+                    // locks and try again.
+                    guard = snapshot_and_write_lock_two<LOCK_TYPE>(hashvalue);
+                    break;
+                default:
+                    assert(false);
+                }
+            }
+        }
 
-        // try_read_from_bucket will search the bucket for the given key and return
-        // the index of the slot if found, or -1 if not found.
-        template <typename K>
-        int try_read_from_bucket(const bucket& b, const partial_t partial,
-                                 const K& key) const {
-            // Silence a warning from MSVC about partial being unused if is_simple.
-            (void)partial;
-            for (size_type i = 0; i < SLOTS_PER_BUCKET; ++i) {
-                if (!b.occupied(i) || (!is_simple && partial != b.partial(i))) {
-                    continue;
-                } else if (key_comparator(b.key(i), key)) {
+        // run_cuckoo performs cuckoo hashing on the table in an attempt to free up
+        // a slot on either of the insert buckets, which are assumed to be locked
+        // before the start. On success, the bucket and slot that was freed up is
+        // stored in insert_bucket and insert_slot. In order to perform the search
+        // and the swaps, it has to release the locks, which can lead to certain
+        // concurrency issues, the details of which are explained in the function.
+        // If run_cuckoo returns ok (success), then `b` will be active, otherwise it
+        // will not.
+        template <typename LOCK_TYPE>
+        operation_status run_cuckoo(two_buckets_write_guard<LOCK_TYPE>& guard,
+                                    size_type& insert_bucket,
+                                    size_type& insert_slot, size_type& work) {
+            // We must unlock the buckets here, so that cuckoopath_search and
+            // cuckoopath_move can lock buckets as desired without deadlock.
+            // cuckoopath_move has to move something out of one of the original
+            // buckets as its last operation, and it will lock both buckets and
+            // leave them locked after finishing. This way, we know that if
+            // cuckoopath_move succeeds, then the buckets needed for insertion are
+            // still locked. If cuckoopath_move fails, the buckets are unlocked and
+            // we try again. This unlocking does present two problems. The first is
+            // that another insert on the same key runs and, finding that the key
+            // isn't in the table, inserts the key into the table. Then we insert
+            // the key into the table, causing a duplication. To check for this, we
+            // search the buckets for the key we are trying to insert before doing
+            // so (this is done in cuckoo_insert, and requires that both buckets are
+            // locked). Another problem is that an expansion runs and changes the
+            // hashpower, meaning the buckets may not be valid anymore. In this
+            // case, the cuckoopath functions will have thrown a hashpower_changed
+            // exception, which we catch and handle here.
+            size_type hp = hashpower();
+            guard.unlock();
+            nodes path;
+            bool done = false;
+            try {
+                while (!done) {
+                    const int depth =
+                        cuckoopath_search<LOCK_TYPE>(hp, path, guard.first(), guard.second(),
+                                                     work, typename DisplacementPolicy::search_tag());
+                    if (depth < 0) {
+                        break;
+                    }
+
+                    if (cuckoopath_move(hp, path, depth, guard)) {
+                        insert_bucket = path[0].bucket;
+                        insert_slot = path[0].slot;
+                        assert(insert_bucket == guard.first() || insert_bucket == guard.second());
+                        assert(LOCK_TYPE() == private_impl::LOCKING_INACTIVE() ||
+                               !get_current_locks()[lock_index(guard.first())].try_write_lock(LOCK_TYPE()));
+                        assert(LOCK_TYPE() == private_impl::LOCKING_INACTIVE() ||
+                               !get_current_locks()[lock_index(guard.second())].try_write_lock(LOCK_TYPE()));
+                        assert(!buckets[insert_bucket].occupied(insert_slot));
+                        done = true;
+                        break;
+                    }
+                }
+            } catch (hashpower_changed &) {
+                // The hashpower changed while we were trying to cuckoo, which means
+                // we want to retry. b.first() and b.second() should not be locked
+                // in this case.
+                return failure_under_expansion;
+            }
+            return done ? ok : failure;
+        }
+
+        // read_bucket runs reader on the bucket at the given index without taking
+        // its write lock. With versioned locks, the read is optimistic and is
+        // retried until the stripe version did not change around it; otherwise
+        // the stripe is held in shared mode. Since the reader may see a bucket in
+        // the middle of a write, it must only copy out occupancy flags and partial
+        // keys, never keys or values.
+        //
+        // throws hashpower_changed if it changed before the read.
+        template <typename LOCK_TYPE, typename F>
+        void read_bucket(const size_type hp, const size_type index, F reader) const {
+            if (!LOCK_TYPE()) {
+                reader(buckets[index]);
+                return;
+            }
+            if (expansion_in_progress()) {
+                // The bucket may not have been migrated yet, which only happens
+                // under its lock.
+                const auto guard = write_lock_one<LOCK_TYPE>(hp, index);
+                reader(buckets[index]);
+                return;
+            }
+            private_impl::epoch_guard epoch;
+            locks_t& locks = get_current_locks();
+            lock_t& lock = locks[lock_index(index)];
+            typename lock_t::version_type version;
+            do {
+                version = lock.read_lock();
+                if (hashpower() != hp || &locks != &get_current_locks()) {
+                    lock.try_read_unlock(version);
+                    throw hashpower_changed();
+                }
+                reader(buckets[index]);
+            } while (!lock.try_read_unlock(version));
+        }
+
+        // bucket_snapshot is what the cuckoo path searches read out of a bucket.
+        struct bucket_snapshot {
+            std::array<bool, SLOTS_PER_BUCKET> occupied;
+            std::array<partial_t, SLOTS_PER_BUCKET> partial;
+        };
+
+        template <typename LOCK_TYPE>
+        bucket_snapshot snapshot_bucket(const size_type hp, const size_type index) const {
+            bucket_snapshot snapshot;
+            read_bucket<LOCK_TYPE>(hp, index, [&snapshot](const bucket& b) {
+                for (size_type slot = 0; slot < SLOTS_PER_BUCKET; ++slot) {
+                    snapshot.occupied[slot] = b.occupied(slot);
+                    snapshot.partial[slot] = b.partial(slot);
+                }
+            });
+            return snapshot;
+        }
+
+        // slot_search searches for a cuckoo path using breadth-first search. It
+        // starts with the i1 and i2 buckets, and, until it finds a bucket with an
+        // empty slot, adds each slot of the bucket in the bfs_slot. If the queue runs
+        // out of space, it fails. Buckets are read with snapshot_bucket, so the
+        // search takes no write locks and doesn't stall readers.
+        //
+        // throws hashpower_changed if it changed during the search
+        template <typename LOCK_TYPE>
+        bfs_slot slot_search(const size_type hp, const size_type i1,
+                             const size_type i2, size_type& work) {
+            private_impl::bfs_queue<SLOTS_PER_BUCKET, MAX_PATH_LEN,
+                                    DisplacementPolicy::max_cuckoo_count> q;
+            // The initial pathcode informs cuckoopath_search which bucket the path
+            // starts on
+            q.enqueue(bfs_slot(i1, 0, 0));
+            q.enqueue(bfs_slot(i2, 1, 0));
+            while (!q.full() && !q.empty() && work != 0) {
+                --work;
+                bfs_slot x = q.dequeue();
+                const bucket_snapshot b = snapshot_bucket<LOCK_TYPE>(hp, x.bucket);
+                // Picks a (sort-of) random slot to start from
+                size_type starting_slot = x.pathcode % SLOTS_PER_BUCKET;
+                for (size_type i = 0; i < SLOTS_PER_BUCKET && !q.full(); ++i) {
+                    size_type slot = (starting_slot + i) % SLOTS_PER_BUCKET;
+                    if (!b.occupied[slot]) {
+                        // We can terminate the search here
+                        x.pathcode = x.pathcode * SLOTS_PER_BUCKET + slot;
+                        return x;
+                    }
+
+                    // If x has less than the maximum number of path components,
+                    // create a new bfs_slot item, that represents the bucket we would
+                    // have come from if we kicked out the item at this slot.
+                    const partial_t partial = b.partial[slot];
+                    if (x.depth < static_cast<int>(MAX_PATH_LEN) - 1) {
+                        bfs_slot y(alt_index(hp, partial, x.bucket),
+                                 x.pathcode * SLOTS_PER_BUCKET + slot, x.depth + 1);
+                        q.enqueue(y);
+                    }
+                }
+            }
+            // We didn't find a short-enough cuckoo path, so the queue or the work
+            // budget ran out. Return a failure value.
+            return bfs_slot(0, 0, -1);
+        }
+
+        // cuckoopath_search finds a cuckoo path from one of the starting buckets to
+        // an empty slot in another bucket. It returns the depth of the discovered
+        // cuckoo path on success, and -1 on failure. Since it doesn't take write
+        // locks on the buckets it searches, the data can change between this
+        // function and cuckoopath_move. Thus cuckoopath_move checks that the data
+        // matches the cuckoo path before changing it.
+        //
+        // throws hashpower_changed if it changed during the search.
+        template <typename LOCK_TYPE>
+        int cuckoopath_search(const size_type hp, nodes& path,
+                              const size_type i1, const size_type i2, size_type& work,
+                              private_impl::bfs_search_tag) {
+            bfs_slot compressed_path = slot_search<LOCK_TYPE>(hp, i1, i2, work);
+            if (compressed_path.depth == -1) {
+                return -1;
+            }
+            // Fill in the cuckoo path slots from the end to the beginning.
+            for (int i = compressed_path.depth; i >= 0; i--) {
+                path[i].slot = compressed_path.pathcode % SLOTS_PER_BUCKET;
+                compressed_path.pathcode /= SLOTS_PER_BUCKET;
+            }
+            // Fill in the cuckoo_path buckets and keys from the beginning to the
+            // end, using the final pathcode to figure out which bucket the path
+            // starts on. Since data could have been modified between slot_search
+            // and the computation of the cuckoo path, this could be an invalid
+            // cuckoo_path.
+            private_impl::node& first = path[0];
+            if (compressed_path.pathcode == 0) {
+                first.bucket = i1;
+            } else {
+                assert(compressed_path.pathcode == 1);
+                first.bucket = i2;
+            }
+            for (int i = 0; i <= compressed_path.depth; ++i) {
+                private_impl::node& cur = path[i];
+                if (i > 0) {
+                    // We get the bucket that this slot is on by computing the
+                    // alternate index of the previous bucket
+                    const private_impl::node& prev = path[i - 1];
+                    cur.bucket = alt_index(hp, prev.partial, prev.bucket);
+                }
+                bool occupied;
+                read_bucket<LOCK_TYPE>(hp, cur.bucket, [&cur, &occupied](const bucket& b) {
+                    occupied = b.occupied(cur.slot);
+                    cur.partial = b.partial(cur.slot);
+                });
+                if (!occupied) {
+                    // We can terminate here
                     return i;
                 }
             }
-            return -1;
-        }
+            return compressed_path.depth;
+        }
+
+        // This cuckoopath_search performs a bounded random walk instead: starting
+        // from a random one of the two buckets, it stops at the first bucket with
+        // an empty slot, or else evicts a random element to its alternate bucket
+        // and continues from there. A slot is never evicted twice in the same
+        // path. It returns the depth of the discovered path, or -1 if none was
+        // found within MAX_PATH_LEN steps or the work budget. Like the BFS, it reads buckets with
+        // snapshot_bucket and only needs the path to be roughly right, since
+        // cuckoopath_move validates every move.
+        //
+        // throws hashpower_changed if it changed during the search.
+        template <typename LOCK_TYPE>
+        int cuckoopath_search(const size_type hp, nodes& path,
+                              const size_type i1, const size_type i2, size_type& work,
+                              private_impl::random_walk_search_tag) {
+            size_type bucket_index = (random_walk_next() & 1) ? i2 : i1;
+            for (size_type depth = 0; depth < MAX_PATH_LEN && work != 0; ++depth, --work) {
+                private_impl::node& cur = path[depth];
+                cur.bucket = bucket_index;
+                const bucket_snapshot b = snapshot_bucket<LOCK_TYPE>(hp, bucket_index);
+                for (size_type slot = 0; slot < SLOTS_PER_BUCKET; ++slot) {
+                    if (!b.occupied[slot]) {
+                        cur.slot = slot;
+                        return static_cast<int>(depth);
+                    }
+                }
+                const size_type starting_slot = random_walk_next() % SLOTS_PER_BUCKET;
+                bool evicted = false;
+                for (size_type i = 0; i < SLOTS_PER_BUCKET && !evicted; ++i) {
+                    cur.slot = (starting_slot + i) % SLOTS_PER_BUCKET;
+                    evicted = true;
+                    for (size_type j = 0; j < depth; ++j) {
+                        if (path[j].bucket == cur.bucket && path[j].slot == cur.slot) {
+                            evicted = false;
+                            break;
+                        }
+                    }
+                }
+                if (!evicted) {
+                    return -1;
+                }
+                cur.partial = b.partial[cur.slot];
+                bucket_index = alt_index(hp, cur.partial, bucket_index);
+            }
+            return -1;
+        }
+
+        // random_walk_next is a per-thread xorshift generator for the random
+        // walk search; the quality of the numbers does not matter much.
+        static size_type random_walk_next() {
+            static thread_local uint64_t state =
+                std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return static_cast<size_type>(state);
+        }
+
+        // Checks whether the resize is okay to proceed. Returns a status code, or
+        // throws an exception, depending on the error type.
+        using automatic_resize = std::integral_constant<bool, true>;
+        using manual_resize = std::integral_constant<bool, false>;
+
+        template <typename AUTO_RESIZE>
+        operation_status check_resize_validity(const size_type orig_hp,
+                                               const size_type new_hp) {
+            const size_type mhp = maximum_hash_power_holder.load(std::memory_order_acquire);
+            if (mhp != private_impl::NO_MAXIMUM_HASHPOWER && new_hp > mhp) {
+                throw private_impl::maximum_hashpower_exceeded(new_hp);
+            }
+            if (AUTO_RESIZE::value && load_factor() < minimum_load_factor()) {
+                throw private_impl::load_factor_too_low(minimum_load_factor());
+            }
+            if (hashpower() != orig_hp) {
+                // Most likely another expansion ran before this one could grab the
+                // locks
+                return failure_under_expansion;
+            }
+            return ok;
+        }
+
+        // When we expand the contanier, we may need to expand the locks array, if
+        // the current locks array is smaller than the maximum size and also smaller
+        // than the number of buckets in the upcoming buckets container. In this
+        // case, we grow the locks array to the smaller of the maximum lock array
+        // size and the bucket count. This is done by allocating an entirely new lock
+        // container, taking all the locks, copying over the counters, and then
+        // finally adding it to the end of `all_locks_`, thereby designating it the
+        // "current" locks container. It is the responsibility of the caller to
+        // unlock all locks taken, including the new locks, whenever it is done with
+        // them, so that old threads can resume and potentially re-start.
+        template <typename LOCK_TYPE>
+        void maybe_resize_locks(size_type new_bucket_count) {
+            locks_t& current_locks = get_current_locks();
+            if (!(current_locks.size() < std::private_impl::MAX_NUM_LOCKS &&
+                  current_locks.size() < new_bucket_count)) {
+                return;
+            }
 
-        template <typename K>
-        table_position cuckoo_find(const K& key, const partial_t partial,
-                                   const size_type first, const size_type second) const {
-            int slot = try_read_from_bucket(buckets[first], partial, key);
-            if (slot != -1) {
-                return table_position{first, static_cast<size_type>(slot), ok};
+            locks_t new_locks(std::min(size_type(std::private_impl::MAX_NUM_LOCKS),
+                                       new_bucket_count), get_allocator());
+            assert(new_locks.size() > current_locks.size());
+            if (get_placement_policy() != placement_policy::local) {
+                private_impl::interleave_pages<rebind_alloc<lock_t>>(
+                        new_locks.data(), new_locks.size() * sizeof(lock_t));
             }
-            slot = try_read_from_bucket(buckets[second], partial, key);
-            if (slot != -1) {
-                return table_position{second, static_cast<size_type>(slot), ok};
+            std::copy(current_locks.begin(), current_locks.end(), new_locks.begin());
+            for (auto& lock : new_locks) {
+                lock.write_lock(LOCK_TYPE());
             }
-            return table_position{0, 0, failure_key_not_found};
+            all_locks.emplace_back(std::move(new_locks));
         }
 
-        // lock_index converts an index into buckets to an index into locks.
-        static inline size_type lock_index(const size_type bucket_index) {
-            return bucket_index & (std::private_impl::MAX_NUM_LOCKS - 1);
+        // maybe_expand_in_background starts doubling the table on the background
+        // expansion thread once the stash is half full, so that inserts with a
+        // bounded displacement budget rarely find the stash full and have to
+        // expand the table inline.
+        template <typename LOCK_TYPE>
+        void maybe_expand_in_background(const size_type current_hp) {
+            if (!LOCK_TYPE() || maintenance.running() ||
+                stash_count.load(std::memory_order_acquire) < private_impl::STASH_SLOTS / 2) {
+                return;
+            }
+            background_expansion.try_start([this, current_hp] {
+                cuckoo_grow<private_impl::LOCKING_ACTIVE, automatic_resize>(current_hp);
+                // Starting an incremental expansion from here cannot hand the
+                // migration to a new background task, so do it on this one.
+                while (help_expansion()) {
+                }
+            });
         }
 
-        template<typename ReadOperation>
-        class two_buckets_read_guard {
-        public:
-            two_buckets_read_guard(locks_t* locks, size_type first_index, size_type second_index)
-                : locks(locks)
-                , first_index(first_index)
-                , second_index(second_index)
-            {
+        // maybe_grow_in_background checks the load factor every
+        // LOAD_FACTOR_CHECK_INTERVAL inserts of the calling thread, and expands
+        // the table on the background expansion thread once it is above the
+        // maximum load factor. The expansion then happens while cuckoo paths are
+        // still short, rather than when an insert finds no path at all.
+        template <typename LOCK_TYPE>
+        void maybe_grow_in_background() {
+            const double mlf = maximum_load_factor();
+            if (!LOCK_TYPE() || mlf == private_impl::NO_MAXIMUM_LOAD_FACTOR ||
+                maintenance.running()) {
+                return;
+            }
+            static thread_local size_type inserts = 0;
+            if (++inserts % private_impl::LOAD_FACTOR_CHECK_INTERVAL != 0) {
+                return;
+            }
+            const size_type current_hp = hashpower();
+            if (current_hp >= maximum_hashpower() || load_factor() <= mlf) {
+                return;
             }
+            background_expansion.try_start([this, current_hp] {
+                cuckoo_grow<private_impl::LOCKING_ACTIVE, automatic_resize>(current_hp);
+                while (help_expansion()) {
+                }
+            });
+        }
 
-            void run(ReadOperation operation) const {
-                std::private_impl::versioned_synchronizer::version_type first_version;
-                std::private_impl::versioned_synchronizer::version_type second_version;
-                auto l1 = lock_index(first_index);
-                auto l2 = lock_index(second_index);
-                if (l1 > l2) {
-                    std::swap(l1, l2);
+        // cuckoo_grow runs an automatic expansion of a table with the hashpower
+        // current_hp, adding the growth power to it, but going no further than
+        // the maximum hashpower unless a doubling would already exceed it.
+        template <typename LOCK_TYPE, typename AUTO_RESIZE>
+        operation_status cuckoo_grow(const size_type current_hp) {
+            const size_type mhp = maximum_hashpower();
+            const size_type step = mhp > current_hp ?
+                                   std::min(growth_power(), mhp - current_hp) : 1;
+            if (step == 1) {
+                return cuckoo_fast_double<LOCK_TYPE, AUTO_RESIZE>(current_hp);
+            }
+            if (!std::is_nothrow_move_constructible<key_type>::value ||
+                !std::is_nothrow_move_constructible<mapped_type>::value) {
+                return cuckoo_expand_simple<LOCK_TYPE, AUTO_RESIZE>(current_hp + step);
+            }
+            const size_type target_hp = current_hp + step;
+            if (!LOCK_TYPE() || hashsize(target_hp - 1) < std::private_impl::MAX_NUM_LOCKS) {
+                return cuckoo_reserve<LOCK_TYPE, AUTO_RESIZE>(current_hp, target_hp);
+            }
+            // Once the table has a bucket for every lock stripe, a step is taken
+            // as that many incremental doublings, so that the largest tables
+            // never stop the world for a whole copy. The smaller part of the
+            // way is done at once.
+            size_type hp = current_hp;
+            operation_status st;
+            if (hashsize(hp) < std::private_impl::MAX_NUM_LOCKS) {
+                while (hashsize(hp) < std::private_impl::MAX_NUM_LOCKS) {
+                    ++hp;
                 }
-                do {
-                    first_version = (*locks)[l1].read_lock();
-                    second_version = (*locks)[l2].read_lock();
-                    operation(first_index, second_index);
-                } while (!(*locks)[l1].try_read_unlock(first_version) ||
-                         !(*locks)[l2].try_read_unlock(second_version));
+                st = cuckoo_reserve<LOCK_TYPE, AUTO_RESIZE>(current_hp, hp);
+            } else {
+                st = cuckoo_incremental_double<AUTO_RESIZE>(hp++);
             }
-
-        private:
-            locks_t* locks;
-            size_type first_index;
-            size_type second_index;
-        };
-
-        template <typename LOCK_TYPE>
-        class bucket_write_guard {
-        public:
-            bucket_write_guard() {}
-            bucket_write_guard(locks_t* locks, size_type index)
-                : locks(locks, unlocker{index})
-                {
+            if (st != ok) {
+                return st;
+            }
+            for (; hp < target_hp; ++hp) {
+                // Each doubling starts from a fully migrated table, so help the
+                // previous one along a stripe at a time before taking the locks.
+                while (help_expansion()) {
                 }
-
-        private:
-            struct unlocker {
-                size_type index;
-                void operator()(locks_t* p) const {
-                    (*p)[lock_index(index)].write_unlock(LOCK_TYPE());
+                if (cuckoo_incremental_double<manual_resize>(hp) != ok) {
+                    // Someone else resized the table in the meantime.
+                    break;
                 }
-            };
+            }
+            return ok;
+        }
 
-            std::unique_ptr<locks_t, unlocker> locks;
-        };
+        // note_resize tells the scans about a resize between the hashpower
+        // smaller_hp and a larger one, before it moves any element. The
+        // elements keep their lock stripes as long as the smaller table has a
+        // bucket for every stripe.
+        void note_resize(const size_type smaller_hp) {
+            if (hashsize(smaller_hp) < std::private_impl::MAX_NUM_LOCKS) {
+                note_rehash();
+            }
+        }
 
-        template <typename LOCK_TYPE>
-        class two_buckets_write_guard {
-        public:
-            two_buckets_write_guard() {}
+        // note_rehash tells the scans about a resize that moves elements to
+        // other lock stripes, before it moves them; see
+        // scan_registry::rehashed. left_over holds the elements that a halving
+        // could not fit back into the table, which are still at the stripes
+        // of the buckets they came from. All the locks have to be taken.
+        void note_rehash(const buckets_t* left_over = nullptr) {
+            scans.rehashed([this, left_over](
+                    const std::function<void(size_type, size_type)>& record) {
+                const buckets_t* const arrays[] = {&buckets, left_over};
+                for (const buckets_t* from : arrays) {
+                    if (from == nullptr) {
+                        continue;
+                    }
+                    for (size_type i = from->next_occupied(0); i < from->size();
+                         i = from->next_occupied(i + 1)) {
+                        const bucket& b = (*from)[i];
+                        for (size_type slot = 0; slot < SLOTS_PER_BUCKET; ++slot) {
+                            if (b.occupied(slot)) {
+                                record(lock_index(i), hashed_key_only_hash(b.key(slot)));
+                            }
+                        }
+                    }
+                }
+                for (size_type i = 0; i < private_impl::STASH_SLOTS; ++i) {
+                    if (stash[i / SLOTS_PER_BUCKET].occupied(i % SLOTS_PER_BUCKET)) {
+                        record(private_impl::scan_registry::stash_position(i), stash_tags.hash(i));
+                    }
+                }
+            });
+        }
 
-            two_buckets_write_guard(locks_t* locks, size_type first, size_type second)
-                : locks(locks, two_buckets_unlocker{first, second}) {
+        // cuckoo_fast_double will double the size of the table by taking advantage
+        // of the properties of index_hash and alt_index. If the key's move
+        // constructor is not noexcept, we use cuckoo_expand_simple, since that
+        // provides a strong exception guarantee.
+        template <typename LOCK_TYPE, typename AUTO_RESIZE>
+        operation_status cuckoo_fast_double(size_type current_hp) {
+            if (!std::is_nothrow_move_constructible<key_type>::value ||
+                !std::is_nothrow_move_constructible<mapped_type>::value) {
+                return cuckoo_expand_simple<LOCK_TYPE, AUTO_RESIZE>(current_hp + 1);
             }
-
-            size_type first() const {
-                return locks.get_deleter().first;
+            if (LOCK_TYPE() && hashsize(current_hp) >= std::private_impl::MAX_NUM_LOCKS) {
+                return cuckoo_incremental_double<AUTO_RESIZE>(current_hp);
             }
+            const size_type new_hp = current_hp + 1;
+            auto unlocker = snapshot_and_write_lock_all<LOCK_TYPE>();
 
-            size_type second() const {
-                return locks.get_deleter().second;
+            auto st = check_resize_validity<AUTO_RESIZE>(current_hp, new_hp);
+            if (st != ok) {
+                return st;
             }
 
-            bool is_active() const {
-                return static_cast<bool>(locks);
-            }
+            note_resize(current_hp);
+            // The locks have to be resized before the elements move, so that
+            // move_buckets can carry the element counters over to the stripes
+            // of the new buckets.
+            maybe_resize_locks<LOCK_TYPE>(1UL << new_hp);
 
-            void unlock() {
-                locks.reset(nullptr);
+            if (buckets.grow_in_place(new_hp)) {
+                // Only the elements that belong to the new upper half move.
+                parallel_exec_elements(0, hashsize(current_hp),
+                                       [this, current_hp](size_type start, size_type end,
+                                                          std::exception_ptr&) {
+                                           for (; start < end; ++start) {
+                                               split_bucket(current_hp, start);
+                                           }
+                                       });
+                drain_stash_all();
+                return ok;
             }
 
-        private:
-            struct two_buckets_unlocker {
-                size_type first, second;
+            buckets_t new_buckets(new_hp, get_allocator(), get_placement_policy());
 
-                void operator()(locks_t *p) const {
-                    const size_type l1 = lock_index(first);
-                    const size_type l2 = lock_index(second);
-                    (*p)[l1].write_unlock(LOCK_TYPE());
-                    if (l1 != l2) {
-                        (*p)[l2].write_unlock(LOCK_TYPE());
-                    }
-                }
-            };
+            // We gradually unlock the new table, by processing each of the buckets
+            // corresponding to each lock we took. For each slot in an old bucket,
+            // we either leave it in the old bucket, or move it to the corresponding
+            // new bucket. After we're done with the bucket, we release the lock on
+            // it and the new bucket, letting other threads using the new map
+            // gradually. We only unlock the locks being used by the old table,
+            // because unlocking new locks would enable operations on the table
+            // before we want them. We also re-evaluate the partial key stored at
+            // each slot, since it depends on the hashpower.
+            parallel_exec_elements(0, hashsize(current_hp),
+                                   [this, current_hp, new_hp, &new_buckets](size_type start, size_type end,
+                                                              std::exception_ptr &eptr) {
+                                       try {
+                                           move_buckets<LOCK_TYPE>(new_buckets, current_hp, new_hp, start, end);
+                                       } catch (...) {
+                                           eptr = std::current_exception();
+                                       }
+                                   });
 
-            std::unique_ptr<locks_t, two_buckets_unlocker> locks;
-        };
+            buckets.swap(new_buckets);
+            retire_buckets(new_buckets);
+            drain_stash_all();
+            return ok;
+        }
 
         template <typename LOCK_TYPE>
-        class all_buckets_write_guard {
-        public:
-            all_buckets_write_guard()
-                    : all_locks(nullptr)
-            {
+        void move_buckets(buckets_t& new_buckets, size_type current_hp, size_type new_hp,
+                          size_type start_lock_ind, size_type end_lock_ind) {
+            for (size_type old_bucket_ind = start_lock_ind; old_bucket_ind < end_lock_ind;
+                 ++old_bucket_ind) {
+                move_bucket(buckets, new_buckets, current_hp, new_hp, old_bucket_ind);
             }
+        }
 
-            all_buckets_write_guard(all_locks_t* all_locks, typename all_locks_t::iterator first_locked)
-                : all_locks(all_locks, unlocker(first_locked))
-                {
+        // move_bucket moves the elements of one bucket of src_buckets, which has
+        // the hashpower current_hp, to their places in new_buckets, which has the
+        // hashpower new_hp = current_hp + 1.
+        void move_bucket(buckets_t& src_buckets, buckets_t& new_buckets, size_type current_hp,
+                         size_type new_hp, size_type old_bucket_ind) const {
+            // By doubling the table size, the index_hash and alt_index of
+            // each key got one bit added to the top, at position
+            // current_hp, which means anything we have to move will either
+            // be at the same bucket position, or exactly
+            // hashsize(current_hp) later than the current bucket
+            bucket &old_bucket = src_buckets[old_bucket_ind];
+            const size_type new_bucket_ind = old_bucket_ind + hashsize(current_hp);
+            size_type new_bucket_slot = 0;
+
+            // For each occupied slot, either move it into its same position in the
+            // new buckets container, or to the first available spot in the new
+            // bucket in the new buckets container.
+            for (size_type old_bucket_slot = 0; old_bucket_slot < std::private_impl::DEFAULT_SLOTS_PER_BUCKET;
+                 ++old_bucket_slot) {
+                if (!old_bucket.occupied(old_bucket_slot)) {
+                    continue;
+                }
+                const hash_value hv = hashed_key(old_bucket.key(old_bucket_slot));
+                const size_type old_ihash = index_hash(current_hp, hv.hash);
+                const size_type old_ahash =
+                        alt_index(current_hp, hv.partial, old_ihash);
+                const size_type new_ihash = index_hash(new_hp, hv.hash);
+                const size_type new_ahash = alt_index(new_hp, hv.partial, new_ihash);
+                size_type dst_bucket_ind, dst_bucket_slot;
+                if ((old_bucket_ind == old_ihash && new_ihash == new_bucket_ind) ||
+                    (old_bucket_ind == old_ahash && new_ahash == new_bucket_ind)) {
+                    // We're moving the key to the new bucket
+                    dst_bucket_ind = new_bucket_ind;
+                    dst_bucket_slot = new_bucket_slot++;
+                } else {
+                    // We're moving the key to the old bucket
+                    assert((old_bucket_ind == old_ihash && new_ihash == old_ihash) ||
+                           (old_bucket_ind == old_ahash && new_ahash == old_ahash));
+                    dst_bucket_ind = old_bucket_ind;
+                    dst_bucket_slot = old_bucket_slot;
+                }
+                new_buckets.set_element(dst_bucket_ind, dst_bucket_slot++,
+                                        old_bucket.partial(old_bucket_slot),
+                                        old_bucket.movable_key(old_bucket_slot),
+                                        std::move(old_bucket.mapped(old_bucket_slot)));
+                // When the new table has more stripes than the old one, the
+                // new bucket has a stripe of its own. No other thread touches
+                // either stripe, since each one covers a single old bucket.
+                if (lock_index(dst_bucket_ind) != lock_index(old_bucket_ind)) {
+                    --get_current_locks()[lock_index(old_bucket_ind)].elem_counter();
+                    ++get_current_locks()[lock_index(dst_bucket_ind)].elem_counter();
                 }
-
-            bool is_active() const {
-                return static_cast<bool>(all_locks);
             }
+        }
 
-            void unlock() {
-                all_locks.reset(nullptr);
+        // split_bucket is the in-place counterpart of move_bucket, for buckets
+        // that were doubled by grow_in_place: the elements of bucket index that
+        // belong to bucket index + hashsize(current_hp) in the doubled table move
+        // there, keeping their slot, which is free since that bucket is only fed
+        // by this one. The others stay where they are.
+        void split_bucket(const size_type current_hp, const size_type index) const {
+            bucket& b = buckets[index];
+            const size_type new_hp = current_hp + 1;
+            const size_type new_index = index + hashsize(current_hp);
+            for (size_type slot = 0; slot < SLOTS_PER_BUCKET; ++slot) {
+                if (!b.occupied(slot)) {
+                    continue;
+                }
+                const hash_value hv = hashed_key(b.key(slot));
+                const size_type new_first = index_hash(new_hp, hv.hash);
+                const size_type dst = index_hash(current_hp, hv.hash) == index
+                                      ? new_first
+                                      : alt_index(new_hp, hv.partial, new_first);
+                if (dst == index) {
+                    continue;
+                }
+                assert(dst == new_index);
+                buckets.set_element(new_index, slot, b.partial(slot), b.movable_key(slot),
+                                    std::move(b.mapped(slot)));
+                buckets.erase_element(index, slot);
+                // As in move_bucket, the stripes are either the same or each
+                // covers a single bucket.
+                if (lock_index(new_index) != lock_index(index)) {
+                    --get_current_locks()[lock_index(index)].elem_counter();
+                    ++get_current_locks()[lock_index(new_index)].elem_counter();
+                }
             }
+        }
 
-            void release() {
-                all_locks.release();
+        // cuckoo_incremental_double doubles a table that already has a bucket for
+        // every lock stripe without stopping the world for the whole copy. Since
+        // the lock of bucket i also covers bucket i + hashsize(current_hp), every
+        // stripe of the doubled table is filled from the same stripe of the old
+        // one. So it only takes all the locks to swap in the new, empty buckets,
+        // and leaves the elements in old_buckets. Each stripe is then migrated by
+        // the first thread that locks it (see migrate_stripe), by writers helping
+        // out, and by the background expansion task, which keeps the stalls
+        // down to one stripe's worth of buckets.
+        template <typename AUTO_RESIZE>
+        operation_status cuckoo_incremental_double(size_type current_hp) {
+            if (hashpower() != current_hp) {
+                // Don't allocate a doubled table only to find out another
+                // expansion already happened.
+                return failure_under_expansion;
             }
+            const size_type new_hp = current_hp + 1;
+            // Allocating the new buckets is the expensive part, so do it before
+            // taking the locks, unless the buckets can be grown in place.
+            buckets_t new_buckets(buckets_t::can_grow_in_place ? 0 : new_hp, get_allocator(),
+                                  get_placement_policy());
+            auto unlocker = snapshot_and_write_lock_all<private_impl::LOCKING_ACTIVE>();
 
-        private:
-            struct unlocker {
-                typename all_locks_t::iterator first_locked;
-
-                unlocker()
-                {
-                }
+            auto st = check_resize_validity<AUTO_RESIZE>(current_hp, new_hp);
+            if (st != ok) {
+                return st;
+            }
+            assert(get_current_locks().size() == std::private_impl::MAX_NUM_LOCKS);
 
-                unlocker(typename all_locks_t::iterator first_locked)
-                        : first_locked(first_locked)
-                {
+            // Grown in place, the lower half of the buckets still holds the
+            // elements of the old table, and migrating a stripe splits its
+            // buckets instead of moving them over.
+            expansion_in_place = buckets.grow_in_place(new_hp);
+            if (!expansion_in_place) {
+                if (new_buckets.hashpower() != new_hp) {
+                    buckets_t(new_hp, get_allocator(), get_placement_policy()).swap(new_buckets);
                 }
-
-                void operator()(all_locks_t* p) const {
-                    if (p != nullptr) {
-                        for (auto it = first_locked; it != p->end(); ++it) {
-                            locks_t& locks = *it;
-                            for (auto& lock : locks) {
-                                lock.write_unlock(LOCK_TYPE());
-                            }
-                        }
-                    }
+                old_buckets.swap(buckets);
+                buckets.swap(new_buckets);
+            }
+            expansion_source_hp = current_hp;
+            old_bucket_array.store(expansion_in_place ? &buckets[0] : &old_buckets[0],
+                                   std::memory_order_relaxed);
+            migrated_stripes.assign(std::private_impl::MAX_NUM_LOCKS, false);
+            migration_cursor.store(0, std::memory_order_relaxed);
+            stripes_left.store(std::private_impl::MAX_NUM_LOCKS, std::memory_order_relaxed);
+            expanding.store(true, std::memory_order_release);
+            drain_stash_all();
+            unlocker.unlock();
+
+            background_expansion.try_start([this] {
+                while (help_expansion()) {
                 }
-            };
-
-            std::unique_ptr<all_locks_t, unlocker> all_locks;
-        };
+            });
+            return ok;
+        }
 
-        // This exception is thrown whenever we try to lock a bucket, but the
-        // hashpower is not what was expected
-        class hashpower_changed {};
+        bool expansion_in_progress() const {
+            return expanding.load(std::memory_order_acquire);
+        }
 
-        // After taking a lock on the table for the given bucket, this function will
-        // check the hashpower to make sure it is the same as what it was before the
-        // lock was taken. If it isn't unlock the bucket and throw a
-        // hashpower_changed exception.
-        template <typename LOCK_TYPE>
-        inline void check_hashpower(const size_type old_hashpower, const size_type lock) const {
-            if (hashpower() != old_hashpower) {
-                locks_t& locks = get_current_locks();
-                locks[lock].write_unlock(LOCK_TYPE());
-                throw hashpower_changed();
+        // migrate_stripe moves the elements covered by the given lock stripe from
+        // old_buckets to buckets, unless that already happened or no incremental
+        // expansion is running. The stripe must be locked.
+        void migrate_stripe(const size_type stripe) const {
+            if (!expansion_in_progress() || migrated_stripes[stripe]) {
+                return;
+            }
+            const size_type old_hp = expansion_source_hp;
+            for (size_type i = stripe; i < hashsize(old_hp); i += std::private_impl::MAX_NUM_LOCKS) {
+                if (expansion_in_place) {
+                    split_bucket(old_hp, i);
+                } else {
+                    move_bucket(old_buckets, buckets, old_hp, old_hp + 1, i);
+                }
+            }
+            migrated_stripes[stripe] = true;
+            if (stripes_left.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                // Every stripe has been migrated, so nobody looks at the old
+                // buckets anymore. Lookups that still find the old array get it
+                // from old_bucket_array, and retry once it is cleared.
+                old_bucket_array.store(nullptr, std::memory_order_release);
+                expanding.store(false, std::memory_order_release);
+                if (!expansion_in_place) {
+                    retire_buckets(old_buckets);
+                }
             }
         }
 
-        // locks the given bucket index.
-        //
-        // throws hashpower_changed if it changed after taking the lock.
-        template <typename LOCK_TYPE>
-        inline bucket_write_guard<LOCK_TYPE> write_lock_one(const size_type hashpower,
-                                                            const size_type index) const {
-            const size_type l = lock_index(index);
-            locks_t& locks = get_current_locks();
-            locks[l].write_lock(LOCK_TYPE());
-            check_hashpower<LOCK_TYPE>(hashpower, l);
-            return bucket_write_guard<LOCK_TYPE>(&locks, index);
+        // help_expansion locks and migrates the next stripe nobody has claimed
+        // yet. It returns false once there is nothing left to claim.
+        bool help_expansion() const {
+            if (!expansion_in_progress()) {
+                return false;
+            }
+            const size_type stripe = migration_cursor.fetch_add(1, std::memory_order_relaxed);
+            if (stripe >= std::private_impl::MAX_NUM_LOCKS) {
+                return false;
+            }
+            lock_t& lock = get_current_locks()[stripe];
+            lock.write_lock(private_impl::LOCKING_ACTIVE());
+            migrate_stripe(stripe);
+            lock.write_unlock(private_impl::LOCKING_ACTIVE());
+            return true;
         }
 
-        // locks the two bucket indexes, always locking the earlier index first to
-        // avoid deadlock. If the two indexes are the same, it just locks one.
-        //
-        // throws hashpower_changed if it changed after taking the lock.
-        template <typename LOCK_TYPE>
-        two_buckets_write_guard<LOCK_TYPE> write_lock_two(const size_type hashpower, const size_type first,
-                                                          const size_type second) const {
-            size_type l1 = lock_index(first);
-            size_type l2 = lock_index(second);
-            if (l2 < l1) {
-                std::swap(l1, l2);
+        // finish_expansion migrates every stripe that is left. All the locks must
+        // be taken, or the table must not be shared.
+        void finish_expansion() const {
+            for (size_type stripe = 0;
+                 expansion_in_progress() && stripe < std::private_impl::MAX_NUM_LOCKS; ++stripe) {
+                migrate_stripe(stripe);
             }
-            locks_t& locks = get_current_locks();
-            assert(l1 < locks.size());
-            assert(l2 < locks.size());
+        }
 
-            locks[l1].write_lock(LOCK_TYPE());
-            check_hashpower<LOCK_TYPE>(hashpower, l1);
-            if (l2 != l1) {
-                locks[l2].write_lock(LOCK_TYPE());
+        // quiesce waits for the background expansion task and finishes any
+        // incremental expansion, so that the table can be moved or walked
+        // without locks.
+        concurrent_unordered_map& quiesce() {
+            background_expansion.join();
+            retired.reclaim();
+            if (expansion_in_progress()) {
+                snapshot_and_write_lock_all<private_impl::LOCKING_ACTIVE>();
             }
-            return two_buckets_write_guard<LOCK_TYPE>(&locks, first, second);
+            return *this;
         }
 
-        template<typename ReadOperation>
-        two_buckets_read_guard<ReadOperation> read_lock_two(const size_type hashpower, const size_type first,
-                                                            const size_type second) const {
-            locks_t& locks = get_current_locks();
-            return two_buckets_read_guard<ReadOperation>(&locks, first, second);
+        // maybe_shrink_in_background checks the load factor every
+        // LOAD_FACTOR_CHECK_INTERVAL erases of the calling thread, and halves the table
+        // on the background expansion thread once it was below the shrink load
+        // factor twice in a row.
+        void maybe_shrink_in_background() {
+            const double slf = shrink_load_factor();
+            if (slf == private_impl::NO_AUTOMATIC_SHRINK || maintenance.running()) {
+                return;
+            }
+            static thread_local size_type erases = 0;
+            if (++erases % private_impl::LOAD_FACTOR_CHECK_INTERVAL != 0) {
+                return;
+            }
+            if (load_factor() >= slf) {
+                below_shrink_load_factor.store(false, std::memory_order_relaxed);
+                return;
+            }
+            if (!below_shrink_load_factor.exchange(true, std::memory_order_relaxed)) {
+                return;
+            }
+            below_shrink_load_factor.store(false, std::memory_order_relaxed);
+            const size_type current_hp = hashpower();
+            if (current_hp == 0) {
+                return;
+            }
+            background_expansion.try_start([this, current_hp] {
+                shrink_once(current_hp);
+            });
         }
 
-        // snapshot_and_write_lock_all takes all the locks, and returns a deleter object
-        // that releases the locks upon destruction. Note that after taking all the
-        // locks, it is okay to resize the buckets_ container, since no other threads
-        // should be accessing the buckets.
-        template <typename LOCK_TYPE>
-        all_buckets_write_guard<LOCK_TYPE> snapshot_and_write_lock_all() const {
-            if (!LOCK_TYPE()) {
-                return all_buckets_write_guard<LOCK_TYPE>();
+        // shrink_once halves the table, provided it still has the hashpower
+        // current_hp. Takes all the locks.
+        void shrink_once(const size_type current_hp) {
+            if (!std::is_nothrow_move_constructible<key_type>::value ||
+                !std::is_nothrow_move_constructible<mapped_type>::value) {
+                cuckoo_expand_simple<private_impl::LOCKING_ACTIVE, manual_resize>(
+                        current_hp - 1);
+                return;
             }
+            auto unlocker = snapshot_and_write_lock_all<private_impl::LOCKING_ACTIVE>();
+            cuckoo_shrink(current_hp, current_hp - 1);
+        }
 
-            // all_locks_ should never decrease in size, so if it is non-empty now, it
-            // will remain non-empty
-            assert(!all_locks.empty());
-            auto first_locked = all_locks.end();
-            --first_locked;
-            auto current_locks = first_locked;
-            while (current_locks != all_locks.end()) {
-                locks_t& locks = *current_locks;
-                for (auto& lock : locks) {
-                    lock.write_lock(LOCK_TYPE());
+        // maintain is one look of the maintenance thread at the table. last_size
+        // is the number of elements it saw the previous time, and
+        // compaction_cursor the next lock stripe to compact, or MAX_NUM_LOCKS
+        // when no compaction pass is running.
+        void maintain(size_type& last_size, size_type& compaction_cursor) {
+            // Finish an incremental expansion first, so that writers stop paying
+            // for the migration.
+            while (help_expansion()) {
+            }
+            retired.reclaim();
+            const size_type current_hp = hashpower();
+            const size_type current_size = size();
+            const bool quiet = current_size == last_size;
+            last_size = current_size;
+            const double lf = load_factor();
+            const double mlf = maximum_load_factor();
+            if ((mlf != private_impl::NO_MAXIMUM_LOAD_FACTOR && lf > mlf) ||
+                stash_count.load(std::memory_order_acquire) >= private_impl::STASH_SLOTS / 2) {
+                if (current_hp < maximum_hashpower()) {
+                    cuckoo_grow<private_impl::LOCKING_ACTIVE, automatic_resize>(current_hp);
+                    while (help_expansion()) {
+                    }
                 }
-                ++current_locks;
+                return;
+            }
+            // Adding or removing elements may have displaced keys or freed up
+            // slots in their first buckets, so a compaction pass starts.
+            const size_type num_stripes =
+                std::min(size_type(std::private_impl::MAX_NUM_LOCKS), hashsize(current_hp));
+            if (!quiet && compaction_cursor >= num_stripes) {
+                compaction_cursor = 0;
+            }
+            if (compaction_cursor < num_stripes) {
+                const size_type last = std::min(
+                    compaction_cursor + private_impl::COMPACTION_STRIPES_PER_LOOK, num_stripes);
+                compact_stripes(compaction_cursor, last);
+                compaction_cursor = last < num_stripes ? last : size_type(std::private_impl::MAX_NUM_LOCKS);
+            }
+            if (!quiet) {
+                return;
+            }
+            const double slf = shrink_load_factor();
+            if (slf != private_impl::NO_AUTOMATIC_SHRINK && lf < slf && current_hp > 0) {
+                shrink_once(current_hp);
+            } else if (stash_count.load(std::memory_order_acquire) > 0) {
+                unstash_by_displacement();
             }
-            // Once we have taken all the locks of the "current" container, nobody
-            // else can do locking operations on the table.
-            return all_buckets_write_guard<LOCK_TYPE>(&all_locks, first_locked);
         }
 
-        template <typename LOCK_TYPE>
-        std::pair<two_buckets_write_guard<LOCK_TYPE>, bucket_write_guard<LOCK_TYPE>>
-            write_lock_three(const size_type hp, const size_type i1, const size_type i2,
-                             const size_type i3) const {
-            std::array<size_type, 3> l{{lock_index(i1), lock_index(i2), lock_index(i3)}};
-            // Lock in order.
-            if (l[2] < l[1])
-                std::swap(l[2], l[1]);
-            if (l[2] < l[0])
-                std::swap(l[2], l[0]);
-            if (l[1] < l[0])
-                std::swap(l[1], l[0]);
-            locks_t& locks = get_current_locks();
-            locks[l[0]].write_lock(LOCK_TYPE());
-            check_hashpower<LOCK_TYPE>(hp, l[0]);
-            if (l[1] != l[0]) {
-                locks[l[1]].write_lock(LOCK_TYPE());
-            }
-            if (l[2] != l[1]) {
-                locks[l[2]].write_lock(LOCK_TYPE());
+        // compact_stripes compacts the buckets of the lock stripes in
+        // [first, last), see compact, and returns how many keys it moved. A
+        // stripe is started over if the table is resized meanwhile.
+        size_type compact_stripes(const size_type first, const size_type last) {
+            size_type moved = 0;
+            for (size_type stripe = first; stripe < last; ++stripe) {
+                size_type hp = hashpower();
+                size_type index = stripe;
+                while (index < hashsize(hp)) {
+                    try {
+                        moved += compact_bucket(hp, index);
+                        index += std::private_impl::MAX_NUM_LOCKS;
+                    } catch (hashpower_changed&) {
+                        hp = hashpower();
+                        index = stripe;
+                    }
+                }
             }
-            return std::make_pair(two_buckets_write_guard<LOCK_TYPE>(&locks, i1, i2),
-                                  bucket_write_guard<LOCK_TYPE>((lock_index(i3) == lock_index(i1) ||
-                                                                 lock_index(i3) == lock_index(i2))
-                                                                ? nullptr
-                                                                : &locks,
-                                                                i3));
+            return moved;
         }
 
-        // snapshot_and_write_lock_two loads locks the buckets associated with the given
-        // hash value, making sure the hashpower doesn't change before the locks are
-        // taken. Thus it ensures that the buckets and locks corresponding to the
-        // hash value will stay correct as long as the locks are held. It returns
-        // the bucket indices associated with the hash value and the current
-        // hashpower.
-        template <typename LOCK_TYPE>
-        two_buckets_write_guard<LOCK_TYPE> snapshot_and_write_lock_two(const hash_value& hashvalue) const {
-            while (true) {
-                // Store the current hashpower we're using to compute the buckets
-                const size_type old_hashpower = hashpower();
-                const size_type first = index_hash(old_hashpower, hashvalue.hash);
-                const size_type second = alt_index(old_hashpower, hashvalue.partial, first);
-                try {
-                    return write_lock_two<LOCK_TYPE>(old_hashpower, first, second);
-                } catch (hashpower_changed &) {
-                    // The hashpower changed while taking the locks. Try again.
+        // compact_bucket moves the keys of the bucket at index that have their
+        // first bucket elsewhere into it, as far as it has free slots. The
+        // bucket is looked at without its lock first, so that only keys that
+        // may move cost a lock.
+        //
+        // throws hashpower_changed if it changed before a lock was taken.
+        size_type compact_bucket(const size_type hp, const size_type index) {
+            const bucket_snapshot snapshot =
+                snapshot_bucket<private_impl::LOCKING_ACTIVE>(hp, index);
+            size_type moved = 0;
+            for (size_type slot = 0; slot < SLOTS_PER_BUCKET; ++slot) {
+                if (!snapshot.occupied[slot]) {
                     continue;
                 }
+                // If index is the key's second bucket, alt_index gives its first.
+                const size_type first = alt_index(hp, snapshot.partial[slot], index);
+                if (first == index) {
+                    continue;
+                }
+                const auto guard =
+                    write_lock_two<private_impl::LOCKING_ACTIVE>(hp, first, index);
+                const bucket& from = buckets[index];
+                if (!from.occupied(slot) ||
+                    index_hash(hp, hashed_key(from.key(slot)).hash) != first) {
+                    continue;
+                }
+                const bucket& to = buckets[first];
+                for (size_type free_slot = 0; free_slot < SLOTS_PER_BUCKET; ++free_slot) {
+                    if (!to.occupied(free_slot)) {
+                        move_element(first, free_slot, index, slot);
+                        ++moved;
+                        break;
+                    }
+                }
             }
+            return moved;
         }
 
-        template<typename ReadOperation>
-        two_buckets_read_guard<ReadOperation> snapshot_and_read_lock_two(const hash_value& hashvalue) const {
+        // erase_stripe_if removes the elements of the buckets of the given
+        // lock stripe that pred holds for, see erase_if, under the stripe's
+        // lock, unless the scan is done with the stripe, and marks it done.
+        // The stripe is started over if the table is resized before the lock
+        // is taken.
+        template <typename Pred>
+        size_type erase_stripe_if(const size_type stripe, scan_state& scan, Pred& pred) {
             while (true) {
-                // Store the current hashpower we're using to compute the buckets
-                const size_type old_hashpower = hashpower();
-                const size_type first = index_hash(old_hashpower, hashvalue.hash);
-                const size_type second = alt_index(old_hashpower, hashvalue.partial, first);
+                const size_type hp = hashpower();
+                if (stripe >= hashsize(hp)) {
+                    scan.mark_done(stripe);
+                    return 0;
+                }
                 try {
-                    return read_lock_two<ReadOperation>(old_hashpower, first, second);
-                } catch (hashpower_changed &) {
-                    // The hashpower changed while taking the locks. Try again.
-                    continue;
+                    const auto guard = write_lock_one<private_impl::LOCKING_ACTIVE>(hp, stripe);
+                    // See visit_stripe_buckets.
+                    if (scan.done(stripe)) {
+                        return 0;
+                    }
+                    size_type erased = 0;
+                    for (size_type index = stripe; index < hashsize(hp);
+                         index += std::private_impl::MAX_NUM_LOCKS) {
+                        // An erase may move a stashed key into the lowest free
+                        // slot, so the slots are looked at from the last one
+                        // down, and a freed slot again.
+                        const bucket& b = buckets[index];
+                        for (size_type slot = SLOTS_PER_BUCKET; slot-- > 0;) {
+                            while (b.occupied(slot) &&
+                                   pred(static_cast<const value_type&>(b.element(slot)))) {
+                                del_from_bucket(index, slot);
+                                maybe_shrink_in_background();
+                                ++erased;
+                            }
+                        }
+                    }
+                    scan.mark_done(stripe);
+                    return erased;
+                } catch (hashpower_changed&) {
                 }
             }
         }
 
-        template <typename K, typename LOCK_TYPE>
-        table_position cuckoo_insert_loop(hash_value hashvalue,
-                                          two_buckets_write_guard<LOCK_TYPE>& guard,
-                                          K& key) {
-            table_position pos;
-            while (true) {
-                assert(guard.is_active());
-                const size_type old_hashpower = hashpower();
-                pos = cuckoo_insert(hashvalue, guard, key);
-                switch (pos.status) {
-                case ok:
-                case failure_key_duplicated:
-                    return pos;
-                case failure_table_full:
-                    // Expand the table and try again, re-grabbing the locks
-                    cuckoo_fast_double<LOCK_TYPE, automatic_resize>(old_hashpower);
-                    guard = snapshot_and_write_lock_two<LOCK_TYPE>(hashvalue);
-                    break;
-                case failure_under_expansion:
-                    // The table was under expansion while we were cuckooing. Re-grab the
-                    // locks and try again.
-                    guard = snapshot_and_write_lock_two<LOCK_TYPE>(hashvalue);
-                    break;
-                default:
-                    assert(false);
+        // sweep_stripes calls per_stripe with every lock stripe, on the worker
+        // pool if parallel is set, and returns the sum of what it returned.
+        template <typename F>
+        static size_type sweep_stripes(const bool parallel, F per_stripe) {
+            std::atomic<size_type> total(0);
+            auto sweep = [&per_stripe, &total](size_type stripe, size_type end,
+                                               std::exception_ptr& eptr) {
+                size_type sum = 0;
+                try {
+                    for (; stripe < end; ++stripe) {
+                        sum += per_stripe(stripe);
+                    }
+                } catch (...) {
+                    eptr = std::current_exception();
+                }
+                total.fetch_add(sum, std::memory_order_relaxed);
+            };
+            if (parallel) {
+                parallel_exec(0, std::private_impl::MAX_NUM_LOCKS, sweep);
+            } else {
+                std::exception_ptr eptr;
+                sweep(0, std::private_impl::MAX_NUM_LOCKS, eptr);
+                if (eptr) {
+                    std::rethrow_exception(eptr);
                 }
             }
+            return total.load(std::memory_order_relaxed);
         }
 
-        // run_cuckoo performs cuckoo hashing on the table in an attempt to free up
-        // a slot on either of the insert buckets, which are assumed to be locked
-        // before the start. On success, the bucket and slot that was freed up is
-        // stored in insert_bucket and insert_slot. In order to perform the search
-        // and the swaps, it has to release the locks, which can lead to certain
-        // concurrency issues, the details of which are explained in the function.
-        // If run_cuckoo returns ok (success), then `b` will be active, otherwise it
-        // will not.
-        template <typename LOCK_TYPE>
-        operation_status run_cuckoo(two_buckets_write_guard<LOCK_TYPE>& guard,
-                                    size_type& insert_bucket,
-                                    size_type& insert_slot) {
-            // We must unlock the buckets here, so that cuckoopath_search and
-            // cuckoopath_move can lock buckets as desired without deadlock.
-            // cuckoopath_move has to move something out of one of the original
-            // buckets as its last operation, and it will lock both buckets and
-            // leave them locked after finishing. This way, we know that if
-            // cuckoopath_move succeeds, then the buckets needed for insertion are
-            // still locked. If cuckoopath_move fails, the buckets are unlocked and
-            // we try again. This unlocking does present two problems. The first is
-            // that another insert on the same key runs and, finding that the key
-            // isn't in the table, inserts the key into the table. Then we insert
-            // the key into the table, causing a duplication. To check for this, we
-            // search the buckets for the key we are trying to insert before doing
-            // so (this is done in cuckoo_insert, and requires that both buckets are
-            // locked). Another problem is that an expansion runs and changes the
-            // hashpower, meaning the buckets may not be valid anymore. In this
-            // case, the cuckoopath functions will have thrown a hashpower_changed
-            // exception, which we catch and handle here.
-            size_type hp = hashpower();
-            guard.unlock();
-            private_impl::nodes path;
-            bool done = false;
+        // sweep goes over the table for visit_all and erase_if. It calls
+        // per_stripe with every lock stripe, on the worker pool if parallel is
+        // set, and per_element with the position of every stashed element, and
+        // returns the sum of what they returned. A stashed element's position
+        // is past the buckets, see bucket_at. The sweep registers as a scan,
+        // see scan_registry, whose positions per_stripe marks done under the
+        // stripe's lock, and in the end gives per_element the elements owed to
+        // it, so that each element that is in the table throughout is handed
+        // out exactly once.
+        template <typename F, typename G>
+        size_type sweep(const bool parallel, F per_stripe, G per_element) const {
+            scan_state scan(scans.rehashes(), true);
+            scans.add(&scan);
+            size_type total = 0;
             try {
-                while (!done) {
-                    const int depth =
-                        cuckoopath_search<LOCK_TYPE>(hp, path, guard.first(), guard.second());
-                    if (depth < 0) {
-                        break;
-                    }
-
-                    if (cuckoopath_move(hp, path, depth, guard)) {
-                        insert_bucket = path[0].bucket;
-                        insert_slot = path[0].slot;
-                        assert(insert_bucket == guard.first() || insert_bucket == guard.second());
-                        assert(LOCK_TYPE() == private_impl::LOCKING_INACTIVE() ||
-                               !get_current_locks()[lock_index(guard.first())].try_write_lock(LOCK_TYPE()));
-                        assert(LOCK_TYPE() == private_impl::LOCKING_INACTIVE() ||
-                               !get_current_locks()[lock_index(guard.second())].try_write_lock(LOCK_TYPE()));
-                        assert(!buckets[insert_bucket].occupied(insert_slot));
-                        done = true;
-                        break;
-                    }
+                total = sweep_stripes(parallel, [&per_stripe, &scan](size_type stripe) {
+                    return per_stripe(stripe, scan);
+                });
+                for (size_type i = 0; i < private_impl::STASH_SLOTS; ++i) {
+                    const size_type position = private_impl::scan_registry::stash_position(i);
+                    total += with_stashed(i, [this, &per_element, &scan, position](
+                            size_type index, size_type slot) {
+                        // A resize got in first, and owes the element to the scan.
+                        if (scan.done(position)) {
+                            return size_type(0);
+                        }
+                        const size_type result = per_element(buckets.size() + index, slot);
+                        scan.mark_done(position);
+                        return result;
+                    });
+                    scan.mark_done(position);
                 }
-            } catch (hashpower_changed &) {
-                // The hashpower changed while we were trying to cuckoo, which means
-                // we want to retry. b.first() and b.second() should not be locked
-                // in this case.
-                return failure_under_expansion;
+                for (const size_type hash : scan.take_owed()) {
+                    total += with_owed(hash, per_element);
+                }
+            } catch (...) {
+                scans.remove(&scan);
+                throw;
             }
-            return done ? ok : failure;
+            scans.remove(&scan);
+            return total;
         }
 
-        // slot_search searches for a cuckoo path using breadth-first search. It
-        // starts with the i1 and i2 buckets, and, until it finds a bucket with an
-        // empty slot, adds each slot of the bucket in the bfs_slot. If the queue runs
-        // out of space, it fails.
-        //
-        // throws hashpower_changed if it changed during the search
-        template <typename LOCK_TYPE>
-        bfs_slot slot_search(const size_type hp, const size_type i1,
-                             const size_type i2) {
-            bfs_queue q;
-            // The initial pathcode informs cuckoopath_search which bucket the path
-            // starts on
-            q.enqueue(bfs_slot(i1, 0, 0));
-            q.enqueue(bfs_slot(i2, 1, 0));
-            while (!q.full() && !q.empty()) {
-                bfs_slot x = q.dequeue();
-                // Picks a (sort-of) random slot to start from
-                size_type starting_slot = x.pathcode % SLOTS_PER_BUCKET;
-                for (size_type i = 0; i < SLOTS_PER_BUCKET && !q.full(); ++i) {
-                    size_type slot = (starting_slot + i) % SLOTS_PER_BUCKET;
-                    auto ob = write_lock_one<LOCK_TYPE>(hp, x.bucket);
-                    bucket& b = buckets[x.bucket];
-                    if (!b.occupied(slot)) {
-                        // We can terminate the search here
-                        x.pathcode = x.pathcode * SLOTS_PER_BUCKET + slot;
-                        return x;
-                    }
-
-                    // If x has less than the maximum number of path components,
-                    // create a new bfs_slot item, that represents the bucket we would
-                    // have come from if we kicked out the item at this slot.
-                    const partial_t partial = b.partial(slot);
-                    if (x.depth < MAX_BFS_PATH_LEN - 1) {
-                        bfs_slot y(alt_index(hp, partial, x.bucket),
-                                 x.pathcode * SLOTS_PER_BUCKET + slot, x.depth + 1);
-                        q.enqueue(y);
+        // with_owed calls func with the position of every element whose hash
+        // is hash, holding the locks of the elements' two buckets, and returns
+        // the sum of what it returned. See sweep for the positions.
+        template <typename F>
+        size_type with_owed(const size_type hash, F& func) const {
+            const hash_value hv{hash, partial_key(hash)};
+            const auto guard = snapshot_and_write_lock_two<private_impl::LOCKING_ACTIVE>(hv);
+            size_type total = 0;
+            for (const size_type index : {guard.first(), guard.second()}) {
+                if (index == guard.second() && guard.first() == guard.second()) {
+                    break;
+                }
+                const bucket& b = buckets[index];
+                for (size_type slot = SLOTS_PER_BUCKET; slot-- > 0;) {
+                    if (b.occupied(slot) && b.partial(slot) == hv.partial &&
+                        hashed_key_only_hash(b.key(slot)) == hash) {
+                        total += func(index, slot);
                     }
                 }
             }
-            // We didn't find a short-enough cuckoo path, so the queue ran out of
-            // space. Return a failure value.
-            return bfs_slot(0, 0, -1);
+            const size_type stashed = stash_tags.published_with(hash);
+            for (size_type i = 0; i < private_impl::STASH_SLOTS; ++i) {
+                if ((stashed & stash_bit(i)) != 0) {
+                    total += func(buckets.size() + i / SLOTS_PER_BUCKET, i % SLOTS_PER_BUCKET);
+                }
+            }
+            return total;
         }
 
-        // cuckoopath_search finds a cuckoo path from one of the starting buckets to
-        // an empty slot in another bucket. It returns the depth of the discovered
-        // cuckoo path on success, and -1 on failure. Since it doesn't take locks on
-        // the buckets it searches, the data can change between this function and
-        // cuckoopath_move. Thus cuckoopath_move checks that the data matches the
-        // cuckoo path before changing it.
-        //
-        // throws hashpower_changed if it changed during the search.
-        template <typename LOCK_TYPE>
-        int cuckoopath_search(const size_type hp, private_impl::nodes& path,
-                              const size_type i1, const size_type i2) {
-            private_impl::bfs_slot<SLOTS_PER_BUCKET> compressed_path =
-            slot_search<LOCK_TYPE>(hp, i1, i2);
-            if (compressed_path.depth == -1) {
-                return -1;
-            }
-            // Fill in the cuckoo path slots from the end to the beginning.
-            for (int i = compressed_path.depth; i >= 0; i--) {
-                path[i].slot = compressed_path.pathcode % SLOTS_PER_BUCKET;
-                compressed_path.pathcode /= SLOTS_PER_BUCKET;
-            }
-            // Fill in the cuckoo_path buckets and keys from the beginning to the
-            // end, using the final pathcode to figure out which bucket the path
-            // starts on. Since data could have been modified between slot_search
-            // and the computation of the cuckoo path, this could be an invalid
-            // cuckoo_path.
-            private_impl::node& first = path[0];
-            if (compressed_path.pathcode == 0) {
-                first.bucket = i1;
-            } else {
-                assert(compressed_path.pathcode == 1);
-                first.bucket = i2;
+        // visit_stripe calls functor on the elements in the buckets of the
+        // given lock stripe, see visit_all, unless the scan is done with the
+        // stripe, and marks it done. The stripe is started over if the table
+        // is resized before the lock is taken.
+        template <typename F>
+        void visit_stripe(const size_type stripe, scan_state& scan, F& functor) {
+            while (true) {
+                const size_type hp = hashpower();
+                if (stripe >= hashsize(hp)) {
+                    scan.mark_done(stripe);
+                    return;
+                }
+                try {
+                    const auto guard = write_lock_one<private_impl::LOCKING_ACTIVE>(hp, stripe);
+                    visit_stripe_buckets(hp, stripe, scan, functor);
+                    return;
+                } catch (hashpower_changed&) {
+                }
             }
-            {
-                const auto guard = write_lock_one<LOCK_TYPE>(hp, first.bucket);
-                const bucket& b = buckets[first.bucket];
-                if (!b.occupied(first.slot)) {
-                    // We can terminate here
-                    return 0;
+        }
+
+        template <typename F>
+        void visit_stripe(const size_type stripe, scan_state& scan, F& functor) const {
+            while (true) {
+                const size_type hp = hashpower();
+                if (stripe >= hashsize(hp)) {
+                    scan.mark_done(stripe);
+                    return;
+                }
+                try {
+                    if (expansion_in_progress()) {
+                        // Only a write lock moves the stripe's buckets over.
+                        const auto guard =
+                                write_lock_one<private_impl::LOCKING_ACTIVE>(hp, stripe);
+                        visit_stripe_buckets(hp, stripe, scan, functor);
+                    } else {
+                        const auto guard = read_lock_one(hp, stripe);
+                        visit_stripe_buckets(hp, stripe, scan, functor);
+                    }
+                    return;
+                } catch (hashpower_changed&) {
                 }
-                first.hv = hashed_key(b.key(first.slot));
             }
-            for (int i = 1; i <= compressed_path.depth; ++i) {
-                private_impl::node& cur = path[i];
-                const private_impl::node& prev = path[i - 1];
-                assert(prev.bucket == index_hash(hp, prev.hv.hash) ||
-                       prev.bucket ==
-                       alt_index(hp, prev.hv.partial, index_hash(hp, prev.hv.hash)));
-                // We get the bucket that this slot is on by computing the alternate
-                // index of the previous bucket
-                cur.bucket = alt_index(hp, prev.hv.partial, prev.bucket);
-                const auto guard = write_lock_one<LOCK_TYPE>(hp, cur.bucket);
-                const bucket& b = buckets[cur.bucket];
-                if (!b.occupied(cur.slot)) {
-                    // We can terminate here
-                    return i;
+        }
+
+        template <typename Bucket, typename F>
+        static void visit_bucket(Bucket& b, F& functor) {
+            for (size_type slot = 0; slot < SLOTS_PER_BUCKET; ++slot) {
+                if (b.occupied(slot)) {
+                    functor(b.element(slot));
                 }
-                cur.hv = hashed_key(b.key(cur.slot));
             }
-            return compressed_path.depth;
         }
 
-        // Checks whether the resize is okay to proceed. Returns a status code, or
-        // throws an exception, depending on the error type.
-        using automatic_resize = std::integral_constant<bool, true>;
-        using manual_resize = std::integral_constant<bool, false>;
+        // A resize that moved elements to other stripes may have got to the
+        // stripe first, in which case its elements are owed to the scan.
+        template <typename F>
+        void visit_stripe_buckets(const size_type hp, const size_type stripe, scan_state& scan,
+                                  F& functor) {
+            if (scan.done(stripe)) {
+                return;
+            }
+            for (size_type index = stripe; index < hashsize(hp);
+                 index += std::private_impl::MAX_NUM_LOCKS) {
+                visit_bucket(buckets[index], functor);
+            }
+            scan.mark_done(stripe);
+        }
 
-        template <typename AUTO_RESIZE>
-        operation_status check_resize_validity(const size_type orig_hp,
-                                               const size_type new_hp) {
-            const size_type mhp = maximum_hash_power_holder.load(std::memory_order_acquire);
-            if (mhp != private_impl::NO_MAXIMUM_HASHPOWER && new_hp > mhp) {
-                throw private_impl::maximum_hashpower_exceeded(new_hp);
+        template <typename F>
+        void visit_stripe_buckets(const size_type hp, const size_type stripe, scan_state& scan,
+                                  F& functor) const {
+            if (scan.done(stripe)) {
+                return;
             }
-            if (AUTO_RESIZE::value && load_factor() < minimum_load_factor()) {
-                throw private_impl::load_factor_too_low(minimum_load_factor());
+            for (size_type index = stripe; index < hashsize(hp);
+                 index += std::private_impl::MAX_NUM_LOCKS) {
+                visit_bucket(buckets[index], functor);
             }
-            if (hashpower() != orig_hp) {
-                // Most likely another expansion ran before this one could grab the
-                // locks
-                return failure_under_expansion;
+            scan.mark_done(stripe);
+        }
+
+        // with_stashed calls func with the stash bucket and slot of the given
+        // stash slot if it holds an element, and returns what func returned,
+        // or 0. Like every operation on a stashed key, it takes the locks of
+        // the key's two buckets, which keep the slot from changing once it is
+        // seen to still hold a key with the same hash.
+        template <typename F>
+        size_type with_stashed(const size_type stash_slot, F func) const {
+            const size_type stash_index = stash_slot / SLOTS_PER_BUCKET;
+            const size_type slot = stash_slot % SLOTS_PER_BUCKET;
+            while (stash_count.load(std::memory_order_acquire) != 0) {
+                const size_type hp = hashpower();
+                size_type hash;
+                partial_t partial;
+                {
+                    std::lock_guard<std::mutex> lock(stash_mutex);
+                    if (!stash[stash_index].occupied(slot)) {
+                        return 0;
+                    }
+                    hash = stash_tags.hash(stash_slot);
+                    partial = stash[stash_index].partial(slot);
+                }
+                try {
+                    const size_type first = index_hash(hp, hash);
+                    const auto guard = write_lock_two<private_impl::LOCKING_ACTIVE>(
+                            hp, first, alt_index(hp, partial, first));
+                    {
+                        std::lock_guard<std::mutex> lock(stash_mutex);
+                        if (!stash[stash_index].occupied(slot) ||
+                            stash_tags.hash(stash_slot) != hash) {
+                            continue;
+                        }
+                    }
+                    return func(stash_index, slot);
+                } catch (hashpower_changed&) {
+                }
             }
-            return ok;
+            return 0;
         }
 
-        // When we expand the contanier, we may need to expand the locks array, if
-        // the current locks array is smaller than the maximum size and also smaller
-        // than the number of buckets in the upcoming buckets container. In this
-        // case, we grow the locks array to the smaller of the maximum lock array
-        // size and the bucket count. This is done by allocating an entirely new lock
-        // container, taking all the locks, copying over the counters, and then
-        // finally adding it to the end of `all_locks_`, thereby designating it the
-        // "current" locks container. It is the responsibility of the caller to
-        // unlock all locks taken, including the new locks, whenever it is done with
-        // them, so that old threads can resume and potentially re-start.
-        template <typename LOCK_TYPE>
-        void maybe_resize_locks(size_type new_bucket_count) {
-            locks_t& current_locks = get_current_locks();
-            if (!(current_locks.size() < std::private_impl::MAX_NUM_LOCKS &&
-                  current_locks.size() < new_bucket_count)) {
+        // cuckoo_shrink halves the table until it reaches target_hp, provided it
+        // still has the hashpower current_hp. It stops early if a halving did not
+        // work out and the table had to be doubled back. All the locks have to
+        // be taken.
+        void cuckoo_shrink(const size_type current_hp, const size_type target_hp) {
+            if (hashpower() != current_hp) {
                 return;
             }
+            while (hashpower() > target_hp && cuckoo_halve()) {
+            }
+            drain_stash_all();
+        }
 
-            locks_t new_locks(std::min(size_type(std::private_impl::MAX_NUM_LOCKS),
-                                       new_bucket_count), get_allocator());
-            assert(new_locks.size() > current_locks.size());
-            std::copy(current_locks.begin(), current_locks.end(), new_locks.begin());
-            for (auto& lock : new_locks) {
-                lock.write_lock(LOCK_TYPE());
+        // cuckoo_halve is the inverse of cuckoo_fast_double. When the hashpower
+        // drops by one, both buckets of every key lose their top bit, so bucket i
+        // of the halved table takes the elements of buckets i and
+        // i + hashsize(new_hp), without rehashing anything. The few that do not
+        // fit are inserted into the halved table afterwards, which may cuckoo,
+        // stash them, or, if all else fails, double the table back, in which
+        // case it returns false. All the locks have to be taken, and keys and
+        // values have to be nothrow move constructible.
+        bool cuckoo_halve() {
+            const size_type current_hp = hashpower();
+            assert(current_hp > 0);
+            const size_type new_hp = current_hp - 1;
+            note_resize(new_hp);
+            buckets_t old(new_hp, get_allocator(), get_placement_policy());
+            buckets.swap(old);
+
+            std::atomic<size_type> num_left_over(0);
+            parallel_exec_elements(0, hashsize(new_hp),
+                                   [this, new_hp, &old, &num_left_over](size_type start, size_type end,
+                                                                        std::exception_ptr&) {
+                                       size_type left_over = 0;
+                                       for (; start < end; ++start) {
+                                           left_over += merge_buckets(old, new_hp, start);
+                                       }
+                                       num_left_over.fetch_add(left_over, std::memory_order_relaxed);
+                                   });
+
+            // The elements changed stripes, so count them again.
+            recount_elements();
+
+            if (num_left_over.load(std::memory_order_relaxed) == 0) {
+                retire_buckets(old);
+                return true;
             }
-            all_locks.emplace_back(std::move(new_locks));
+            // The elements left over are inserted anywhere.
+            note_rehash(&old);
+            for (size_type i = old.next_occupied(0); i < old.size(); i = old.next_occupied(i + 1)) {
+                for (size_type j = 0; j < SLOTS_PER_BUCKET; ++j) {
+                    if (old[i].occupied(j)) {
+                        rehome(old, i, j);
+                    }
+                }
+            }
+            retire_buckets(old);
+            return hashpower() == new_hp;
         }
 
-        // cuckoo_fast_double will double the size of the table by taking advantage
-        // of the properties of index_hash and alt_index. If the key's move
-        // constructor is not noexcept, we use cuckoo_expand_simple, since that
-        // provides a strong exception guarantee.
+        // recount_elements recomputes the element counter of every stripe of the
+        // current lock array from the buckets, one stripe per task. All the locks
+        // have to be taken.
+        void recount_elements() {
+            locks_t& locks = get_current_locks();
+            const size_type num_buckets = buckets.size();
+            parallel_exec(0, locks.size(),
+                          [this, &locks, num_buckets](size_type stripe, size_type end,
+                                                      std::exception_ptr&) {
+                              for (; stripe < end; ++stripe) {
+                                  size_type count = 0;
+                                  for (size_type i = stripe; i < num_buckets;
+                                       i += std::private_impl::MAX_NUM_LOCKS) {
+                                      for (size_type j = 0; j < SLOTS_PER_BUCKET; ++j) {
+                                          count += buckets[i].occupied(j);
+                                      }
+                                  }
+                                  locks[stripe].elem_counter() = count;
+                              }
+                          });
+        }
+
+        // cuckoo_reserve grows the table straight to new_hp. It generalizes
+        // cuckoo_fast_double to several bits at once: both bucket indices of a
+        // key keep their low current_hp bits, so every element of old bucket i
+        // lands in a bucket congruent to i, and no two old buckets share a
+        // destination. Each element can therefore keep its slot number. Keys and
+        // values have to be nothrow move constructible. An automatic resize only
+        // goes ahead if the table still has the hashpower orig_hp.
         template <typename LOCK_TYPE, typename AUTO_RESIZE>
-        operation_status cuckoo_fast_double(size_type current_hp) {
-            if (!std::is_nothrow_move_constructible<key_type>::value ||
-                !std::is_nothrow_move_constructible<mapped_type>::value) {
-                return cuckoo_expand_simple<LOCK_TYPE, AUTO_RESIZE>(current_hp + 1);
-            }
-            const size_type new_hp = current_hp + 1;
+        operation_status cuckoo_reserve(const size_type orig_hp, const size_type new_hp) {
+            // Allocating is the expensive part, so do it before taking the locks.
+            buckets_t new_buckets(new_hp, get_allocator(), get_placement_policy());
             auto unlocker = snapshot_and_write_lock_all<LOCK_TYPE>();
-
-            auto st = check_resize_validity<AUTO_RESIZE>(current_hp, new_hp);
+            const size_type current_hp = hashpower();
+            if (new_hp <= current_hp) {
+                // Another thread grew the table in the meantime.
+                return failure_under_expansion;
+            }
+            auto st = check_resize_validity<AUTO_RESIZE>(AUTO_RESIZE::value ? orig_hp : current_hp,
+                                                         new_hp);
             if (st != ok) {
                 return st;
             }
+            note_resize(current_hp);
+            maybe_resize_locks<LOCK_TYPE>(hashsize(new_hp));
 
-            buckets_t new_buckets(new_hp, get_allocator());
-
-            // We gradually unlock the new table, by processing each of the buckets
-            // corresponding to each lock we took. For each slot in an old bucket,
-            // we either leave it in the old bucket, or move it to the corresponding
-            // new bucket. After we're done with the bucket, we release the lock on
-            // it and the new bucket, letting other threads using the new map
-            // gradually. We only unlock the locks being used by the old table,
-            // because unlocking new locks would enable operations on the table
-            // before we want them. We also re-evaluate the partial key stored at
-            // each slot, since it depends on the hashpower.
-            parallel_exec(0, hashsize(current_hp),
-                          [this, current_hp, new_hp, &new_buckets](size_type start, size_type end,
-                                                     std::exception_ptr &eptr) {
-                              try {
-                                  move_buckets<LOCK_TYPE>(new_buckets, current_hp, new_hp, start, end);
-                              } catch (...) {
-                                  eptr = std::current_exception();
-                              }
-                          });
-
-            maybe_resize_locks<LOCK_TYPE>(1UL << new_hp);
+            parallel_exec_elements(0, hashsize(current_hp),
+                                   [this, current_hp, new_hp, &new_buckets](size_type start, size_type end,
+                                                                            std::exception_ptr&) {
+                                       for (; start < end; ++start) {
+                                           spread_bucket(new_buckets, current_hp, new_hp, start);
+                                       }
+                                   });
             buckets.swap(new_buckets);
+            retire_buckets(new_buckets);
+            recount_elements();
+            drain_stash_all();
             return ok;
         }
 
-        template <typename LOCK_TYPE>
-        void move_buckets(buckets_t& new_buckets, size_type current_hp, size_type new_hp,
-                          size_type start_lock_ind, size_type end_lock_ind) {
-            for (size_type old_bucket_ind = start_lock_ind; old_bucket_ind < end_lock_ind;
-                 ++old_bucket_ind) {
-                // By doubling the table size, the index_hash and alt_index of
-                // each key got one bit added to the top, at position
-                // current_hp, which means anything we have to move will either
-                // be at the same bucket position, or exactly
-                // hashsize(current_hp) later than the current bucket
-                bucket &old_bucket = buckets[old_bucket_ind];
-                const size_type new_bucket_ind = old_bucket_ind + hashsize(current_hp);
-                size_type new_bucket_slot = 0;
-
-                // For each occupied slot, either move it into its same position in the
-                // new buckets container, or to the first available spot in the new
-                // bucket in the new buckets container.
-                for (size_type old_bucket_slot = 0; old_bucket_slot < std::private_impl::DEFAULT_SLOTS_PER_BUCKET;
-                     ++old_bucket_slot) {
-                    if (!old_bucket.occupied(old_bucket_slot)) {
+        // spread_bucket moves the elements of bucket index to their buckets in
+        // new_buckets, which has the larger hashpower new_hp.
+        void spread_bucket(buckets_t& new_buckets, const size_type current_hp,
+                           const size_type new_hp, const size_type index) {
+            bucket& from = buckets[index];
+            for (size_type slot = 0; slot < SLOTS_PER_BUCKET; ++slot) {
+                if (!from.occupied(slot)) {
+                    continue;
+                }
+                const hash_value hv = hashed_key(from.key(slot));
+                const size_type new_first = index_hash(new_hp, hv.hash);
+                const size_type dst = index_hash(current_hp, hv.hash) == index
+                                      ? new_first
+                                      : alt_index(new_hp, hv.partial, new_first);
+                assert((dst & hashmask(current_hp)) == index);
+                new_buckets.set_element(dst, slot, from.partial(slot), from.movable_key(slot),
+                                        std::move(from.mapped(slot)));
+            }
+        }
+
+        // merge_buckets moves the elements of buckets index and
+        // index + hashsize(new_hp) of old into bucket index of the halved table,
+        // as far as they fit. Returns how many were left behind.
+        size_type merge_buckets(buckets_t& old, const size_type new_hp, const size_type index) {
+            size_type slot = 0;
+            size_type left_over = 0;
+            for (const size_type old_index : {index, index + hashsize(new_hp)}) {
+                bucket& from = old[old_index];
+                for (size_type j = 0; j < SLOTS_PER_BUCKET; ++j) {
+                    if (!from.occupied(j)) {
                         continue;
                     }
-                    const hash_value hv = hashed_key(old_bucket.key(old_bucket_slot));
-                    const size_type old_ihash = index_hash(current_hp, hv.hash);
-                    const size_type old_ahash =
-                            alt_index(current_hp, hv.partial, old_ihash);
-                    const size_type new_ihash = index_hash(new_hp, hv.hash);
-                    const size_type new_ahash = alt_index(new_hp, hv.partial, new_ihash);
-                    size_type dst_bucket_ind, dst_bucket_slot;
-                    if ((old_bucket_ind == old_ihash && new_ihash == new_bucket_ind) ||
-                        (old_bucket_ind == old_ahash && new_ahash == new_bucket_ind)) {
-                        // We're moving the key to the new bucket
-                        dst_bucket_ind = new_bucket_ind;
-                        dst_bucket_slot = new_bucket_slot++;
-                    } else {
-                        // We're moving the key to the old bucket
-                        assert((old_bucket_ind == old_ihash && new_ihash == old_ihash) ||
-                               (old_bucket_ind == old_ahash && new_ahash == old_ahash));
-                        dst_bucket_ind = old_bucket_ind;
-                        dst_bucket_slot = old_bucket_slot;
+                    if (slot == SLOTS_PER_BUCKET) {
+                        ++left_over;
+                        continue;
                     }
-                    new_buckets.set_element(dst_bucket_ind, dst_bucket_slot++,
-                                            old_bucket.partial(old_bucket_slot),
-                                            old_bucket.movable_key(old_bucket_slot),
-                                            std::move(old_bucket.mapped(old_bucket_slot)));
+                    buckets.set_element(index, slot++, from.partial(j), from.movable_key(j),
+                                        std::move(from.mapped(j)));
+                    old.erase_element(old_index, j);
+                }
+            }
+            return left_over;
+        }
+
+        // rehome inserts an element that was left behind by a halving into the
+        // table, doubling it back if there is no room for it at all.
+        void rehome(buckets_t& old, const size_type index, const size_type slot) {
+            bucket& from = old[index];
+            const hash_value hv = hashed_key(from.key(slot));
+            while (true) {
+                auto guard = snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
+                size_type work = private_impl::NO_MAXIMUM_DISPLACEMENT_WORK;
+                table_position pos = cuckoo_insert(hv, guard, from.key(slot), work);
+                if (pos.status == failure_table_full) {
+                    pos = stash_insert(hv, guard, from.key(slot));
+                }
+                if (pos.status == ok) {
+                    add_to_bucket(pos.index, pos.slot, hv.partial, from.movable_key(slot),
+                                  std::move(from.mapped(slot)));
+                    old.erase_element(index, slot);
+                    return;
                 }
+                assert(pos.status == failure_table_full);
+                guard.unlock();
+                cuckoo_fast_double<private_impl::LOCKING_INACTIVE, manual_resize>(hashpower());
             }
         }
 
@@ -2511,6 +6479,10 @@ namespace std {
             buckets.move_element(dst_bucket, dst_slot, src_bucket, src_slot);
             --get_current_locks()[lock_index(src_bucket)].elem_counter();
             ++get_current_locks()[lock_index(dst_bucket)].elem_counter();
+            scans.moved(lock_index(src_bucket), lock_index(dst_bucket),
+                        [this, dst_bucket, dst_slot] {
+                            return hashed_key_only_hash(buckets[dst_bucket].key(dst_slot));
+                        });
         }
 
 
@@ -2529,41 +6501,312 @@ namespace std {
             if (st != ok) {
                 return st;
             }
-            // Creates a new hash table with hashpower new_hp and adds all
-            // the elements from the old buckets.
-            concurrent_unordered_map new_map(hashsize(new_hp) * SLOTS_PER_BUCKET,
-                                             hash_function(), key_eq(), get_allocator());
+            note_rehash();
+            // Places the elements straight into new buckets with hashpower
+            // new_hp, without locks: the workers claim slots in an element's
+            // first or second bucket with an atomic counter per bucket. The few
+            // elements that find both full, and the stashed ones, are inserted
+            // once the new buckets are in place.
+            buckets_t new_buckets(new_hp, get_allocator(), get_placement_policy());
+            std::vector<std::atomic<uint8_t>> claimed(hashsize(new_hp));
+            std::vector<std::pair<size_type, size_type>> overflow;
+            std::mutex overflow_mutex;
+            parallel_exec_elements(0, hashsize(hp), [this, new_hp, &new_buckets, &claimed,
+                                                     &overflow, &overflow_mutex](
+                                                            size_type i, size_type end,
+                                                            std::exception_ptr& eptr) {
+                std::vector<std::pair<size_type, size_type>> left_over;
+                try {
+                    for (i = buckets.next_occupied(i, end); i < end;
+                         i = buckets.next_occupied(i + 1, end)) {
+                        bucket& b = buckets[i];
+                        for (size_type j = 0; j < SLOTS_PER_BUCKET; ++j) {
+                            if (!b.occupied(j)) {
+                                continue;
+                            }
+                            const hash_value hv = hashed_key(b.key(j));
+                            size_type index = index_hash(new_hp, hv.hash);
+                            int slot = claim_slot(claimed[index]);
+                            if (slot < 0) {
+                                index = alt_index(new_hp, hv.partial, index);
+                                slot = claim_slot(claimed[index]);
+                            }
+                            if (slot < 0) {
+                                left_over.emplace_back(i, j);
+                                continue;
+                            }
+                            new_buckets.place_element(index, slot, b.partial(j), b.movable_key(j),
+                                                      std::move(b.mapped(j)));
+                        }
+                    }
+                } catch (...) {
+                    eptr = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(overflow_mutex);
+                overflow.insert(overflow.end(), left_over.begin(), left_over.end());
+            });
 
-            parallel_exec(0, hashsize(hp), [this, &new_map](size_type i, size_type end,
-                                                            std::exception_ptr &eptr) {
-                              try {
-                                  for (; i < end; ++i) {
-                                      for (size_type j = 0; j < SLOTS_PER_BUCKET; ++j) {
-                                          if (buckets[i].occupied(j)) {
-                                              new_map.emplace(buckets[i].movable_key(j),
-                                                             std::move(buckets[i].mapped(j)));
-                                          }
-                                      }
-                                  }
-                              } catch (...) {
-                                  eptr = std::current_exception();
-                              }
-                          });
+            // From here on the old buckets only hold the left over elements.
+            maybe_resize_locks<LOCK_TYPE>(hashsize(new_hp));
+            buckets.swap(new_buckets);
+            buckets_t old_stash(stash.hashpower(), get_allocator());
+            {
+                std::lock_guard<std::mutex> lock(stash_mutex);
+                stash_tags.clear();
+                stash.swap(old_stash);
+                stash_reserved = 0;
+                stash_count.store(0, std::memory_order_release);
+            }
+            count_claimed(claimed);
 
-            // Swap the current buckets containers with new_map's. This is okay,
-            // because we have all the locks, so nobody else should be reading from the
-            // buckets array. Then the old buckets array will be deleted when new_map
-            // is deleted. We also need to `emulate` new_map's locks array, so we have
-            // the same size and data content. We can't swap the memory though, since
-            // other threads may still be looking at our lock memory. Regardless, we
-            // shouldn't need to swap the memory, since new_map is using the same
-            // allocator as we are.
-            maybe_resize_locks<LOCK_TYPE>(new_map.bucket_count());
-            buckets.swap(new_map.buckets);
+            for (const auto& position : overflow) {
+                bucket& b = new_buckets[position.first];
+                reinsert_element(b.movable_key(position.second),
+                                 std::move(b.mapped(position.second)));
+            }
+            for (size_type i = 0; i < old_stash.size(); ++i) {
+                for (size_type j = 0; j < SLOTS_PER_BUCKET; ++j) {
+                    if (old_stash[i].occupied(j)) {
+                        reinsert_element(old_stash[i].movable_key(j),
+                                         std::move(old_stash[i].mapped(j)));
+                    }
+                }
+            }
+            retire_buckets(new_buckets);
+            retire_buckets(old_stash);
 
             return ok;
         }
 
+        // claim_slot reserves the next free slot of a bucket that several
+        // threads fill at once, given the bucket's count of claimed slots.
+        // Returns -1 if the bucket is full.
+        static int claim_slot(std::atomic<uint8_t>& claimed) {
+            uint8_t slot = claimed.load(std::memory_order_relaxed);
+            while (slot < SLOTS_PER_BUCKET) {
+                if (claimed.compare_exchange_weak(slot, slot + 1, std::memory_order_relaxed)) {
+                    return slot;
+                }
+            }
+            return -1;
+        }
+
+        // count_claimed sets the element counters of the lock stripes from the
+        // number of slots claimed in each bucket.
+        void count_claimed(const std::vector<std::atomic<uint8_t>>& claimed) {
+            locks_t& locks = get_current_locks();
+            parallel_exec(0, locks.size(), [&locks, &claimed](size_type i, size_type end,
+                                                              std::exception_ptr&) {
+                for (; i < end; ++i) {
+                    size_type count = 0;
+                    for (size_type b = i; b < claimed.size(); b += locks.size()) {
+                        count += claimed[b].load(std::memory_order_relaxed);
+                    }
+                    locks[i].elem_counter() = count;
+                }
+            });
+        }
+
+        // bulk_load_size is the number of elements a range constructor sizes
+        // the table for: n, or the length of the range if that is larger and
+        // known up front.
+        template <typename InputIterator>
+        static size_type bulk_load_size(InputIterator first, InputIterator last, size_type n) {
+            return bulk_load_size(first, last, n,
+                                  typename std::iterator_traits<InputIterator>::iterator_category());
+        }
+
+        template <typename InputIterator>
+        static size_type bulk_load_size(InputIterator, InputIterator, size_type n,
+                                        std::input_iterator_tag) {
+            return n;
+        }
+
+        template <typename RandomIt>
+        static size_type bulk_load_size(RandomIt first, RandomIt last, size_type n,
+                                        std::random_access_iterator_tag) {
+            return std::max(n, static_cast<size_type>(last - first));
+        }
+
+        // bulk_load inserts the elements of [first, last) into a table that
+        // is still being constructed, so nobody else can see it and no locks
+        // are needed. When several elements have equivalent keys, it is
+        // unspecified which one is inserted.
+        template <typename InputIterator>
+        void bulk_load(InputIterator first, InputIterator last) {
+            try {
+                bulk_load(first, last,
+                          typename std::iterator_traits<InputIterator>::iterator_category());
+            } catch (...) {
+                // The destructor does not run when the constructor throws, and
+                // the helper threads are only joined after the members they
+                // use are gone, so a resize may have left one running.
+                background_expansion.join();
+                background_reclaim.join();
+                throw;
+            }
+        }
+
+        template <typename InputIterator>
+        void bulk_load(InputIterator first, InputIterator last, std::input_iterator_tag) {
+            for (; first != last; ++first) {
+                load_element(first->first, first->second);
+            }
+        }
+
+        // Random-access ranges are loaded on the worker pool. The elements
+        // are first sorted by groups of first buckets, and each worker places
+        // the elements of the groups it is handed in their first buckets,
+        // which no other worker touches, skipping the keys already there.
+        // The ones that find their first bucket full then claim a slot in
+        // their second bucket, the way cuckoo_expand_simple places elements,
+        // and the few left after that are inserted one at a time.
+        template <typename RandomIt>
+        void bulk_load(RandomIt first, RandomIt last, std::random_access_iterator_tag) {
+            const size_type count = static_cast<size_type>(last - first);
+            const size_type hp = hashpower();
+            const size_type group_size = std::min(hashsize(hp), private_impl::BULK_LOAD_GROUP);
+            const size_type num_groups = hashsize(hp) / group_size;
+
+            std::vector<size_type> hashes(count);
+            std::vector<std::atomic<size_type>> group_cursor(num_groups);
+            parallel_exec(0, count, [this, first, hp, group_size, &hashes, &group_cursor](
+                                            size_type i, size_type end, std::exception_ptr& eptr) {
+                try {
+                    for (; i < end; ++i) {
+                        hashes[i] = hashed_key_only_hash(first[i].first);
+                        group_cursor[index_hash(hp, hashes[i]) / group_size].fetch_add(
+                                1, std::memory_order_relaxed);
+                    }
+                } catch (...) {
+                    eptr = std::current_exception();
+                }
+            });
+            std::vector<size_type> group_start(num_groups + 1);
+            for (size_type g = 0; g < num_groups; ++g) {
+                group_start[g + 1] =
+                        group_start[g] + group_cursor[g].load(std::memory_order_relaxed);
+                group_cursor[g].store(group_start[g], std::memory_order_relaxed);
+            }
+            std::vector<size_type> order(count);
+            parallel_exec(0, count, [hp, group_size, &hashes, &group_cursor, &order](
+                                            size_type i, size_type end, std::exception_ptr&) {
+                for (; i < end; ++i) {
+                    const size_type g = index_hash(hp, hashes[i]) / group_size;
+                    order[group_cursor[g].fetch_add(1, std::memory_order_relaxed)] = i;
+                }
+            });
+
+            std::vector<std::atomic<uint8_t>> claimed(hashsize(hp));
+            std::vector<std::pair<size_type, size_type>> second;
+            std::mutex second_mutex;
+            parallel_exec_elements(0, num_groups, [this, first, hp, &hashes, &group_start, &order,
+                                                   &claimed, &second, &second_mutex](
+                                                          size_type g, size_type end,
+                                                          std::exception_ptr& eptr) {
+                // The elements whose first bucket is full, as pairs of that
+                // bucket and their position in the range.
+                std::vector<std::pair<size_type, size_type>> left_over;
+                try {
+                    for (size_type k = group_start[g]; k < group_start[end]; ++k) {
+                        const size_type i = order[k];
+                        const partial_t partial = partial_key(hashes[i]);
+                        const size_type index = index_hash(hp, hashes[i]);
+                        if (try_read_from_bucket(buckets[index], partial, first[i].first) >= 0) {
+                            continue;
+                        }
+                        const uint8_t slot = claimed[index].load(std::memory_order_relaxed);
+                        if (slot == SLOTS_PER_BUCKET) {
+                            left_over.emplace_back(index, i);
+                            continue;
+                        }
+                        buckets.set_element(index, slot, partial, first[i].first, first[i].second);
+                        claimed[index].store(slot + 1, std::memory_order_relaxed);
+                    }
+                    // Equivalent keys share their first bucket, so they are
+                    // all handled here and only one of each has to be kept.
+                    std::sort(left_over.begin(), left_over.end());
+                    auto kept = left_over.begin();
+                    auto run = kept;
+                    for (auto it = left_over.begin(); it != left_over.end(); ++it) {
+                        if (run != kept && run->first != it->first) {
+                            run = kept;
+                        }
+                        const bool duplicate = std::any_of(
+                                run, kept, [this, first, it](const std::pair<size_type, size_type>& e) {
+                                    return key_comparator(first[e.second].first, first[it->second].first);
+                                });
+                        if (!duplicate) {
+                            *kept++ = *it;
+                        }
+                    }
+                    left_over.erase(kept, left_over.end());
+                } catch (...) {
+                    eptr = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(second_mutex);
+                second.insert(second.end(), left_over.begin(), left_over.end());
+            });
+
+            std::vector<size_type> overflow;
+            std::mutex overflow_mutex;
+            parallel_exec_elements(0, second.size(), [this, first, hp, &hashes, &claimed, &second,
+                                                      &overflow, &overflow_mutex](
+                                                             size_type k, size_type end,
+                                                             std::exception_ptr& eptr) {
+                std::vector<size_type> left_over;
+                try {
+                    for (; k < end; ++k) {
+                        const size_type i = second[k].second;
+                        const partial_t partial = partial_key(hashes[i]);
+                        const size_type index = alt_index(hp, partial, second[k].first);
+                        const int slot = claim_slot(claimed[index]);
+                        if (slot < 0) {
+                            left_over.push_back(i);
+                            continue;
+                        }
+                        buckets.place_element(index, slot, partial, first[i].first,
+                                              first[i].second);
+                    }
+                } catch (...) {
+                    eptr = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(overflow_mutex);
+                overflow.insert(overflow.end(), left_over.begin(), left_over.end());
+            });
+            count_claimed(claimed);
+
+            for (const size_type i : overflow) {
+                load_element(first[i].first, first[i].second);
+            }
+        }
+
+        // load_element inserts an element into a table that is still being
+        // constructed, without taking locks. It does nothing if the key is
+        // already there.
+        template <typename K, typename V>
+        void load_element(K&& key, V&& val) {
+            const hash_value hv = hashed_key(key);
+            auto b = snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
+            const table_position pos = cuckoo_insert_loop(hv, b, key);
+            if (pos.status == ok) {
+                add_to_bucket(pos.index, pos.slot, hv.partial, std::forward<K>(key),
+                              std::forward<V>(val));
+            }
+        }
+
+        // reinsert_element inserts an element that is known not to be in the
+        // table, while all the locks are held.
+        template <typename K, typename V>
+        void reinsert_element(K&& key, V&& val) {
+            const hash_value hv = hashed_key(key);
+            auto b = snapshot_and_write_lock_two<private_impl::LOCKING_INACTIVE>(hv);
+            const table_position pos = cuckoo_insert_loop(hv, b, key);
+            assert(pos.status == ok);
+            add_to_bucket(pos.index, pos.slot, hv.partial, std::forward<K>(key),
+                          std::forward<V>(val));
+        }
+
         // cuckoopath_move moves keys along the given cuckoo path in order to make
         // an empty slot in one of the buckets in cuckoo_insert. Before the start of
         // this function, the two insert-locked buckets were unlocked in run_cuckoo.
@@ -2573,7 +6816,7 @@ namespace std {
         //
         // throws hashpower_changed if it changed during the move.
         template <typename LOCK_TYPE>
-        bool cuckoopath_move(const size_type hp, private_impl::nodes& path,
+        bool cuckoopath_move(const size_type hp, nodes& path,
                              size_type depth, two_buckets_write_guard<LOCK_TYPE>& guard) {
             assert(!guard.is_active());
             if (depth == 0) {
@@ -2621,12 +6864,13 @@ namespace std {
                 // that happened, just... try again. Also the slot we are filling in
                 // may have already been filled in by another thread, or the slot we
                 // are moving from may be empty, both of which invalidate the swap.
-                // We only need to check that the hash value is the same, because,
-                // even if the keys are different and have the same hash value, then
-                // the cuckoopath is still valid.
-                if (hashed_key_only_hash(from_bucket.key(from_slot)) != from.hv.hash ||
-                    to_bucket.occupied(to_slot) ||
-                    !from_bucket.occupied(from_slot)) {
+                // We only need to check that the partial key is the same, because
+                // the alternate bucket only depends on the partial key and the
+                // current bucket, so any element with that partial key in the from
+                // slot can legally move to the to bucket.
+                if (!from_bucket.occupied(from_slot) ||
+                    from_bucket.partial(from_slot) != from.partial ||
+                    to_bucket.occupied(to_slot)) {
                     return false;
                 }
 
@@ -2647,6 +6891,11 @@ namespace std {
         template <typename K, typename... Args>
         void add_to_bucket(const size_type bucket_index, const size_type slot,
                            const partial_t partial, K&& key, Args&&... val) {
+            if (is_stash_index(bucket_index)) {
+                add_to_stash(bucket_index - buckets.size(), slot, partial,
+                             std::forward<K>(key), std::forward<Args>(val)...);
+                return;
+            }
             buckets.set_element(bucket_index, slot, partial,
                                 std::forward<K>(key),
                                 std::forward<Args>(val)...);
@@ -2675,10 +6924,14 @@ namespace std {
             return true;
         }
 
+        // find_insert_position looks for the key and for a free slot in the two
+        // locked buckets. It returns failure_key_duplicated if the key is already
+        // in the table (or in the stash), ok with a free slot, and
+        // failure_table_full if both buckets are full.
         template <typename K, typename LOCK_TYPE>
-        table_position cuckoo_insert(const hash_value hashvalue,
-                                     two_buckets_write_guard<LOCK_TYPE>& guard,
-                                     K& key) {
+        table_position find_insert_position(const hash_value hashvalue,
+                                            two_buckets_write_guard<LOCK_TYPE>& guard,
+                                            K& key) {
             int res1, res2;
             bucket& b1 = buckets[guard.first()];
             if (!try_find_insert_bucket(b1, res1, hashvalue.partial, key)) {
@@ -2690,17 +6943,35 @@ namespace std {
                 return table_position{guard.second(), static_cast<size_type>(res2),
                         failure_key_duplicated};
             }
+            if (stash_count.load(std::memory_order_acquire) != 0) {
+                table_position pos = stash_find(key, hashvalue);
+                if (pos.status == ok) {
+                    pos.status = failure_key_duplicated;
+                    return pos;
+                }
+            }
             if (res1 != -1) {
                 return table_position{guard.first(), static_cast<size_type>(res1), ok};
             }
             if (res2 != -1) {
                 return table_position{guard.second(), static_cast<size_type>(res2), ok};
             }
+            return table_position{0, 0, failure_table_full};
+        }
+
+        template <typename K, typename LOCK_TYPE>
+        table_position cuckoo_insert(const hash_value hashvalue,
+                                     two_buckets_write_guard<LOCK_TYPE>& guard,
+                                     K& key, size_type& work) {
+            const table_position found = find_insert_position(hashvalue, guard, key);
+            if (found.status != failure_table_full) {
+                return found;
+            }
 
             // We are unlucky, so let's perform cuckoo hashing.
             size_type insert_bucket = 0;
             size_type insert_slot = 0;
-            auto st = run_cuckoo<LOCK_TYPE>(guard, insert_bucket, insert_slot);
+            auto st = run_cuckoo<LOCK_TYPE>(guard, insert_bucket, insert_slot, work);
             if (st == failure_under_expansion) {
                 // The run_cuckoo operation operated on an old version of the table,
                 // so we have to try again. We signal to the calling insert method
@@ -2718,7 +6989,7 @@ namespace std {
                 // Since we unlocked the buckets during run_cuckoo, another insert
                 // could have inserted the same key into either b.first() or
                 // b.second(), so we check for that before doing the insert.
-                table_position pos = cuckoo_find(key, hashvalue.partial,
+                table_position pos = cuckoo_find(key, hashvalue,
                                                  guard.first(), guard.second());
                 if (pos.status == ok) {
                     pos.status = failure_key_duplicated;
@@ -2732,58 +7003,62 @@ namespace std {
 
         template <typename F>
         static void parallel_exec(size_type start, size_type end, F func) {
-            static const size_type num_threads =
-            std::max(std::thread::hardware_concurrency(), 1U);
-            size_type work_per_thread = (end - start) / num_threads;
-            std::vector<std::thread> threads(num_threads);
-            std::vector<std::exception_ptr> eptrs(num_threads, nullptr);
-            for (size_type i = 0; i < num_threads - 1; ++i) {
-                threads[i] =
-                    std::thread(func, start, start + work_per_thread, std::ref(eptrs[i]));
-                start += work_per_thread;
-            }
-            threads.back() = std::thread(func, start, end, std::ref(eptrs.back()));
-            for (std::thread &t : threads) {
-                t.join();
-            }
-            for (std::exception_ptr &eptr : eptrs) {
-                if (eptr) {
-                    std::rethrow_exception(eptr);
-                }
+            private_impl::worker_pool::instance().run(start, end, func);
+        }
+
+        // parallel_exec_elements is parallel_exec for work that constructs or
+        // destroys elements, which stays on the calling thread unless the
+        // allocator may be used from several threads at once.
+        template <typename F>
+        static void parallel_exec_elements(size_type start, size_type end, F func) {
+            if (private_impl::allows_concurrent_use<allocator_type>::value) {
+                parallel_exec(start, end, func);
+                return;
+            }
+            std::exception_ptr eptr;
+            func(start, end, eptr);
+            if (eptr) {
+                std::rethrow_exception(eptr);
             }
         }
 
         void del_from_bucket(const size_type bucket_index, const size_type slot) {
+            if (is_stash_index(bucket_index)) {
+                del_from_stash(bucket_index - buckets.size(), slot);
+                return;
+            }
             buckets.erase_element(bucket_index, slot);
             assert(get_current_locks()[lock_index(bucket_index)].elem_counter() > 0);
             --get_current_locks()[lock_index(bucket_index)].elem_counter();
+            drain_stash(bucket_index);
         }
 
-        void minimum_load_factor(const double mlf) {
-            if (mlf < 0.0) {
-                throw std::invalid_argument("load factor " + std::to_string(mlf) +
-                                            " cannot be "
-                                            "less than 0");
-            } else if (mlf > 1.0) {
-                throw std::invalid_argument("load factor " + std::to_string(mlf) +
-                                            " cannot be "
-                                            "greater than 1");
-            }
-            minimum_load_factor_holder.store(mlf, std::memory_order_release);
-        }
-        double minimum_load_factor() {
-            return minimum_load_factor_holder.load(std::memory_order_acquire);
-        }
-
-        void maximum_hashpower(size_type mhp) {
-            if (hashpower() > mhp) {
-                throw std::invalid_argument("maximum hashpower " + std::to_string(mhp) +
-                                            " is less than current hashpower");
+        // replace_in_bucket destroys the element at the given position and
+        // constructs a new one in its place, for mapped types that cannot be
+        // assigned.
+        template <typename K, typename... Args>
+        void replace_in_bucket(const size_type bucket_index, const size_type slot,
+                               const partial_t partial, K&& key, Args&&... val) {
+            if (is_stash_index(bucket_index)) {
+                const size_type stash_slot = (bucket_index - buckets.size()) * SLOTS_PER_BUCKET + slot;
+                std::lock_guard<std::mutex> lock(stash_mutex);
+                stash_tags.unpublish(stash_slot);
+                stash.erase_element(bucket_index - buckets.size(), slot);
+                try {
+                    stash.set_element(bucket_index - buckets.size(), slot, partial,
+                                      std::forward<K>(key), std::forward<Args>(val)...);
+                    stash_tags.publish(stash_slot);
+                } catch (...) {
+                    stash_reserved &= ~stash_bit((bucket_index - buckets.size()) *
+                                                 SLOTS_PER_BUCKET + slot);
+                    stash_count.fetch_sub(1, std::memory_order_release);
+                    throw;
+                }
+                return;
             }
-            maximum_hash_power_holder.store(mhp, std::memory_order_release);
-        }
-        size_type maximum_hashpower() {
-            return maximum_hash_power_holder.load(std::memory_order_acquire);
+            buckets.erase_element(bucket_index, slot);
+            buckets.set_element(bucket_index, slot, partial, std::forward<K>(key),
+                                std::forward<Args>(val)...);
         }
 
         double load_factor() const {
@@ -2793,12 +7068,13 @@ namespace std {
         size_type size() const {
             size_type s = 0;
             if (!all_locks.empty()) {
+                private_impl::epoch_guard epoch;
                 auto &locks = get_current_locks();
                 for (size_type i = 0; i < locks.size(); ++i) {
                     s += locks[i].elem_counter();
                 }
             }
-            return s;
+            return s + stash_count.load(std::memory_order_acquire);
         }
         size_type capacity() const {
             return bucket_count() * SLOTS_PER_BUCKET;
@@ -2809,14 +7085,74 @@ namespace std {
         }
 
     private:
+        // Declared first, so that moving the table stops the maintenance thread
+        // and joins the background expansion and reclamation of the source
+        // before any of its state is moved.
+        private_impl::periodic_task maintenance;
+        private_impl::background_task background_expansion;
+        mutable private_impl::background_task background_reclaim;
+
         allocator_type allocator;
         hasher hash;
         key_equal key_comparator;
-        buckets_t buckets;
+        // The buckets are mutable because a lock stripe is migrated by the first
+        // thread that takes its lock during an incremental expansion, which may
+        // be a const lookup.
+        mutable buckets_t buckets;
         mutable all_locks_t all_locks;
-
-        std::atomic<size_type> minimum_load_factor_holder;
+        // Memory that was replaced while other threads may still be reading it,
+        // such as lock arrays replaced by larger ones.
+        mutable private_impl::retired_memory retired;
+
+        // While an incremental expansion is running, old_buckets holds the table
+        // being doubled and buckets the doubled one. migrated_stripes records, for
+        // each lock stripe, whether its buckets have been moved over yet; it is
+        // only written with the stripe locked, and read by lookups under the
+        // stripe's read protocol. Helpers claim stripes in order through
+        // migration_cursor, and whoever migrates the last stripe clears
+        // expanding and frees old_buckets.
+        mutable buckets_t old_buckets;
+        mutable std::vector<char> migrated_stripes;
+        mutable std::atomic<size_type> migration_cursor;
+        mutable std::atomic<size_type> stripes_left;
+        mutable std::atomic<bool> expanding;
+        // The hashpower the running expansion started from, and whether it grew
+        // the buckets in place rather than into a new container.
+        mutable size_type expansion_source_hp;
+        mutable bool expansion_in_place;
+        // The bucket array lookups read unmigrated stripes from, which is the
+        // lower half of buckets when they were grown in place. It is cleared
+        // before expanding, so that a lookup never follows it to an array
+        // retired after the expansion.
+        mutable std::atomic<const bucket*> old_bucket_array;
+
+        std::atomic<double> minimum_load_factor_holder;
         std::atomic<size_type> maximum_hash_power_holder;
+        std::atomic<size_type> maximum_displacement_work_holder;
+        std::atomic<double> shrink_load_factor_holder;
+        std::atomic<double> maximum_load_factor_holder;
+        std::atomic<size_type> growth_power_holder;
+        std::atomic<placement_policy> placement_holder;
+        // Set when the last load factor check was below the shrink load factor.
+        std::atomic<bool> below_shrink_load_factor;
+
+        buckets_t stash;
+        mutable std::mutex stash_mutex;
+        // Number of constructed stash elements; lookups skip the stash while it
+        // is zero.
+        std::atomic<size_type> stash_count;
+        // Bitmask of the stash slots handed out by stash_insert, guarded by
+        // stash_mutex.
+        size_type stash_reserved;
+        // Which stash slots hold a key, and each stashed key's full hash value,
+        // so that lookups need not lock the stash and draining does not rehash
+        // keys.
+        private_impl::stash_tag_array stash_tags;
+
+        // Where find and visit found their keys.
+        mutable private_impl::hit_counters hits;
+        // The concurrent ranges iterating over the table.
+        mutable private_impl::scan_registry scans;
 
         friend unit_test_internals_view;
     };
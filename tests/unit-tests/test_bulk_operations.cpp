@@ -0,0 +1,255 @@
+#include <atomic>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <catch.hpp>
+
+#include "unit_test_util.hpp"
+#include <concurrent_hash_map/concurrent_hash_map.hpp>
+
+using int_int_table = std::concurrent_unordered_map<int, int>;
+
+TEST_CASE("erase_if", "[bulk operations]") {
+    const int num_elems = 100000;
+    int_int_table table;
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i + 1));
+    }
+    auto even_key = [](const int_int_table::value_type& elem) {
+        return elem.first % 2 == 0;
+    };
+
+    SECTION("one stripe at a time") {
+        REQUIRE(table.erase_if(even_key) == num_elems / 2);
+    }
+
+    SECTION("stripes in parallel") {
+        REQUIRE(table.erase_if(even_key, true) == num_elems / 2);
+    }
+
+    SECTION("alongside writers") {
+        std::atomic<bool> done(false);
+        std::thread writer([&table, &done] {
+            for (int i = num_elems; i < 2 * num_elems; ++i) {
+                table.emplace(i, i + 1);
+            }
+            done = true;
+        });
+        auto old_even_key = [](const int_int_table::value_type& elem) {
+            return elem.first < num_elems && elem.first % 2 == 0;
+        };
+        // The writer displaces old keys across stripes, and none of them may
+        // be missed.
+        REQUIRE(table.erase_if(old_even_key) == num_elems / 2);
+        writer.join();
+        REQUIRE(done);
+        for (int i = num_elems; i < 2 * num_elems; ++i) {
+            REQUIRE(table.find(i).value() == i + 1);
+        }
+        REQUIRE(table.erase_if([](const int_int_table::value_type& elem) {
+            return elem.first >= num_elems;
+        }) == num_elems);
+    }
+
+    REQUIRE(table.make_unordered_map_view().size() == num_elems / 2);
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == (i % 2 == 0 ? -1 : i + 1));
+    }
+    REQUIRE(table.erase_if(even_key) == 0);
+}
+
+TEST_CASE("erase_if with a throwing predicate", "[bulk operations]") {
+    int_int_table table;
+    for (int i = 0; i < 1000; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    int calls = 0;
+    REQUIRE_THROWS_AS(table.erase_if([&calls](const int_int_table::value_type&) {
+        if (++calls == 500) {
+            throw std::runtime_error("predicate failed");
+        }
+        return true;
+    }), std::runtime_error);
+    REQUIRE(table.make_unordered_map_view().size() == 501);
+    // The table is still usable; no lock was left taken.
+    REQUIRE(table.erase_if([](const int_int_table::value_type&) { return true; }) == 501);
+    REQUIRE(table.make_unordered_map_view().empty());
+}
+
+TEST_CASE("visit_all", "[bulk operations]") {
+    // More buckets than lock stripes, so each stripe has several.
+    const int num_elems = 1 << 19;
+    int_int_table table(num_elems);
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    REQUIRE(table.make_unordered_map_view().bucket_count() >
+            std::private_impl::MAX_NUM_LOCKS);
+
+    auto increment = [](int_int_table::value_type& elem) { ++elem.second; };
+
+    SECTION("one stripe at a time") {
+        table.visit_all(increment);
+        for (int i = 0; i < num_elems; ++i) {
+            REQUIRE(table.find(i).value() == i + 1);
+        }
+    }
+
+    SECTION("stripes in parallel") {
+        table.visit_all(increment, true);
+        for (int i = 0; i < num_elems; ++i) {
+            REQUIRE(table.find(i).value() == i + 1);
+        }
+    }
+
+    SECTION("shared locks") {
+        std::atomic<long long> sum(0);
+        std::atomic<int> count(0);
+        const int_int_table& const_table = table;
+        const_table.visit_all([&sum, &count](const int_int_table::value_type& elem) {
+            sum += elem.second;
+            ++count;
+        }, true);
+        REQUIRE(count == num_elems);
+        REQUIRE(sum == static_cast<long long>(num_elems) * (num_elems - 1) / 2);
+    }
+
+    SECTION("shared locks while the table grows") {
+        // The inserts double the table incrementally, and the sweeps switch
+        // to write locks whenever they see an expansion start.
+        std::atomic<bool> done(false);
+        std::thread writer([&table, &done] {
+            for (int i = num_elems; i < 3 * num_elems; ++i) {
+                table.emplace(i, i);
+            }
+            done = true;
+        });
+        const int_int_table& const_table = table;
+        do {
+            int count = 0;
+            const_table.visit_all([&count](const int_int_table::value_type&) { ++count; });
+            REQUIRE(count > 0);
+        } while (!done);
+        writer.join();
+    }
+
+    SECTION("alongside writers") {
+        // The inserts move the old keys around to make room, and none of
+        // them may be visited twice or missed.
+        std::atomic<bool> done(false);
+        std::thread writer([&table, &done] {
+            for (int i = num_elems; i < 2 * num_elems; ++i) {
+                table.emplace(i, i);
+            }
+            done = true;
+        });
+        for (const bool parallel : {false, true}) {
+            std::vector<std::atomic<int>> visits(num_elems);
+            table.visit_all([&visits](int_int_table::value_type& elem) {
+                if (elem.first < num_elems) {
+                    ++visits[elem.first];
+                }
+            }, parallel);
+            for (int i = 0; i < num_elems; ++i) {
+                REQUIRE(visits[i] == 1);
+            }
+        }
+        writer.join();
+        REQUIRE(done);
+    }
+}
+
+TEST_CASE("visit_all alongside a rehash", "[bulk operations]") {
+    // Fewer buckets than lock stripes, so resizing moves elements across
+    // them, and the sweeps have to catch up on the ones they had not got to.
+    const int num_elems = 2000;
+    int_int_table table;
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    std::atomic<bool> done(false);
+    std::thread resizer([&table, &done] {
+        for (int i = 0; i < 50; ++i) {
+            table.reserve(20 * num_elems);
+            table.shrink_to_fit();
+        }
+        done = true;
+    });
+    const int_int_table& const_table = table;
+    do {
+        std::vector<int> visits(num_elems);
+        const_table.visit_all([&visits](const int_int_table::value_type& elem) {
+            ++visits[elem.first];
+        });
+        for (int i = 0; i < num_elems; ++i) {
+            REQUIRE(visits[i] == 1);
+        }
+    } while (!done);
+    resizer.join();
+}
+
+TEST_CASE("concurrent range", "[bulk operations]") {
+    const int num_elems = 1 << 19;
+    int_int_table table(num_elems);
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+
+    SECTION("sees every element once") {
+        auto range = table.make_concurrent_range();
+        long long sum = 0;
+        int count = 0;
+        for (const auto& elem : range) {
+            sum += elem.second;
+            ++count;
+        }
+        REQUIRE_FALSE(range.interrupted());
+        REQUIRE(count == num_elems);
+        REQUIRE(sum == static_cast<long long>(num_elems) * (num_elems - 1) / 2);
+    }
+
+    SECTION("alongside writers") {
+        // No key is inserted twice, so none may be seen twice, even though
+        // the inserts move other keys around.
+        std::atomic<bool> done(false);
+        std::thread writer([&table, &done] {
+            for (int i = num_elems / 2; i < num_elems; ++i) {
+                table.erase(i);
+                table.emplace(i + num_elems, i);
+            }
+            done = true;
+        });
+        do {
+            std::set<int> seen;
+            auto range = table.make_concurrent_range();
+            for (const auto& elem : range) {
+                REQUIRE(seen.insert(elem.first).second);
+                REQUIRE(elem.second == elem.first % num_elems);
+            }
+            REQUIRE_FALSE(range.interrupted());
+        } while (!done);
+        writer.join();
+    }
+}
+
+TEST_CASE("concurrent range ends on a rehash", "[bulk operations]") {
+    // Fewer buckets than lock stripes, so growing moves elements across them.
+    int_int_table table;
+    for (int i = 0; i < 1000; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    auto range = table.make_concurrent_range();
+    table.reserve(100000);
+    REQUIRE(range.begin() == range.end());
+    REQUIRE(range.interrupted());
+
+    auto fresh = table.make_concurrent_range();
+    int count = 0;
+    for (auto it = fresh.begin(); it != fresh.end(); ++it) {
+        ++count;
+    }
+    REQUIRE_FALSE(fresh.interrupted());
+    REQUIRE(count == 1000);
+}
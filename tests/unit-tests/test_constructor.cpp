@@ -2,7 +2,10 @@
 
 #include <array>
 #include <cmath>
+#include <list>
 #include <stdexcept>
+#include <utility>
+#include <vector>
 
 #include "unit_test_util.hpp"
 #include <concurrent_hash_map/concurrent_hash_map.hpp>
@@ -145,6 +148,61 @@ TEST_CASE("range constructor", "[constructor]") {
     }
 }
 
+TEST_CASE("bulk range constructor", "[constructor]") {
+    // Keys appear up to twice, with either value.
+    const int num_keys = 150000;
+    std::vector<std::pair<int, int>> elems;
+    for (int i = 0; i < 200000; ++i) {
+        elems.emplace_back(i % num_keys, i);
+    }
+    auto check = [num_keys](int_int_table& map) {
+        REQUIRE(map.make_unordered_map_view().size() == num_keys);
+        for (int i = 0; i < num_keys; ++i) {
+            const int value = map.find(i).value();
+            REQUIRE(value % num_keys == i);
+        }
+    };
+
+    SECTION("random-access range") {
+        int_int_table map(elems.begin(), elems.end(), 1);
+        REQUIRE(map.make_unordered_map_view().bucket_count() * 4 >= elems.size());
+        check(map);
+    }
+
+    SECTION("input range") {
+        std::list<std::pair<int, int>> list(elems.begin(), elems.end());
+        int_int_table map(list.begin(), list.end());
+        check(map);
+    }
+
+    SECTION("keys sharing buckets") {
+        // Four keys per hash value fill a bucket, so the keys of two hash
+        // values with the same first bucket overflow into their second ones.
+        struct clustering_hash {
+            size_t operator()(int key) const {
+                return static_cast<size_t>(key / 4) * 0x9e3779b97f4a7c15;
+            }
+        };
+        std::concurrent_unordered_map<int, int, clustering_hash> map(elems.begin(), elems.end());
+        REQUIRE(map.make_unordered_map_view().size() == num_keys);
+        for (int i = 0; i < num_keys; ++i) {
+            REQUIRE(map.find(i).value() % num_keys == i);
+        }
+    }
+
+    SECTION("keys that cannot be placed") {
+        // Eight keys per hash value only fit if nothing else shares their
+        // buckets, so the resizes give up on the load factor.
+        struct clustering_hash {
+            size_t operator()(int key) const {
+                return static_cast<size_t>(key / 8) * 0x9e3779b97f4a7c15;
+            }
+        };
+        using map_t = std::concurrent_unordered_map<int, int, clustering_hash>;
+        REQUIRE_THROWS_AS(map_t(elems.begin(), elems.end()), std::private_impl::load_factor_too_low);
+    }
+}
+
 TEST_CASE("move constructor", "[constructor]") {
     tbl_t map(10, StatefulHash(10), StatefulKeyEqual(20), alloc_t(30));
     map.emplace(10, 10);
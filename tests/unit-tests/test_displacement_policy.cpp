@@ -0,0 +1,150 @@
+#include <set>
+#include <thread>
+
+#include <catch.hpp>
+
+#include "unit_test_util.hpp"
+#include <concurrent_hash_map/concurrent_hash_map.hpp>
+
+template <class DisplacementPolicy>
+using policy_table =
+std::concurrent_unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+        std::allocator<std::pair<const int, int>>, DisplacementPolicy>;
+
+template <class Table>
+void fill_and_check(Table& table, const int num_elems) {
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i + 1));
+    }
+    REQUIRE(table.make_unordered_map_view().size() == static_cast<size_t>(num_elems));
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.find(i).value() == i + 1);
+    }
+    REQUIRE_FALSE(table.find(num_elems));
+
+    std::set<int> seen;
+    auto lt = table.make_unordered_map_view();
+    for (const auto& elem : lt) {
+        REQUIRE(elem.second == elem.first + 1);
+        REQUIRE(seen.insert(elem.first).second);
+    }
+    REQUIRE(seen.size() == static_cast<size_t>(num_elems));
+}
+
+TEST_CASE("default displacement policy", "[displacement policy]") {
+    policy_table<std::bfs_displacement<>> table(8);
+    REQUIRE((std::is_same<decltype(table), int_int_table>::value));
+    fill_and_check(table, 10000);
+}
+
+TEST_CASE("deeper bfs displacement policy", "[displacement policy]") {
+    policy_table<std::bfs_displacement<8, 1024>> table(8);
+    fill_and_check(table, 10000);
+}
+
+TEST_CASE("random walk displacement policy", "[displacement policy]") {
+    SECTION("default walk length") {
+        policy_table<std::random_walk_displacement<>> table(8);
+        fill_and_check(table, 10000);
+    }
+
+    SECTION("short walk length") {
+        policy_table<std::random_walk_displacement<2>> table(8);
+        fill_and_check(table, 10000);
+    }
+
+    SECTION("erase and reinsert") {
+        policy_table<std::random_walk_displacement<>> table(8);
+        fill_and_check(table, 5000);
+        for (int i = 0; i < 5000; i += 2) {
+            REQUIRE(table.erase(i) == 1);
+        }
+        for (int i = 0; i < 5000; i += 2) {
+            REQUIRE(table.emplace(i, i + 1));
+        }
+        REQUIRE(table.make_unordered_map_view().size() == 5000);
+        for (int i = 0; i < 5000; ++i) {
+            REQUIRE(table.find(i).value() == i + 1);
+        }
+    }
+}
+
+template <class Table>
+double lookup_hit_ratio(Table& table, const int num_elems) {
+    table.reset_hit_counters();
+    for (int i = 0; i < num_elems; i += 2) {
+        REQUIRE(table.find(i).value() == i + 1);
+    }
+    return table.first_bucket_hit_ratio();
+}
+
+template <class Table>
+void erase_and_compact(Table& table) {
+    const int num_elems = 20000;
+    REQUIRE(table.first_bucket_hit_ratio() == 1.0);
+    REQUIRE(!table.hit_counting());
+    table.set_hit_counting(true);
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i + 1));
+    }
+    for (int i = 1; i < num_elems; i += 2) {
+        REQUIRE(table.erase(i) == 1);
+    }
+    const double before = lookup_hit_ratio(table, num_elems);
+    REQUIRE(before < 1.0);
+    REQUIRE(table.compact() > 0);
+    REQUIRE(lookup_hit_ratio(table, num_elems) > before);
+    REQUIRE(table.make_unordered_map_view().size() == num_elems / 2);
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == (i % 2 == 0 ? i + 1 : -1));
+    }
+}
+
+TEST_CASE("compaction", "[displacement policy]") {
+    SECTION("cuckoo probing") {
+        policy_table<std::bfs_displacement<>> table(8);
+        erase_and_compact(table);
+    }
+
+    SECTION("hit counting is off by default") {
+        policy_table<std::bfs_displacement<>> table(8);
+        for (int i = 0; i < 20000; ++i) {
+            REQUIRE(table.emplace(i, i + 1));
+        }
+        for (int i = 1; i < 20000; i += 2) {
+            REQUIRE(table.erase(i) == 1);
+        }
+        REQUIRE(lookup_hit_ratio(table, 20000) == 1.0);
+        table.set_hit_counting(true);
+        const double counted = lookup_hit_ratio(table, 20000);
+        REQUIRE(counted < 1.0);
+        table.set_hit_counting(false);
+        for (int i = 0; i < 20000; i += 2) {
+            REQUIRE(table.find(i).value() == i + 1);
+        }
+        REQUIRE(table.first_bucket_hit_ratio() == counted);
+    }
+
+    SECTION("alongside writers") {
+        policy_table<std::bfs_displacement<>> table(8);
+        for (int i = 0; i < 20000; ++i) {
+            REQUIRE(table.emplace(i, i + 1));
+        }
+        std::thread writer([&table]() {
+            for (int i = 1; i < 20000; i += 2) {
+                table.erase(i);
+            }
+            for (int i = 20000; i < 40000; ++i) {
+                table.emplace(i, i + 1);
+            }
+        });
+        for (int pass = 0; pass < 10; ++pass) {
+            table.compact();
+        }
+        writer.join();
+        REQUIRE(table.make_unordered_map_view().size() == 30000);
+        for (int i = 0; i < 40000; ++i) {
+            REQUIRE(table.find(i).value_or(-1) == (i < 20000 && i % 2 == 1 ? -1 : i + 1));
+        }
+    }
+}
@@ -1,10 +1,15 @@
 #include <catch.hpp>
 
 #include <cstddef>
+#include <cstring>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <stdexcept>
+#include <thread>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 #include "unit_test_util.hpp"
 #include <iostream>
@@ -128,6 +133,136 @@ TEST_CASE("bucket container move construction", "[bucket container]") {
     REQUIRE(tc2.get_allocator().id == 5);
 }
 
+TEST_CASE("bucket container copies and clears large containers",
+          "[bucket container]") {
+    // Enough buckets to be split among the worker threads.
+    const size_t hashpower = 14;
+    allocator_wrapper<>::stateful_allocator<value_type> a;
+    testing_container<decltype(a)> tc(hashpower, a);
+    std::vector<std::shared_ptr<int>> keys;
+    for (size_t i = 0; i < tc.size(); ++i) {
+        keys.push_back(std::make_shared<int>(i));
+        tc.set_element(i, i % SLOT_PER_BUCKET, 0, keys.back(), i);
+    }
+    {
+        testing_container<decltype(a)> copy(tc);
+        for (size_t i = 0; i < copy.size(); ++i) {
+            REQUIRE(copy[i].occupied(i % SLOT_PER_BUCKET));
+            REQUIRE(copy[i].key(i % SLOT_PER_BUCKET) == keys[i]);
+            REQUIRE(copy[i].mapped(i % SLOT_PER_BUCKET) == static_cast<int>(i));
+            REQUIRE(keys[i].use_count() == 3);
+        }
+    }
+    for (const auto& key : keys) {
+        REQUIRE(key.use_count() == 2);
+    }
+    tc.clear();
+    for (size_t i = 0; i < tc.size(); ++i) {
+        REQUIRE_FALSE(tc[i].occupied(i % SLOT_PER_BUCKET));
+        REQUIRE(keys[i].use_count() == 1);
+    }
+}
+
+TEST_CASE("bucket container finds occupied buckets", "[bucket container]") {
+    allocator_wrapper<>::stateful_allocator<value_type> a;
+    testing_container<decltype(a)> tc(12, a);
+    REQUIRE(tc.next_occupied(0) == tc.size());
+
+    // Buckets at the edges of the summary words and blocks.
+    const std::vector<size_t> indices = {0, 63, 64, 511, 512, 1000, 4095};
+    for (const size_t i : indices) {
+        tc.set_element(i, 1, 0, std::make_shared<int>(i), i);
+        tc.set_element(i, 3, 0, std::make_shared<int>(i), i);
+    }
+    std::vector<size_t> found;
+    for (size_t i = tc.next_occupied(0); i < tc.size(); i = tc.next_occupied(i + 1)) {
+        found.push_back(i);
+    }
+    REQUIRE(found == indices);
+    REQUIRE(tc.next_occupied(65, 511) == 511);
+    REQUIRE(tc.next_occupied(65, 500) == 500);
+
+    // A bucket only counts as empty once its last element is gone.
+    tc.erase_element(512, 1);
+    REQUIRE(tc.next_occupied(65) == 511);
+    REQUIRE(tc.next_occupied(512) == 512);
+    tc.erase_element(512, 3);
+    REQUIRE(tc.next_occupied(512) == 1000);
+
+    testing_container<decltype(a)> copy(tc);
+    REQUIRE(copy.next_occupied(512) == 1000);
+    tc.resize(13);
+    REQUIRE(tc.next_occupied(1001) == 4095);
+    REQUIRE(tc.next_occupied(4096) == tc.size());
+    tc.clear();
+    REQUIRE(tc.next_occupied(0) == tc.size());
+    REQUIRE(copy.next_occupied(0) == 0);
+}
+
+struct thread_record {
+    std::mutex mutex;
+    std::set<std::thread::id> threads;
+};
+
+// thread_recording_allocator notes the threads it constructs and destroys
+// objects on. Being stateful, it does not promise to be usable from several
+// threads at once.
+template <class T>
+class thread_recording_allocator {
+public:
+    using value_type = T;
+
+    explicit thread_recording_allocator(std::shared_ptr<thread_record> r) : r(std::move(r)) {}
+
+    template <class U>
+    thread_recording_allocator(const thread_recording_allocator<U>& other) : r(other.r) {}
+
+    T* allocate(size_t n) { return std::allocator<T>().allocate(n); }
+
+    void deallocate(T* p, size_t n) { std::allocator<T>().deallocate(p, n); }
+
+    template <class U, class... Args>
+    void construct(U* p, Args&&... args) {
+        note();
+        new (p) U(std::forward<Args>(args)...);
+    }
+
+    template <class U>
+    void destroy(U* p) {
+        note();
+        p->~U();
+    }
+
+    bool operator==(const thread_recording_allocator& other) const { return r == other.r; }
+    bool operator!=(const thread_recording_allocator& other) const { return r != other.r; }
+
+    std::shared_ptr<thread_record> r;
+
+private:
+    void note() {
+        std::lock_guard<std::mutex> lock(r->mutex);
+        r->threads.insert(std::this_thread::get_id());
+    }
+};
+
+TEST_CASE("bucket container keeps stateful allocators on one thread",
+          "[bucket container]") {
+    auto r = std::make_shared<thread_record>();
+    thread_recording_allocator<value_type> a(r);
+    {
+        // Large enough to be split among the worker threads, if it were.
+        testing_container<decltype(a)> tc(14, a);
+        for (size_t i = 0; i < tc.size(); ++i) {
+            tc.set_element(i, i % SLOT_PER_BUCKET, 0, std::make_shared<int>(i), i);
+        }
+        testing_container<decltype(a)> copy(tc);
+        copy.resize(15);
+        tc.clear();
+    }
+    REQUIRE(r->threads.size() == 1);
+    REQUIRE(r->threads.count(std::this_thread::get_id()) == 1);
+}
+
 TEST_CASE("bucket container copy assignment with propagate",
           "[bucket container]") {
     allocator_wrapper<true>::stateful_allocator<value_type> a(5);
@@ -332,3 +467,72 @@ TEST_CASE("copy assignment with throwing type is destroyed properly",
     REQUIRE_THROWS_AS(other = container, std::runtime_error);
     exception_int::do_throw = false;
 }
+
+// Hands out memory full of garbage from allocate, and zero-filled memory from
+// allocate_zeroed, counting the calls of the latter.
+template <class T>
+class zeroing_allocator {
+public:
+    using value_type = T;
+
+    zeroing_allocator() {}
+
+    template <class U>
+    zeroing_allocator(const zeroing_allocator<U>&) {}
+
+    T* allocate(size_t n) {
+        T* p = std::allocator<T>().allocate(n);
+        std::memset(static_cast<void*>(p), 0xff, n * sizeof(T));
+        return p;
+    }
+
+    T* allocate_zeroed(size_t n) {
+        ++zeroed_allocations;
+        T* p = std::allocator<T>().allocate(n);
+        std::memset(static_cast<void*>(p), 0, n * sizeof(T));
+        return p;
+    }
+
+    void deallocate(T* p, size_t n) {
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    bool operator==(const zeroing_allocator&) const { return true; }
+
+    bool operator!=(const zeroing_allocator&) const { return false; }
+
+    static size_t zeroed_allocations;
+};
+
+template <class T>
+size_t zeroing_allocator<T>::zeroed_allocations = 0;
+
+TEST_CASE("bucket container uses zero-filled memory", "[bucket container]") {
+    using zeroed_container =
+    std::private_impl::bucket_container<int, int, zeroing_allocator<std::pair<const int, int>>,
+            uint8_t, SLOT_PER_BUCKET>;
+    REQUIRE(zeroed_container::zeroed_buckets);
+    REQUIRE(zeroed_container::trivial_teardown);
+    REQUIRE_FALSE(testing_container<std::allocator<value_type>>::trivial_teardown);
+    // std::allocator goes through operator new, which may be replaced, so
+    // its buckets are constructed rather than taken from calloc.
+    using heap_container =
+    std::private_impl::bucket_container<int, int, std::allocator<std::pair<const int, int>>,
+            uint8_t, SLOT_PER_BUCKET>;
+    REQUIRE_FALSE(heap_container::zeroed_buckets);
+
+    const size_t before = zeroed_container::bucket_allocator_type::zeroed_allocations;
+    zeroed_container tc(4, zeroed_container::allocator_type());
+    REQUIRE(zeroed_container::bucket_allocator_type::zeroed_allocations == before + 1);
+    for (size_t i = 0; i < tc.size(); ++i) {
+        for (size_t j = 0; j < SLOT_PER_BUCKET; ++j) {
+            REQUIRE_FALSE(tc[i].occupied(j));
+        }
+    }
+    tc.set_element(3, 1, 0, 10, 20);
+    REQUIRE(tc[3].occupied(1));
+    REQUIRE(tc[3].mapped(1) == 20);
+    tc.resize(6);
+    REQUIRE(tc[3].occupied(1));
+    REQUIRE_FALSE(tc[40].occupied(0));
+}
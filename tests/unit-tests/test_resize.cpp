@@ -1,4 +1,10 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include <catch.hpp>
 
@@ -16,6 +22,34 @@ TEST_CASE("rehash empty table", "[resize]") {
     REQUIRE(unit_test_internals_view::hashpower(table) == 1);
 }
 
+TEST_CASE("rehash full table", "[resize]") {
+    int_int_table table(8);
+    const int num_elems = 50000;
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    const size_t hp = unit_test_internals_view::hashpower(table);
+
+    SECTION("to a larger hashpower") {
+        table.make_unordered_map_view().rehash(hp + 3);
+        REQUIRE(unit_test_internals_view::hashpower(table) == hp + 3);
+    }
+
+    SECTION("to a hashpower too small for the elements") {
+        // The elements that do not fit grow the table again.
+        table.make_unordered_map_view().rehash(hp - 2);
+        REQUIRE(unit_test_internals_view::hashpower(table) >= hp - 1);
+    }
+
+    REQUIRE(table.make_unordered_map_view().size() == num_elems);
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == i);
+    }
+    REQUIRE(table.emplace(num_elems, num_elems));
+    REQUIRE(table.erase(0) == 1);
+    REQUIRE(table.make_unordered_map_view().size() == num_elems);
+}
+
 TEST_CASE("reserve calc", "[resize]") {
     const size_t slot_per_bucket = std::private_impl::DEFAULT_SLOTS_PER_BUCKET;
     REQUIRE(unit_test_internals_view::reserve_calc<int_int_table>(0) == 0);
@@ -55,21 +89,564 @@ size_t my_type::num_deletes = 0;
 TEST_CASE("Resizing number of frees", "[resize]") {
     my_type val{0};
     size_t num_deletes_after_resize;
+    // The table should allocate 2 buckets of 4 slots, and the stash takes the
+    // next STASH_SLOTS items before the table has to be resized.
+    const int num_elems = 8 + std::private_impl::STASH_SLOTS + 1;
     {
-        // Should allocate 2 buckets of 4 slots
         std::concurrent_unordered_map<int, my_type, std::hash<int>, std::equal_to<int>,
                 std::allocator<std::pair<const int, my_type>>>
                 map(8);
-        for (int i = 0; i < 9; ++i) {
+        for (int i = 0; i < num_elems; ++i) {
             map.emplace(i, val);
         }
-        // All of the items should be moved during resize to the new region of
-        // memory. Then up to 8 of them can be moved to their new bucket.
+        // The old buckets are freed once no reader can see them anymore, which
+        // making a view checks for.
+        map.make_unordered_map_view();
+        // All of the items in the table should be moved during resize to the
+        // new region of memory. Then up to 8 of them can be moved to their new
+        // bucket, and the stashed items can be moved back into the table.
         REQUIRE(my_type::num_deletes >= 8);
-        REQUIRE(my_type::num_deletes <= 17);
+        REQUIRE(my_type::num_deletes <= 17 + std::private_impl::STASH_SLOTS);
         num_deletes_after_resize = my_type::num_deletes;
     }
-    REQUIRE(my_type::num_deletes == num_deletes_after_resize + 9);
+    REQUIRE(my_type::num_deletes == num_deletes_after_resize + num_elems);
+}
+
+TEST_CASE("stash absorbs failed inserts", "[resize]") {
+    const size_t stash_slots = std::private_impl::STASH_SLOTS;
+    int_int_table table(8);
+    REQUIRE(unit_test_internals_view::hashpower(table) == 1);
+    for (int i = 0; i < 8 + static_cast<int>(stash_slots); ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    // The table is full, but the overflow went to the stash instead of
+    // doubling the table
+    REQUIRE(unit_test_internals_view::hashpower(table) == 1);
+    REQUIRE(unit_test_internals_view::stash_size(table) == stash_slots);
+    REQUIRE(table.make_unordered_map_view().size() == 8 + stash_slots);
+    for (int i = 0; i < 8 + static_cast<int>(stash_slots); ++i) {
+        REQUIRE(table.find(i).value_or(-1) == i);
+        REQUIRE_FALSE(table.emplace(i, -1));
+    }
+
+    SECTION("iteration covers the stash") {
+        auto view = table.make_unordered_map_view();
+        size_t count = 0;
+        for (const auto& kv : view) {
+            REQUIRE(kv.first == kv.second);
+            ++count;
+        }
+        REQUIRE(count == 8 + stash_slots);
+    }
+
+    SECTION("erase drains the stash") {
+        for (int i = 0; i < 8 + static_cast<int>(stash_slots); ++i) {
+            REQUIRE(table.update(i, i + 1) == 1);
+        }
+        size_t erased = 0;
+        for (int i = 0; i < 8 + static_cast<int>(stash_slots) &&
+                        unit_test_internals_view::stash_size(table) > 0; ++i) {
+            REQUIRE(table.erase(i) == 1);
+            ++erased;
+        }
+        REQUIRE(unit_test_internals_view::stash_size(table) == 0);
+        REQUIRE(table.make_unordered_map_view().size() == 8 + stash_slots - erased);
+        for (int i = erased; i < 8 + static_cast<int>(stash_slots); ++i) {
+            REQUIRE(table.find(i).value_or(-1) == i + 1);
+        }
+    }
+
+    SECTION("erase_if sweeps the stash") {
+        REQUIRE(table.erase_if([](const int_int_table::value_type& elem) {
+            return elem.first % 2 == 0;
+        }) == (8 + stash_slots) / 2);
+        REQUIRE(table.make_unordered_map_view().size() == (8 + stash_slots) / 2);
+        for (int i = 0; i < 8 + static_cast<int>(stash_slots); ++i) {
+            REQUIRE(table.find(i).value_or(-1) == (i % 2 == 0 ? -1 : i));
+        }
+    }
+
+    SECTION("visit_all covers the stash") {
+        table.visit_all([](int_int_table::value_type& elem) { elem.second = -elem.first; });
+        int count = 0;
+        static_cast<const int_int_table&>(table).visit_all(
+                [&count](const int_int_table::value_type& elem) {
+                    REQUIRE(elem.second == -elem.first);
+                    ++count;
+                });
+        REQUIRE(count == 8 + static_cast<int>(stash_slots));
+    }
+
+    SECTION("a full stash triggers a resize") {
+        REQUIRE(table.emplace(100, 100));
+        REQUIRE(unit_test_internals_view::hashpower(table) == 2);
+        REQUIRE(table.make_unordered_map_view().size() == 9 + stash_slots);
+        for (int i = 0; i < 8 + static_cast<int>(stash_slots); ++i) {
+            REQUIRE(table.find(i).value_or(-1) == i);
+        }
+        REQUIRE(table.find(100).value_or(-1) == 100);
+    }
+}
+
+TEST_CASE("stash drains through displacement", "[resize]") {
+    // A key parked in the stash goes back into the table once displacement
+    // can make room in one of its buckets, even if neither of them sees an
+    // erase and the table is not resized.
+    int_int_table table(65536);
+    const size_t hp = unit_test_internals_view::hashpower(table);
+    int num_elems = 0;
+    while (unit_test_internals_view::stash_size(table) == 0) {
+        REQUIRE(table.emplace(num_elems, num_elems));
+        ++num_elems;
+    }
+    auto buckets_of = [hp](const int key) {
+        const size_t hv = std::hash<int>()(key);
+        const size_t first = unit_test_internals_view::index_hash<int_int_table>(hp, hv);
+        return std::make_pair(first, unit_test_internals_view::alt_index<int_int_table>(
+                hp, unit_test_internals_view::partial_key<int_int_table>(hv), first));
+    };
+    // The last key found both its buckets full, so it is the stashed one.
+    const auto stashed = buckets_of(num_elems - 1);
+
+    // Lookups, including misses, do not need the stash mutex.
+    {
+        std::unique_lock<std::mutex> lock(unit_test_internals_view::stash_mutex(table));
+        std::atomic<bool> done(false);
+        std::thread reader([&table, &done, num_elems] {
+            for (int i = 0; i < num_elems + 1000; ++i) {
+                table.find(i);
+            }
+            done = true;
+        });
+        for (int i = 0; i < 5000 && !done; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        const bool finished_while_locked = done;
+        lock.unlock();
+        reader.join();
+        REQUIRE(finished_while_locked);
+    }
+
+    std::vector<int> erased;
+    const size_t num_erased = num_elems / 4;
+    for (int i = 0; i < num_elems - 1 && erased.size() < num_erased; ++i) {
+        const auto b = buckets_of(i);
+        if (b.first != stashed.first && b.first != stashed.second &&
+            b.second != stashed.first && b.second != stashed.second) {
+            REQUIRE(table.erase(i) == 1);
+            erased.push_back(i);
+        }
+    }
+    REQUIRE(unit_test_internals_view::stash_size(table) == 1);
+    // The inserts look at the stash every LOAD_FACTOR_CHECK_INTERVAL of them.
+    erased.resize(erased.size() / 2);
+    for (const int key : erased) {
+        REQUIRE(table.emplace(key, key));
+    }
+    for (int i = 0; i < 5000 && unit_test_internals_view::stash_size(table) > 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(unit_test_internals_view::stash_size(table) == 0);
+    REQUIRE(unit_test_internals_view::hashpower(table) == hp);
+    REQUIRE(table.make_unordered_map_view().size() == num_elems - num_erased + erased.size());
+    REQUIRE(table.find(num_elems - 1).value_or(-1) == num_elems - 1);
+    for (const int key : erased) {
+        REQUIRE(table.find(key).value_or(-1) == key);
+    }
+}
+
+TEST_CASE("bounded displacement work", "[resize]") {
+    int_int_table table(8);
+    REQUIRE(table.maximum_displacement_work() ==
+            std::private_impl::NO_MAXIMUM_DISPLACEMENT_WORK);
+    REQUIRE_THROWS_AS(table.maximum_displacement_work(0), std::invalid_argument);
+    table.maximum_displacement_work(1);
+    REQUIRE(table.maximum_displacement_work() == 1);
+
+    const int num_elems = 20000;
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    REQUIRE(table.make_unordered_map_view().size() == num_elems);
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == i);
+    }
+
+    SECTION("moving joins the background expansion") {
+        int_int_table moved(std::move(table));
+        REQUIRE(moved.maximum_displacement_work() == 1);
+        REQUIRE(moved.make_unordered_map_view().size() == num_elems);
+        for (int i = 0; i < num_elems; ++i) {
+            REQUIRE(moved.find(i).value_or(-1) == i);
+        }
+    }
+}
+
+TEST_CASE("incremental expansion", "[resize]") {
+    // With a bucket for every lock stripe, doubling the table migrates the
+    // stripes one at a time instead of copying the table under all the locks.
+    int_int_table table(std::private_impl::MAX_NUM_LOCKS *
+                        std::private_impl::DEFAULT_SLOTS_PER_BUCKET);
+    const size_t hp = unit_test_internals_view::hashpower(table);
+    int num_elems = 0;
+    while (unit_test_internals_view::hashpower(table) == hp) {
+        REQUIRE(table.emplace(num_elems, num_elems));
+        ++num_elems;
+    }
+    REQUIRE(unit_test_internals_view::hashpower(table) == hp + 1);
+
+    // Lookups and inserts keep working while the stripes are migrated.
+    std::atomic<int> missing(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&table, &missing, num_elems, t] {
+            for (int i = t; i < num_elems; i += 4) {
+                if (table.find(i).value_or(-1) != i) {
+                    ++missing;
+                }
+            }
+        });
+    }
+    const int num_extra = 10000;
+    for (int i = num_elems; i < num_elems + num_extra; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    REQUIRE(missing == 0);
+
+    REQUIRE(table.make_unordered_map_view().size() == num_elems + num_extra);
+    REQUIRE_FALSE(unit_test_internals_view::expansion_in_progress(table));
+    REQUIRE(unit_test_internals_view::hashpower(table) == hp + 1);
+    for (int i = 0; i < num_elems + num_extra; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == i);
+    }
+}
+
+TEST_CASE("incremental expansion by a larger growth power", "[resize]") {
+    // Each step of the growth power is its own incremental doubling.
+    int_int_table table(std::private_impl::MAX_NUM_LOCKS *
+                        std::private_impl::DEFAULT_SLOTS_PER_BUCKET);
+    table.growth_power(2);
+    const size_t hp = unit_test_internals_view::hashpower(table);
+    int num_elems = 0;
+    while (unit_test_internals_view::hashpower(table) == hp) {
+        REQUIRE(table.emplace(num_elems, num_elems));
+        ++num_elems;
+    }
+    REQUIRE(unit_test_internals_view::hashpower(table) == hp + 2);
+
+    std::atomic<int> missing(0);
+    std::thread reader([&table, &missing, num_elems] {
+        for (int i = 0; i < num_elems; ++i) {
+            if (table.find(i).value_or(-1) != i) {
+                ++missing;
+            }
+        }
+    });
+    for (int i = num_elems; i < num_elems + 10000; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    reader.join();
+    REQUIRE(missing == 0);
+
+    REQUIRE(table.make_unordered_map_view().size() == num_elems + 10000);
+    REQUIRE_FALSE(unit_test_internals_view::expansion_in_progress(table));
+    REQUIRE(unit_test_internals_view::hashpower(table) == hp + 2);
+    for (int i = 0; i < num_elems + 10000; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == i);
+    }
+}
+
+TEST_CASE("reserve", "[resize]") {
+    int_int_table table(8);
+    const int num_elems = 1000;
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    const int num_reserved = 200000;
+    const size_t hp = unit_test_internals_view::reserve_calc<int_int_table>(num_reserved);
+    table.reserve(num_reserved);
+    REQUIRE(unit_test_internals_view::hashpower(table) == hp);
+    REQUIRE(table.make_unordered_map_view().size() == num_elems);
+    REQUIRE(unit_test_internals_view::get_current_locks(table).size() ==
+            std::min(size_t(1) << hp, std::private_impl::MAX_NUM_LOCKS));
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == i);
+    }
+    // Reserving less than the current size changes nothing.
+    table.reserve(10);
+    REQUIRE(unit_test_internals_view::hashpower(table) == hp);
+    for (int i = num_elems; i < num_reserved; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    REQUIRE(unit_test_internals_view::hashpower(table) == hp);
+}
+
+#if defined(__linux__)
+TEST_CASE("growing in place", "[resize]") {
+    using mmap_table =
+        std::concurrent_unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+                                      std::mmap_allocator<std::pair<const int, int>>>;
+    mmap_table table(8);
+    // Large enough that the last doublings are incremental.
+    const int num_elems = 300000;
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i));
+        if (i % 1000 == 0) {
+            REQUIRE(table.find(i / 2).value_or(-1) == i / 2);
+        }
+    }
+    REQUIRE(unit_test_internals_view::hashpower(table) > 16);
+    REQUIRE(table.make_unordered_map_view().size() == num_elems);
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == i);
+    }
+}
+
+TEST_CASE("huge page backed table", "[resize]") {
+    using huge_page_table =
+        std::concurrent_unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+                                      std::huge_page_allocator<std::pair<const int, int>>>;
+    // Big enough that the bucket array outgrows a huge page.
+    huge_page_table table(8);
+    const int num_elems = 300000;
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    REQUIRE(unit_test_internals_view::hashpower(table) > 16);
+    REQUIRE(table.make_unordered_map_view().size() == num_elems);
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == i);
+    }
+    table.clear();
+    REQUIRE(table.find(0).value_or(-1) == -1);
+}
+
+TEST_CASE("interleaving a table that maps its own pages", "[resize]") {
+    // Heap memory is never interleaved, since the policy would outlive the
+    // table.
+    REQUIRE_FALSE(std::private_impl::maps_own_pages<std::allocator<int>>::value);
+    REQUIRE(std::private_impl::maps_own_pages<std::mmap_allocator<int>>::value);
+    REQUIRE(std::private_impl::maps_own_pages<std::huge_page_allocator<int>>::value);
+
+    using mmap_table =
+        std::concurrent_unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+                                      std::mmap_allocator<std::pair<const int, int>>>;
+    mmap_table table(8);
+    table.set_placement_policy(std::placement_policy::interleave);
+    const int num_elems = 100000;
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    REQUIRE(table.make_unordered_map_view().size() == num_elems);
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == i);
+    }
+}
+#endif
+
+TEST_CASE("shrink to fit", "[resize]") {
+    int_int_table table;
+    const int num_elems = 50000;
+    const int num_kept = 1000;
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    const size_t full_hp = unit_test_internals_view::hashpower(table);
+    for (int i = num_kept; i < num_elems; ++i) {
+        REQUIRE(table.erase(i) == 1);
+    }
+    REQUIRE(unit_test_internals_view::hashpower(table) == full_hp);
+
+    table.shrink_to_fit();
+    REQUIRE(unit_test_internals_view::hashpower(table) ==
+            unit_test_internals_view::reserve_calc<int_int_table>(num_kept));
+    REQUIRE(table.make_unordered_map_view().size() == num_kept);
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == (i < num_kept ? i : -1));
+    }
+    // The halved table still grows as usual.
+    for (int i = num_kept; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    REQUIRE(table.make_unordered_map_view().size() == num_elems);
+}
+
+TEST_CASE("shrink load factor", "[resize]") {
+    int_int_table table;
+    REQUIRE(table.shrink_load_factor() == std::private_impl::NO_AUTOMATIC_SHRINK);
+    REQUIRE_THROWS_AS(table.shrink_load_factor(-0.1), std::invalid_argument);
+    REQUIRE_THROWS_AS(table.shrink_load_factor(0.5), std::invalid_argument);
+    table.shrink_load_factor(0.1);
+    REQUIRE(table.shrink_load_factor() == 0.1);
+
+    const int num_elems = 100000;
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    const size_t full_hp = unit_test_internals_view::hashpower(table);
+    const int num_kept = 100;
+    for (int i = num_kept; i < num_elems; ++i) {
+        REQUIRE(table.erase(i) == 1);
+    }
+    // Creating the view waits for the background task.
+    REQUIRE(table.make_unordered_map_view().size() == num_kept);
+    REQUIRE(unit_test_internals_view::hashpower(table) < full_hp);
+    for (int i = 0; i < num_kept; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == i);
+    }
+}
+
+TEST_CASE("resize policy", "[resize]") {
+    int_int_table table;
+    const std::resize_policy defaults = table.get_resize_policy();
+    REQUIRE(defaults.maximum_load_factor == std::private_impl::NO_MAXIMUM_LOAD_FACTOR);
+    REQUIRE(defaults.growth_power == std::private_impl::DEFAULT_GROWTH_POWER);
+    REQUIRE(defaults.minimum_load_factor == std::private_impl::DEFAULT_MINIMUM_LOAD_FACTOR);
+    REQUIRE(defaults.maximum_hashpower == std::private_impl::NO_MAXIMUM_HASHPOWER);
+
+    table.minimum_load_factor(0.01);
+    REQUIRE(table.minimum_load_factor() == 0.01);
+    REQUIRE_THROWS_AS(table.minimum_load_factor(1.5), std::invalid_argument);
+    REQUIRE_THROWS_AS(table.maximum_load_factor(0.005), std::invalid_argument);
+    REQUIRE_THROWS_AS(table.growth_power(0), std::invalid_argument);
+    REQUIRE_THROWS_AS(table.maximum_hashpower(0), std::invalid_argument);
+    REQUIRE(table.minimum_load_factor() == 0.01);
+    REQUIRE(table.growth_power() == 1);
+
+    SECTION("growth power") {
+        int_int_table small(8);
+        const size_t initial_hp = unit_test_internals_view::hashpower(small);
+        small.growth_power(2);
+        for (int i = 0; i < 10000; ++i) {
+            REQUIRE(small.emplace(i, i));
+        }
+        const size_t hp = unit_test_internals_view::hashpower(small);
+        REQUIRE(hp > initial_hp);
+        REQUIRE((hp - initial_hp) % 2 == 0);
+        for (int i = 0; i < 10000; ++i) {
+            REQUIRE(small.find(i).value_or(-1) == i);
+        }
+    }
+
+    SECTION("maximum load factor") {
+        // Filling three quarters of the table finds room for every key, so
+        // only the maximum load factor makes it grow.
+        const int num_elems = 12000;
+        int_int_table small(16384);
+        const size_t initial_hp = unit_test_internals_view::hashpower(small);
+        small.maximum_load_factor(0.5);
+        for (int i = 0; i < num_elems; ++i) {
+            REQUIRE(small.emplace(i, i));
+        }
+        // Creating the view waits for the background task.
+        REQUIRE(small.make_unordered_map_view().size() == num_elems);
+        REQUIRE(unit_test_internals_view::hashpower(small) > initial_hp);
+        for (int i = 0; i < num_elems; ++i) {
+            REQUIRE(small.find(i).value_or(-1) == i);
+        }
+    }
+}
+
+TEST_CASE("maintenance thread", "[resize]") {
+    const int num_elems = 12000;
+    int_int_table table(16384);
+    const size_t initial_hp = unit_test_internals_view::hashpower(table);
+    table.maximum_load_factor(0.5);
+    table.shrink_load_factor(0.1);
+    REQUIRE(!table.maintenance_running());
+    table.start_maintenance(std::chrono::milliseconds(1));
+    REQUIRE(table.maintenance_running());
+
+    auto wait_for_hashpower = [&table](bool grown, size_t hp) {
+        for (int i = 0; i < 5000; ++i) {
+            const size_t current = unit_test_internals_view::hashpower(table);
+            if (grown ? current > hp : current < hp) {
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return false;
+    };
+
+    for (int i = 0; i < num_elems; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    REQUIRE(wait_for_hashpower(true, initial_hp));
+    const size_t grown_hp = unit_test_internals_view::hashpower(table);
+    for (int i = 100; i < num_elems; ++i) {
+        REQUIRE(table.erase(i) == 1);
+    }
+    REQUIRE(wait_for_hashpower(false, grown_hp));
+
+    table.stop_maintenance();
+    REQUIRE(!table.maintenance_running());
+    REQUIRE(table.make_unordered_map_view().size() == 100);
+    for (int i = 0; i < 100; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == i);
+    }
+}
+
+TEST_CASE("views lock the table while maintenance runs", "[resize]") {
+    int_int_table table(8);
+    table.start_maintenance(std::chrono::milliseconds(1));
+    std::atomic<bool> inserted(false);
+    std::thread writer;
+    {
+        auto view = table.make_unordered_map_view();
+        writer = std::thread([&table, &inserted]() {
+            table.emplace(1, 1);
+            inserted = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        REQUIRE(!inserted);
+        REQUIRE(view.size() == 0);
+    }
+    writer.join();
+    REQUIRE(inserted);
+    table.stop_maintenance();
+    REQUIRE(table.find(1).value_or(-1) == 1);
+}
+
+TEST_CASE("retired lock arrays are freed", "[resize]") {
+    int_int_table table(8);
+    for (int i = 0; i < 100000; ++i) {
+        REQUIRE(table.emplace(i, i));
+    }
+    // Each doubling replaced the lock array. Making a view frees the ones no
+    // thread can be looking at anymore, which with no other threads is all of
+    // them.
+    REQUIRE(table.make_unordered_map_view().size() == 100000);
+    REQUIRE(unit_test_internals_view::num_allocated_locks(table) ==
+            unit_test_internals_view::get_current_locks(table).size());
+    for (int i = 0; i < 100000; ++i) {
+        REQUIRE(table.find(i).value_or(-1) == i);
+    }
+}
+
+TEST_CASE("placement policy", "[resize]") {
+    for (const std::placement_policy policy :
+         {std::placement_policy::local, std::placement_policy::parallel_first_touch,
+          std::placement_policy::interleave}) {
+        int_int_table table(8);
+        REQUIRE(table.get_placement_policy() == std::placement_policy::local);
+        table.set_placement_policy(policy);
+        REQUIRE(table.get_placement_policy() == policy);
+        for (int i = 0; i < 100000; ++i) {
+            REQUIRE(table.emplace(i, i));
+        }
+        for (int i = 0; i < 100000; ++i) {
+            REQUIRE(table.find(i).value_or(-1) == i);
+        }
+        const size_t hp = unit_test_internals_view::hashpower(table);
+        table.make_unordered_map_view().rehash(hp + 2);
+        REQUIRE(unit_test_internals_view::hashpower(table) == hp + 2);
+        REQUIRE(table.get_placement_policy() == policy);
+        REQUIRE(table.make_unordered_map_view().size() == 100000);
+        REQUIRE(table.find(99999).value_or(-1) == 99999);
+    }
 }
 
 // Taken from https://github.com/facebook/folly/blob/master/folly/docs/Traits.md
@@ -0,0 +1,81 @@
+#include <catch.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <stdexcept>
+#include <vector>
+
+#include "unit_test_util.hpp"
+
+using std::private_impl::worker_pool;
+
+TEST_CASE("worker pool covers the range once", "[worker pool]") {
+    worker_pool& pool = worker_pool::instance();
+    REQUIRE(pool.concurrency() >= 1);
+    REQUIRE(pool.concurrency() <= std::private_impl::available_cpus());
+
+    const size_t num_elems = 100000;
+    std::vector<std::atomic<int>> visits(num_elems);
+    for (auto& v : visits) {
+        v = 0;
+    }
+    pool.run(10, num_elems, [&visits](size_t start, size_t end, std::exception_ptr&) {
+        for (; start < end; ++start) {
+            ++visits[start];
+        }
+    });
+    for (size_t i = 0; i < num_elems; ++i) {
+        REQUIRE(visits[i] == (i < 10 ? 0 : 1));
+    }
+}
+
+TEST_CASE("worker pool runs nested ranges", "[worker pool]") {
+    worker_pool& pool = worker_pool::instance();
+    std::atomic<size_t> total(0);
+    pool.run(0, 10000, [&pool, &total](size_t start, size_t end, std::exception_ptr&) {
+        pool.run(start, end, [&total](size_t start, size_t end, std::exception_ptr&) {
+            total += end - start;
+        });
+    });
+    REQUIRE(total == 10000);
+}
+
+TEST_CASE("worker pool rethrows exceptions", "[worker pool]") {
+    worker_pool& pool = worker_pool::instance();
+    auto failing = [](size_t start, size_t, std::exception_ptr& eptr) {
+        try {
+            if (start == 0) {
+                throw std::runtime_error("first chunk");
+            }
+        } catch (...) {
+            eptr = std::current_exception();
+        }
+    };
+    REQUIRE_THROWS_AS(pool.run(0, 100000, failing), std::runtime_error);
+    REQUIRE_THROWS_AS(pool.run(0, 10, failing), std::runtime_error);
+
+    // The pool is usable again afterwards.
+    std::atomic<size_t> total(0);
+    pool.run(0, 100000, [&total](size_t start, size_t end, std::exception_ptr&) {
+        total += end - start;
+    });
+    REQUIRE(total == 100000);
+}
+
+TEST_CASE("worker pool rethrows escaping exceptions", "[worker pool]") {
+    worker_pool& pool = worker_pool::instance();
+    auto throwing = [](size_t start, size_t, std::exception_ptr&) {
+        if (start == 0) {
+            throw std::runtime_error("first chunk");
+        }
+    };
+    REQUIRE_THROWS_AS(pool.run(0, 100000, throwing), std::runtime_error);
+
+    // The next run still gets the workers rather than running inline.
+    std::atomic<size_t> total(0);
+    pool.run(0, 100000, [&total](size_t start, size_t end, std::exception_ptr&) {
+        total += end - start;
+    });
+    REQUIRE(total == 100000);
+}
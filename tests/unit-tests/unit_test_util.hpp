@@ -7,6 +7,7 @@
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <new>
 #include <string>
 #include <utility>
@@ -156,13 +157,39 @@ public:
 
     template<class concurrent_map>
     static typename concurrent_map::locks_t& get_current_locks(const concurrent_map& table) {
-        return table.locks;
+        return table.get_current_locks();
     }
 
     template<class concurrent_map>
     static typename concurrent_map::size_type hashpower(const concurrent_map& table) {
         return table.hashpower();
     }
+
+    template<class concurrent_map>
+    static typename concurrent_map::size_type stash_size(const concurrent_map& table) {
+        return table.stash_count.load();
+    }
+
+    template<class concurrent_map>
+    static std::mutex& stash_mutex(const concurrent_map& table) {
+        return table.stash_mutex;
+    }
+
+    template<class concurrent_map>
+    static bool expansion_in_progress(const concurrent_map& table) {
+        return table.expansion_in_progress();
+    }
+
+    // Total number of locks held by the lock arrays of the table, retired
+    // ones included.
+    template<class concurrent_map>
+    static size_t num_allocated_locks(const concurrent_map& table) {
+        size_t n = 0;
+        for (const auto& locks : table.all_locks) {
+            n += locks.capacity();
+        }
+        return n;
+    }
 };
 
 #endif // UNIT_TEST_UTIL_HH_